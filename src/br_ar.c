@@ -44,6 +44,7 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 
 /* Windows-specific includes before unistd.h to avoid conflicts */
 #ifdef _WIN32
@@ -53,6 +54,15 @@
 
 #include <unistd.h>
 
+#include "brarchive.h"
+#include "delta.h"
+#include "hash.h"
+#include "match.h"
+#include "serve.h"
+#include "stats.h"
+#include "uring.h"
+#include "verify.h"
+
 /* getopt should be available via unistd.h with _POSIX_C_SOURCE */
 /* If not available, declare it */
 #ifdef HAVE_GETOPT
@@ -62,6 +72,10 @@
 /* If compilation fails, we'll need to provide an implementation */
 #endif
 
+#ifdef HAVE_GETOPT_H
+#include <getopt.h>
+#endif
+
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
 #endif
@@ -92,6 +106,38 @@
 #include <errno.h>
 #endif
 
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+/* Directory walk relative to directory fds */
+#if defined(HAVE_OPENAT) && defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+#define USE_DIRFD_WALK 1
+#ifndef O_DIRECTORY
+#define O_DIRECTORY 0
+#endif
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#else
+#define USE_DIRFD_WALK 0
+#endif
+
+/* Extraction relative to cached directory fds */
+#if USE_DIRFD_WALK && defined(HAVE_MKDIRAT)
+#define USE_DIRFD_EXTRACT 1
+#else
+#define USE_DIRFD_EXTRACT 0
+#endif
+
 /* Define PATH_MAX if not available */
 #ifndef PATH_MAX
 #ifdef _WIN32
@@ -112,33 +158,40 @@ static int mkdir_with_mode(const char *path, mode_t mode) {
 #define mkdir(path, mode) mkdir_with_mode(path, mode)
 #endif
 
-/* Platform-specific endian headers */
-#if defined(HAVE_DARWIN_ENDIAN) && defined(HAVE_LIBKERN_OSBYTEORDER_H)
-#include <libkern/OSByteOrder.h>
-#endif
-
-#if defined(HAVE_FREEBSD_ENDIAN) && defined(HAVE_SYS_ENDIAN_H)
-#include <sys/endian.h>
-#endif
-
-#if defined(HAVE_OPENBSD_ENDIAN) && defined(HAVE_SYS_ENDIAN_H)
-#include <sys/endian.h>
-#endif
-
-#if defined(HAVE_LINUX_ENDIAN) && defined(HAVE_ENDIAN_H)
-#include <endian.h>
-#include <byteswap.h>
-#endif
-
-#define MAGIC 0x267052A0B125277DULL
-#define ARCHIVE_VERSION 1
-#define HEADER_SIZE 16
-#define ENTRY_SIZE 256
-#define MAX_NAME_LEN 247
-
 /* Option flags (matching ar behavior) */
 #define OPT_C 0x01  /* Suppress "creating archive" message */
 #define OPT_V 0x02  /* Verbose mode */
+#define OPT_U 0x04  /* Update: only read files that changed */
+#define OPT_DEDUP 0x08  /* Share one data range between identical members */
+#define OPT_SUM 0x10    /* Write a checksum file next to the archive */
+#define OPT_SKIP 0x20   /* Leave files that already have a member's contents */
+
+/* Streaming transfer buffer (see --max-memory) */
+#define DEFAULT_IO_BUFFER (1024 * 1024)
+#define MIN_IO_BUFFER     (4 * 1024)
+
+/* Long-only option codes */
+#define LOPT_MAX_MEMORY 256
+#define LOPT_DEDUP      257
+#define LOPT_STATS      258
+#define LOPT_TRACE      259
+#define LOPT_SERVE      260
+#define LOPT_IO         261
+#define LOPT_COMPRESS   262
+#define LOPT_LEVEL      263
+#define LOPT_DIFF       264
+#define LOPT_DELTA      265
+#define LOPT_APPLY      266
+#define LOPT_MERGE      267
+#define LOPT_REPACK     268
+#define LOPT_ALIGN      269
+#define LOPT_SPLIT      270
+#define LOPT_SUM        271
+#define LOPT_SKIP       272
+
+/* I/O backends for bulk extract and create (see --io) */
+#define IO_SYNC  0
+#define IO_URING 1
 
 /* Old-school struct naming */
 struct br_ar_header {
@@ -146,189 +199,392 @@ struct br_ar_header {
     uint32_t version;
 };
 
+/* Entry with its name copied out and NUL-terminated, for printing and matching */
 struct br_ar_entry {
-    char name[248];  /* 1 byte length + 247 bytes name */
-    uint8_t name_len;
-    uint32_t contents_offset;
-    uint32_t contents_len;
+    struct brarchive_entry view;
+    char name[BRARCHIVE_MAX_NAME + 1];
+};
+
+/* Hash map from names to indices; keys are borrowed, not copied */
+struct name_map {
+    const char **keys;
+    uint8_t *lens;
+    uint32_t *values;
+    size_t capacity;            /* Power of two, 0 when empty */
 };
 
 struct file_list {
     char **paths;
     char **names;
-    char **contents;
-    size_t *sizes;
+    uint64_t *sizes;
+    int64_t *mtimes;            /* Nanoseconds since the epoch */
     size_t count;
     size_t capacity;
 };
 
-/* Endian conversion functions */
-#if USE_PLATFORM_ENDIAN
+/* Size of the buffer used to stream member data */
+static size_t io_buffer_size = DEFAULT_IO_BUFFER;
 
-#if defined(HAVE_DARWIN_ENDIAN)
-/* Darwin/macOS endian operations */
-static inline void write_u32_le(uint8_t *buf, uint32_t value) {
-    uint32_t le = OSSwapHostToLittleInt32(value);
-    memcpy(buf, &le, 4);
-}
+static int io_backend = IO_SYNC;
 
-static inline void write_u64_le(uint8_t *buf, uint64_t value) {
-    uint64_t le = OSSwapHostToLittleInt64(value);
-    memcpy(buf, &le, 8);
-}
+/* Output compression (--compress, -1 to go by the archive name), level and workers */
+static int compress_method = -1;
+static int compress_level = 0;
+static int compress_threads = 1;
 
-static inline uint32_t read_u32_le(const uint8_t *buf) {
-    uint32_t le;
-    memcpy(&le, buf, 4);
-    return OSSwapLittleToHostInt32(le);
-}
+/* --align: non-empty members start at file offsets that are multiples of this (0 for none) */
+static uint64_t data_align = 0;
 
-static inline uint64_t read_u64_le(const uint8_t *buf) {
-    uint64_t le;
-    memcpy(&le, buf, 8);
-    return OSSwapLittleToHostInt64(le);
-}
+/* --split: largest volume to write, 0 for a single archive */
+static uint64_t split_size = 0;
 
-#elif defined(HAVE_FREEBSD_ENDIAN) || defined(HAVE_OPENBSD_ENDIAN)
-/* FreeBSD/OpenBSD endian operations */
-static inline void write_u32_le(uint8_t *buf, uint32_t value) {
-    uint32_t le = htole32(value);
-    memcpy(buf, &le, 4);
-}
+/* Extractions running side by side, which share the directory fd budget */
+static int extract_sharing = 1;
 
-static inline void write_u64_le(uint8_t *buf, uint64_t value) {
-    uint64_t le = htole64(value);
-    memcpy(buf, &le, 8);
-}
+#ifdef HAVE_IO_URING
+/* Operations --io=uring keeps in flight; each holds at most one fd */
+#define URING_SLOTS 256
+
+/* Tags in completion user_data: slot index, then what it was waiting for */
+#define SLOT_OPEN  0
+#define SLOT_RW    1
+#define SLOT_CLOSE 2
+#define SLOT_TAG(slot, op) (((uint64_t)(slot) << 2) | (op))
 
-static inline uint32_t read_u32_le(const uint8_t *buf) {
-    uint32_t le;
-    memcpy(&le, buf, 4);
-    return le32toh(le);
+/* Largest single read or write queued */
+#define URING_MAX_CHUNK (1U << 30)
+
+/* Slots for a ring, leaving most of the fd limit to directories and the archive */
+static unsigned io_slots(void) {
+    unsigned n = URING_SLOTS;
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < n) {
+        n = rl.rlim_cur / 4 > 0 ? (unsigned)(rl.rlim_cur / 4) : 1;
+    }
+#endif
+    return n;
 }
 
-static inline uint64_t read_u64_le(const uint8_t *buf) {
-    uint64_t le;
-    memcpy(&le, buf, 8);
-    return le64toh(le);
+/* The ring could not be set up: say so once and carry on synchronously */
+static void io_uring_unavailable(void) {
+    fprintf(stderr, "Warning: io_uring unavailable (%s), using synchronous I/O\n", strerror(errno));
+    io_backend = IO_SYNC;
 }
+#endif
 
-#elif defined(HAVE_LINUX_ENDIAN)
-/* Linux endian operations */
-static inline void write_u32_le(uint8_t *buf, uint32_t value) {
-    uint32_t le = htole32(value);
-    memcpy(buf, &le, 4);
+#if !USE_DIRFD_EXTRACT
+/* Write buffer to file */
+static bool write_file(const char *path, const void *data, size_t size) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return false;
+    }
+    
+    size_t written = fwrite(data, 1, size, f);
+    fclose(f);
+    
+    return written == size;
 }
+#endif
 
-static inline void write_u64_le(uint8_t *buf, uint64_t value) {
-    uint64_t le = htole64(value);
-    memcpy(buf, &le, 8);
+/* Parse a byte count with an optional K, M or G suffix (powers of 1024) */
+static bool parse_size(const char *arg, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *arg == '-') {
+        return false;
+    }
+    
+    unsigned shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    default: break;
+    }
+    if (*end == 'i' && shift) {
+        end++;
+    }
+    if (*end == 'B' || *end == 'b') {
+        end++;
+    }
+    if (*end != '\0' || (shift && value > (UINT64_MAX >> shift))) {
+        return false;
+    }
+    
+    *out = (uint64_t)value << shift;
+    return true;
 }
 
-static inline uint32_t read_u32_le(const uint8_t *buf) {
-    uint32_t le;
-    memcpy(&le, buf, 4);
-    return le32toh(le);
+/* Size the map for count keys, keeping it at most half full */
+static bool name_map_init(struct name_map *m, size_t count) {
+    size_t capacity = 16;
+    while (capacity < count * 2) {
+        capacity *= 2;
+    }
+    m->keys = calloc(capacity, sizeof(const char *));
+    m->lens = malloc(capacity);
+    m->values = malloc(capacity * sizeof(uint32_t));
+    if (!m->keys || !m->lens || !m->values) {
+        free(m->keys);
+        free(m->lens);
+        free(m->values);
+        memset(m, 0, sizeof(*m));
+        return false;
+    }
+    m->capacity = capacity;
+    return true;
 }
 
-static inline uint64_t read_u64_le(const uint8_t *buf) {
-    uint64_t le;
-    memcpy(&le, buf, 8);
-    return le64toh(le);
+static void name_map_free(struct name_map *m) {
+    free(m->keys);
+    free(m->lens);
+    free(m->values);
+    memset(m, 0, sizeof(*m));
 }
 
-#else
-/* Fallback to generic implementation */
-#define USE_PLATFORM_ENDIAN 0
-#endif
+/* Insert a key unless it is already present (the first one wins) */
+static void name_map_put(struct name_map *m, const char *key, size_t len, uint32_t value) {
+    size_t mask = m->capacity - 1;
+    size_t i = (size_t)name_hash(key, len) & mask;
+    while (m->keys[i]) {
+        if (m->lens[i] == len && memcmp(m->keys[i], key, len) == 0) {
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    m->keys[i] = key;
+    m->lens[i] = (uint8_t)len;
+    m->values[i] = value;
+}
 
-#endif /* USE_PLATFORM_ENDIAN */
+static bool name_map_get(const struct name_map *m, const char *key, size_t len, uint32_t *value) {
+    if (m->capacity == 0 || len > BRARCHIVE_MAX_NAME) {
+        return false;
+    }
+    size_t mask = m->capacity - 1;
+    size_t i = (size_t)name_hash(key, len) & mask;
+    while (m->keys[i]) {
+        if (m->lens[i] == len && memcmp(m->keys[i], key, len) == 0) {
+            *value = m->values[i];
+            return true;
+        }
+        i = (i + 1) & mask;
+    }
+    return false;
+}
 
-#if !USE_PLATFORM_ENDIAN
-/* Generic portable endian operations */
-static void write_u32_le(uint8_t *buf, uint32_t value) {
-    buf[0] = (uint8_t)(value & 0xFF);
-    buf[1] = (uint8_t)((value >> 8) & 0xFF);
-    buf[2] = (uint8_t)((value >> 16) & 0xFF);
-    buf[3] = (uint8_t)((value >> 24) & 0xFF);
+/* Whether an archive path means standard input or output */
+static bool is_stdio(const char *path) {
+    return strcmp(path, "-") == 0;
 }
 
-static void write_u64_le(uint8_t *buf, uint64_t value) {
-    buf[0] = (uint8_t)(value & 0xFF);
-    buf[1] = (uint8_t)((value >> 8) & 0xFF);
-    buf[2] = (uint8_t)((value >> 16) & 0xFF);
-    buf[3] = (uint8_t)((value >> 24) & 0xFF);
-    buf[4] = (uint8_t)((value >> 32) & 0xFF);
-    buf[5] = (uint8_t)((value >> 40) & 0xFF);
-    buf[6] = (uint8_t)((value >> 48) & 0xFF);
-    buf[7] = (uint8_t)((value >> 56) & 0xFF);
+/* Open an archive ("-" reads stdin), reporting failures on stderr */
+static brarchive *open_archive(const char *path, int hint) {
+    brarchive *ar;
+    int err = is_stdio(path) ? brarchive_open_stream(&ar, stdin, path, hint) : brarchive_open(&ar, path, hint);
+    
+    switch (err) {
+    case BRARCHIVE_OK:
+        return ar;
+    case BRARCHIVE_ESMALL:
+        fprintf(stderr, "Archive too small\n");
+        break;
+    case BRARCHIVE_EMAGIC:
+        fprintf(stderr, "Invalid magic number: %s\n", path);
+        break;
+    case BRARCHIVE_ENOTSUP:
+        fprintf(stderr, "Compression method not supported by this build: %s\n", path);
+        break;
+    case BRARCHIVE_ENOMEM:
+        fprintf(stderr, "Memory allocation failed\n");
+        break;
+    default:
+        fprintf(stderr, "Failed to read archive: %s\n", path);
+        break;
+    }
+    return NULL;
 }
 
-static uint32_t read_u32_le(const uint8_t *buf) {
-    return (uint32_t)buf[0] |
-           ((uint32_t)buf[1] << 8) |
-           ((uint32_t)buf[2] << 16) |
-           ((uint32_t)buf[3] << 24);
+/* Describe an entry; false if its descriptor is invalid */
+static bool read_entry(const brarchive *ar, uint32_t index, struct br_ar_entry *entry) {
+    if (brarchive_entry(ar, index, &entry->view) != BRARCHIVE_OK) {
+        return false;
+    }
+    memcpy(entry->name, entry->view.name, entry->view.name_len);
+    entry->name[entry->view.name_len] = '\0';
+    return true;
 }
 
-static uint64_t read_u64_le(const uint8_t *buf) {
-    return (uint64_t)buf[0] |
-           ((uint64_t)buf[1] << 8) |
-           ((uint64_t)buf[2] << 16) |
-           ((uint64_t)buf[3] << 24) |
-           ((uint64_t)buf[4] << 32) |
-           ((uint64_t)buf[5] << 40) |
-           ((uint64_t)buf[6] << 48) |
-           ((uint64_t)buf[7] << 56);
+static int index_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
 }
-#endif
 
-/* Read file contents into buffer */
-static char *read_file(const char *path, size_t *size) {
-    FILE *f = fopen(path, "rb");
-    if (!f) {
+/*
+ * Entries selected by a filter of exact names, in table order, found by
+ * name lookups instead of a pass over the entry table.  Returns NULL
+ * with *count 0 when the filter needs a full pass, or on failure.  Only
+ * a sorted table keeps every member of one name next to the one found.
+ */
+static uint32_t *lookup_members(brarchive *ar, const struct name_matcher *filter, size_t *count, bool *failed) {
+    *count = 0;
+    *failed = false;
+    if (!matcher_exact(filter) || !brarchive_sorted(ar)) {
         return NULL;
     }
     
-    fseek(f, 0, SEEK_END);
-    long file_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    
-    if (file_size < 0) {
-        fclose(f);
+    size_t capacity = filter->key_count;
+    uint32_t *indices = malloc(capacity * sizeof(uint32_t));
+    size_t k;
+    for (k = 0; indices && k < filter->key_capacity; k++) {
+        const char *name = filter->keys[k];
+        size_t len = name ? strlen(name) : 0;
+        struct brarchive_entry entry;
+        uint32_t i;
+        if (!name) {
+            continue;
+        }
+        int err = brarchive_find(ar, name, len, &i);
+        if (err == BRARCHIVE_ENOENT) {
+            continue;
+        }
+        if (err != BRARCHIVE_OK) {
+            free(indices);
+            indices = NULL;
+            break;
+        }
+        
+        do {
+            if (*count >= capacity) {
+                uint32_t *grown = realloc(indices, capacity * 2 * sizeof(uint32_t));
+                if (!grown) {
+                    free(indices);
+                    indices = NULL;
+                    break;
+                }
+                indices = grown;
+                capacity *= 2;
+            }
+            indices[(*count)++] = i++;
+        } while (brarchive_entry(ar, i, &entry) == BRARCHIVE_OK &&
+                 entry.name_len == len && memcmp(entry.name, name, len) == 0);
+    }
+    if (!indices) {
+        fprintf(stderr, "Memory allocation failed\n");
+        *count = 0;
+        *failed = true;
         return NULL;
     }
+    qsort(indices, *count, sizeof(uint32_t), index_cmp);
+    return indices;
+}
+
+/* Compression named by an archive's suffix (.gz or .zst) */
+static int path_compression(const char *path) {
+    size_t len = strlen(path);
+    if (len > 3 && strcmp(path + len - 3, ".gz") == 0) {
+        return BRARCHIVE_GZIP;
+    }
+    if (len > 4 && strcmp(path + len - 4, ".zst") == 0) {
+        return BRARCHIVE_ZSTD;
+    }
+    return BRARCHIVE_RAW;
+}
+
+/* Take stdout for an archive, and send what would be printed there to stderr */
+static FILE *claim_stdout(void) {
+    int fd;
+    FILE *f;
     
-    char *buf = malloc((size_t)file_size + 1);
-    if (!buf) {
-        fclose(f);
+    fflush(stdout);
+    if ((fd = dup(STDOUT_FILENO)) < 0) {
         return NULL;
     }
-    
-    size_t read = fread(buf, 1, (size_t)file_size, f);
-    fclose(f);
-    
-    if (read != (size_t)file_size) {
-        free(buf);
+    if (!(f = fdopen(fd, "wb")) || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        if (f) {
+            fclose(f);
+        } else {
+            close(fd);
+        }
         return NULL;
     }
-    
-    buf[file_size] = '\0';
-    *size = (size_t)file_size;
-    return buf;
+    return f;
 }
 
-/* Write buffer to file */
-static bool write_file(const char *path, const void *data, size_t size) {
-    FILE *f = fopen(path, "wb");
-    if (!f) {
-        return false;
+/* archive_path with a sidecar suffix appended */
+static char *sidecar_path(const char *archive_path, const char *suffix) {
+    size_t len = strlen(archive_path);
+    char *path = malloc(len + strlen(suffix) + 1);
+    if (path) {
+        memcpy(path, archive_path, len);
+        strcpy(path + len, suffix);
+    }
+    return path;
+}
+
+/* Checksum file next to an archive, see sum_save() */
+#define SUM_SUFFIX ".sum"
+
+/*
+ * Start writing an archive ("-" writes stdout), reporting failures on
+ * stderr.  It is compressed as --compress says, else as its name says,
+ * else like the archive it replaces (old, if any).
+ */
+static brarchive_writer *open_writer(const char *path, const brarchive *old) {
+    brarchive_writer *w;
+    int method = compress_method >= 0 ? compress_method : path_compression(path);
+    if (method == BRARCHIVE_RAW && compress_method < 0 && old) {
+        method = brarchive_compression(old);
+    }
+    int err = BRARCHIVE_EIO;
+    if (!is_stdio(path)) {
+        err = brarchive_writer_open(&w, path, io_buffer_size);
+    } else {
+        FILE *f = claim_stdout();
+        if (f) {
+            err = brarchive_writer_open_stream(&w, f, io_buffer_size);
+        }
+    }
+    if (err == BRARCHIVE_ENOMEM) {
+        fprintf(stderr, "Memory allocation failed\n");
+    } else if (err != BRARCHIVE_OK) {
+        fprintf(stderr, "Failed to create archive: %s\n", path);
+    }
+    if (err == BRARCHIVE_OK && method != BRARCHIVE_RAW &&
+        (err = brarchive_writer_compress(w, method, compress_level, compress_threads)) != BRARCHIVE_OK) {
+        if (err == BRARCHIVE_EINVAL) {
+            fprintf(stderr, "Invalid compression level: %d\n", compress_level);
+        } else {
+            fprintf(stderr, "Failed to set up compression for %s: %s\n", path, brarchive_strerror(err));
+        }
+        brarchive_writer_abort(w);
+    }
+    return err == BRARCHIVE_OK ? w : NULL;
+}
+
+/*
+ * Checksums of an archive that was just replaced would pass for the new
+ * one, so they go once it is in place; --sum writes them again.
+ */
+static void remove_sums(const char *path) {
+    char *sum = is_stdio(path) ? NULL : sidecar_path(path, SUM_SUFFIX);
+    if (sum) {
+        remove(sum);
+        free(sum);
     }
-    
-    size_t written = fwrite(data, 1, size, f);
-    fclose(f);
-    
-    return written == size;
+}
+
+/* Finish an archive from open_writer() */
+static int commit_writer(brarchive_writer *w, const char *path) {
+    int err = brarchive_writer_commit(w);
+    if (err == BRARCHIVE_OK) {
+        remove_sums(path);
+    }
+    return err;
 }
 
 /* File list operations */
@@ -337,8 +593,8 @@ static void file_list_init(struct file_list *list) {
     list->count = 0;
     list->paths = malloc(list->capacity * sizeof(char*));
     list->names = malloc(list->capacity * sizeof(char*));
-    list->contents = malloc(list->capacity * sizeof(char*));
-    list->sizes = malloc(list->capacity * sizeof(size_t));
+    list->sizes = malloc(list->capacity * sizeof(uint64_t));
+    list->mtimes = malloc(list->capacity * sizeof(int64_t));
 }
 
 static void file_list_free(struct file_list *list) {
@@ -346,21 +602,32 @@ static void file_list_free(struct file_list *list) {
     for (i = 0; i < list->count; i++) {
         free(list->paths[i]);
         free(list->names[i]);
-        free(list->contents[i]);
     }
     free(list->paths);
     free(list->names);
-    free(list->contents);
     free(list->sizes);
+    free(list->mtimes);
+}
+
+/* Modification time of a file in nanoseconds */
+static int64_t stat_mtime_ns(const struct stat *st) {
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtime * 1000000000;
+#endif
 }
 
-static bool file_list_add(struct file_list *list, const char *path, const char *name) {
+/* Record a file to archive; contents are streamed later, only size and mtime are kept */
+static bool file_list_add(struct file_list *list, const char *path, const char *name, uint64_t size, int64_t mtime) {
     if (list->count >= list->capacity) {
         list->capacity *= 2;
         list->paths = realloc(list->paths, list->capacity * sizeof(char*));
         list->names = realloc(list->names, list->capacity * sizeof(char*));
-        list->contents = realloc(list->contents, list->capacity * sizeof(char*));
-        list->sizes = realloc(list->sizes, list->capacity * sizeof(size_t));
+        list->sizes = realloc(list->sizes, list->capacity * sizeof(uint64_t));
+        list->mtimes = realloc(list->mtimes, list->capacity * sizeof(int64_t));
     }
     
 #ifdef HAVE_STRDUP
@@ -382,20 +649,51 @@ static bool file_list_add(struct file_list *list, const char *path, const char *
     }
 #endif
     
-    size_t size;
-    list->contents[list->count] = read_file(path, &size);
-    if (!list->contents[list->count]) {
-        free(list->paths[list->count]);
-        free(list->names[list->count]);
-        return false;
-    }
-    
     list->sizes[list->count] = size;
+    list->mtimes[list->count] = mtime;
     list->count++;
     return true;
 }
 
+/* One file list row, for sorting */
+struct file_row {
+    char *path;
+    char *name;
+    uint64_t size;
+    int64_t mtime;
+};
+
+static int file_row_cmp(const void *a, const void *b) {
+    return strcmp(((const struct file_row *)a)->name, ((const struct file_row *)b)->name);
+}
+
+/* Order files by member name, so the archive does not depend on readdir() order */
+static bool file_list_sort(struct file_list *list) {
+    struct file_row *rows = malloc((list->count + 1) * sizeof(struct file_row));
+    size_t i;
+    if (!rows) {
+        return false;
+    }
+    for (i = 0; i < list->count; i++) {
+        rows[i].path = list->paths[i];
+        rows[i].name = list->names[i];
+        rows[i].size = list->sizes[i];
+        rows[i].mtime = list->mtimes[i];
+    }
+    qsort(rows, list->count, sizeof(struct file_row), file_row_cmp);
+    for (i = 0; i < list->count; i++) {
+        list->paths[i] = rows[i].path;
+        list->names[i] = rows[i].name;
+        list->sizes[i] = rows[i].size;
+        list->mtimes[i] = rows[i].mtime;
+    }
+    free(rows);
+    return true;
+}
+
+#if !USE_DIRFD_WALK
 static void collect_files_recursive(const char *dir_path, const char *base_path, struct file_list *list) {
+    uint64_t span = TRACE_START();
     DIR *dir = opendir(dir_path);
     if (!dir) {
         return;
@@ -424,12 +722,12 @@ static void collect_files_recursive(const char *dir_path, const char *base_path,
                 relative_name[sizeof(relative_name) - 1] = '\0';
             }
             
-            if (strlen(relative_name) > MAX_NAME_LEN) {
+            if (strlen(relative_name) > BRARCHIVE_MAX_NAME) {
                 fprintf(stderr, "Warning: File name too long, skipping: %s\n", relative_name);
                 continue;
             }
             
-            file_list_add(list, full_path, relative_name);
+            file_list_add(list, full_path, relative_name, (uint64_t)st.st_size, stat_mtime_ns(&st));
         } else if (S_ISDIR(st.st_mode)) {
             char new_base[PATH_MAX];
             if (base_path) {
@@ -443,608 +741,4039 @@ static void collect_files_recursive(const char *dir_path, const char *base_path,
     }
     
     closedir(dir);
+    TRACE_SPAN("collect_files_recursive", dir_path, span);
 }
+#endif
 
-/* Create archive from directory */
-static bool create_archive(const char *archive_path, const char *dir_path, int options) {
-    struct file_list files;
-    file_list_init(&files);
-    
-    collect_files_recursive(dir_path, NULL, &files);
-    
-    if (files.count == 0) {
-        fprintf(stderr, "No files found in directory: %s\n", dir_path);
-        file_list_free(&files);
-        return false;
+#if USE_DIRFD_WALK
+/*
+ * Directory walk relative to directory fds.  Each directory becomes a
+ * node that one worker scans; subdirectories are queued for any worker to
+ * pick up.  Nodes keep their children in readdir() order, and the tree is
+ * flattened depth-first afterwards, so the member order and warnings are
+ * the same as a plain recursive walk regardless of thread count.
+ */
+#define WALK_FILE 0
+#define WALK_DIR  1
+#define WALK_LONG 2  /* Name too long, warned about when flattening */
+
+struct walk_dir;
+
+struct walk_item {
+    char *name;              /* Relative member name */
+    uint64_t size;
+    int64_t mtime;
+    int kind;
+    struct walk_dir *dir;    /* Subdirectory node for WALK_DIR */
+};
+
+struct walk_dir {
+    char *rel;               /* Path relative to the root, NULL for the root */
+    struct walk_item *items;
+    size_t count;
+    size_t capacity;
+    struct walk_dir *next;   /* Work queue link */
+};
+
+struct walk_state {
+    int root_fd;
+    struct walk_dir *queue;
+    size_t pending;          /* Directories queued or being scanned */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+static char *join_name(const char *prefix, const char *name) {
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    size_t name_len = strlen(name);
+    char *joined = malloc(prefix_len + name_len + 2);
+    if (!joined) {
+        return NULL;
     }
-    
-    /* Calculate total size needed */
-    size_t header_and_entries_size = HEADER_SIZE + (ENTRY_SIZE * files.count);
-    size_t data_offset = header_and_entries_size;
-    size_t total_data_size = 0;
+    if (prefix) {
+        memcpy(joined, prefix, prefix_len);
+        joined[prefix_len++] = '/';
+    }
+    memcpy(joined + prefix_len, name, name_len + 1);
+    return joined;
+}
+
+static struct walk_item *walk_dir_push(struct walk_dir *dir) {
+    if (dir->count >= dir->capacity) {
+        size_t capacity = dir->capacity ? dir->capacity * 2 : 16;
+        struct walk_item *items = realloc(dir->items, capacity * sizeof(struct walk_item));
+        if (!items) {
+            return NULL;
+        }
+        dir->items = items;
+        dir->capacity = capacity;
+    }
+    return &dir->items[dir->count++];
+}
+
+static void walk_dir_free(struct walk_dir *dir) {
     size_t i;
-    
-    for (i = 0; i < files.count; i++) {
-        total_data_size += files.sizes[i];
+    for (i = 0; i < dir->count; i++) {
+        if (dir->items[i].dir) {
+            walk_dir_free(dir->items[i].dir);
+        }
+        free(dir->items[i].name);
     }
-    
-    size_t total_size = header_and_entries_size + total_data_size;
-    uint8_t *archive = malloc(total_size);
-    if (!archive) {
-        fprintf(stderr, "Memory allocation failed\n");
-        file_list_free(&files);
-        return false;
+    free(dir->items);
+    free(dir->rel);
+    free(dir);
+}
+
+/* Read one directory; returns its new subdirectory nodes as a linked list */
+static struct walk_dir *walk_dir_scan(struct walk_state *state, struct walk_dir *dir) {
+    uint64_t span = TRACE_START();
+    struct walk_dir *subdirs = NULL;
+    int fd = openat(state->root_fd, dir->rel ? dir->rel : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return NULL;
     }
     
-    memset(archive, 0, total_size);
-    
-    /* Write header */
-    write_u64_le(archive, MAGIC);
-    write_u32_le(archive + 8, (uint32_t)files.count);
-    write_u32_le(archive + 12, ARCHIVE_VERSION);
-    
-    /* Write entry descriptors and calculate offsets */
-    size_t entry_offset = HEADER_SIZE;
-    size_t data_pos = data_offset;
-    
-    for (i = 0; i < files.count; i++) {
-        uint8_t name_len = (uint8_t)strlen(files.names[i]);
-        archive[entry_offset] = name_len;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
         
-        memcpy(archive + entry_offset + 1, files.names[i], name_len);
-        /* Rest is already zeroed */
+        /* Trust d_type when the filesystem provides it; directories need no stat */
+        bool is_dir = false;
+        struct stat st;
+        st.st_size = 0;
+#ifdef HAVE_STRUCT_DIRENT_D_TYPE
+        if (entry->d_type == DT_DIR) {
+            is_dir = true;
+        } else if (entry->d_type == DT_REG) {
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+        } else if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+            continue;
+        } else
+#endif
+        {
+            if (fstatat(fd, entry->d_name, &st, 0) != 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                is_dir = true;
+            } else if (!S_ISREG(st.st_mode)) {
+                continue;
+            }
+        }
         
-        /* contents_offset is relative to data block start */
-        write_u32_le(archive + entry_offset + 248, (uint32_t)(data_pos - data_offset));
-        write_u32_le(archive + entry_offset + 252, (uint32_t)files.sizes[i]);
+        char *rel = join_name(dir->rel, entry->d_name);
+        if (!rel) {
+            continue;
+        }
+        struct walk_item *item = walk_dir_push(dir);
+        if (!item) {
+            free(rel);
+            continue;
+        }
+        item->name = rel;
+        item->size = (uint64_t)st.st_size;
+        item->mtime = is_dir ? 0 : stat_mtime_ns(&st);
+        item->dir = NULL;
+        item->kind = WALK_FILE;
         
-        data_pos += files.sizes[i];
-        entry_offset += ENTRY_SIZE;
-    }
-    
-    /* Write file contents */
-    data_pos = data_offset;
-    for (i = 0; i < files.count; i++) {
-        memcpy(archive + data_pos, files.contents[i], files.sizes[i]);
-        data_pos += files.sizes[i];
-    }
-    
-    bool success = write_file(archive_path, archive, total_size);
-    
-    free(archive);
-    file_list_free(&files);
-    
-    if (success) {
-        if (!(options & OPT_C)) {
-            printf("Created archive: %s (%zu files)\n", archive_path, files.count);
+        if (is_dir) {
+            struct walk_dir *sub = calloc(1, sizeof(struct walk_dir));
+            char *sub_rel = join_name(dir->rel, entry->d_name);
+            if (!sub || !sub_rel) {
+                free(sub);
+                free(sub_rel);
+                free(rel);
+                dir->count--;
+                continue;
+            }
+            sub->rel = sub_rel;
+            sub->next = subdirs;
+            subdirs = sub;
+            item->kind = WALK_DIR;
+            item->dir = sub;
+        } else if (strlen(rel) > BRARCHIVE_MAX_NAME) {
+            item->kind = WALK_LONG;
         }
     }
     
-    return success;
+    closedir(d);
+    TRACE_SPAN("walk_dir_scan", dir->rel ? dir->rel : ".", span);
+    return subdirs;
 }
 
-/* Extract archive to directory (with optional file filter) */
-static bool extract_archive(const char *archive_path, const char *dir_path, char **file_filter, int filter_count, int options) {
-    size_t archive_size;
-    uint8_t *archive_data = (uint8_t*)read_file(archive_path, &archive_size);
-    if (!archive_data) {
-        fprintf(stderr, "Failed to read archive: %s\n", archive_path);
-        return false;
-    }
-    
-    if (archive_size < HEADER_SIZE) {
-        fprintf(stderr, "Archive too small\n");
-        free(archive_data);
-        return false;
-    }
-    
-    /* Read header */
-    uint64_t magic = read_u64_le(archive_data);
-    if (magic != MAGIC) {
-        fprintf(stderr, "Invalid magic number: 0x%016llx\n", (unsigned long long)magic);
-        free(archive_data);
+static void walk_lock(struct walk_state *state) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&state->lock);
+#else
+    (void)state;
+#endif
+}
+
+static void walk_unlock(struct walk_state *state) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&state->lock);
+#else
+    (void)state;
+#endif
+}
+
+/* Scan queued directories until the whole tree has been read */
+static void *walk_worker(void *arg) {
+    struct walk_state *state = arg;
+    
+    walk_lock(state);
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        while (!state->queue && state->pending > 0) {
+            pthread_cond_wait(&state->cond, &state->lock);
+        }
+#endif
+        if (!state->queue) {
+            break;
+        }
+        struct walk_dir *dir = state->queue;
+        state->queue = dir->next;
+        walk_unlock(state);
+        
+        struct walk_dir *subdirs = walk_dir_scan(state, dir);
+        
+        walk_lock(state);
+        while (subdirs) {
+            struct walk_dir *next = subdirs->next;
+            subdirs->next = state->queue;
+            state->queue = subdirs;
+            state->pending++;
+            subdirs = next;
+        }
+        state->pending--;
+#ifdef HAVE_PTHREAD
+        pthread_cond_broadcast(&state->cond);
+#endif
+    }
+    walk_unlock(state);
+    return NULL;
+}
+
+/* Append the tree to the file list in depth-first readdir order */
+static void walk_flatten(const struct walk_dir *dir, const char *dir_path, struct file_list *list) {
+    uint64_t span = TRACE_START();
+    size_t i;
+    for (i = 0; i < dir->count; i++) {
+        const struct walk_item *item = &dir->items[i];
+        if (item->kind == WALK_DIR) {
+            walk_flatten(item->dir, dir_path, list);
+        } else if (item->kind == WALK_LONG) {
+            fprintf(stderr, "Warning: File name too long, skipping: %s\n", item->name);
+        } else {
+            char *full_path = join_name(dir_path, item->name);
+            if (full_path) {
+                file_list_add(list, full_path, item->name, item->size, item->mtime);
+                free(full_path);
+            }
+        }
+    }
+    TRACE_SPAN("file_list_add", dir->rel ? dir->rel : ".", span);
+}
+
+static void collect_files(const char *dir_path, struct file_list *list, int threads) {
+    struct walk_state state;
+    state.root_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (state.root_fd < 0) {
+        return;
+    }
+    
+    struct walk_dir *root = calloc(1, sizeof(struct walk_dir));
+    if (!root) {
+        close(state.root_fd);
+        return;
+    }
+    state.queue = root;
+    state.pending = 1;
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    
+    pthread_t *workers = NULL;
+    int started = 0;
+    if (threads > 1) {
+        workers = malloc((size_t)(threads - 1) * sizeof(pthread_t));
+    }
+    while (workers && started < threads - 1 &&
+           pthread_create(&workers[started], NULL, walk_worker, &state) == 0) {
+        started++;
+    }
+#else
+    (void)threads;
+#endif
+    
+    /* The calling thread takes part in the walk */
+    walk_worker(&state);
+    
+#ifdef HAVE_PTHREAD
+    int t;
+    for (t = 0; t < started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    free(workers);
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+#endif
+    
+    close(state.root_fd);
+    walk_flatten(root, dir_path, list);
+    walk_dir_free(root);
+}
+#else
+static void collect_files(const char *dir_path, struct file_list *list, int threads) {
+    (void)threads;
+    collect_files_recursive(dir_path, NULL, list);
+}
+#endif /* USE_DIRFD_WALK */
+
+/*
+ * Update manifest, written next to the archive by -u.  It records the
+ * size and mtime each member's source file had when it was archived, plus
+ * the archive's own size, mtime and inode so a manifest left behind by
+ * another writer is ignored:
+ *
+ *   br-ar-manifest 1 <archive size> <archive mtime> <archive inode>
+ *   <size> <mtime> <name>
+ *   ...
+ *
+ * Times are in nanoseconds; -1 marks a file that was modified too close
+ * to the update to trust its mtime.
+ */
+#define MANIFEST_SUFFIX ".manifest"
+#define MANIFEST_TAG "br-ar-manifest 1"
+
+struct manifest {
+    char *text;                 /* File contents; names point into it */
+    struct name_map map;        /* Name to record index */
+    uint64_t *sizes;
+    int64_t *mtimes;
+    size_t count;
+};
+
+static void manifest_free(struct manifest *m) {
+    free(m->text);
+    free(m->sizes);
+    free(m->mtimes);
+    name_map_free(&m->map);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Load the manifest for an archive; false if it is missing, malformed or stale */
+static bool manifest_load(struct manifest *m, const char *archive_path) {
+    memset(m, 0, sizeof(*m));
+    char *path = sidecar_path(archive_path, MANIFEST_SUFFIX);
+    if (!path) {
+        return false;
+    }
+    FILE *f = fopen(path, "rb");
+    free(path);
+    if (!f) {
+        return false;
+    }
+    
+    struct stat st;
+    struct stat archive_st;
+    bool ok = fstat(fileno(f), &st) == 0 && st.st_size > 0 &&
+              stat(archive_path, &archive_st) == 0;
+    if (ok) {
+        m->text = malloc((size_t)st.st_size + 1);
+        ok = m->text && fread(m->text, 1, (size_t)st.st_size, f) == (size_t)st.st_size;
+    }
+    fclose(f);
+    if (!ok) {
+        manifest_free(m);
+        return false;
+    }
+    m->text[st.st_size] = '\0';
+    
+    /* One record per line after the header line */
+    size_t lines = 0;
+    char *p;
+    for (p = m->text; *p; p++) {
+        if (*p == '\n') {
+            *p = '\0';
+            lines++;
+        }
+    }
+    
+    unsigned long long archive_size;
+    long long archive_mtime;
+    unsigned long long archive_ino;
+    int used = 0;
+    if (sscanf(m->text, MANIFEST_TAG " %llu %lld %llu%n", &archive_size, &archive_mtime, &archive_ino, &used) != 3 ||
+        m->text[used] != '\0' ||
+        archive_size != (unsigned long long)archive_st.st_size ||
+        archive_mtime != (long long)stat_mtime_ns(&archive_st) ||
+        archive_ino != (unsigned long long)archive_st.st_ino) {
+        manifest_free(m);
+        return false;
+    }
+    
+    m->sizes = malloc((lines + 1) * sizeof(uint64_t));
+    m->mtimes = malloc((lines + 1) * sizeof(int64_t));
+    if (!m->sizes || !m->mtimes || !name_map_init(&m->map, lines)) {
+        manifest_free(m);
+        return false;
+    }
+    
+    char *end = m->text + st.st_size;
+    for (p = m->text + strlen(m->text) + 1; p < end; p += strlen(p) + 1) {
+        char *name;
+        unsigned long long size = strtoull(p, &name, 10);
+        long long mtime = strtoll(name, &name, 10);
+        if (*name++ != ' ' || strlen(name) > BRARCHIVE_MAX_NAME) {
+            continue;
+        }
+        m->sizes[m->count] = (uint64_t)size;
+        m->mtimes[m->count] = (int64_t)mtime;
+        name_map_put(&m->map, name, strlen(name), (uint32_t)m->count);
+        m->count++;
+    }
+    return true;
+}
+
+/* Record the sources of a freshly written archive */
+static bool manifest_save(const char *archive_path, const struct file_list *files, time_t started) {
+    struct stat archive_st;
+    if (stat(archive_path, &archive_st) != 0) {
+        return false;
+    }
+    char *path = sidecar_path(archive_path, MANIFEST_SUFFIX);
+    char *tmp_path = path ? malloc(strlen(path) + sizeof(".tmp")) : NULL;
+    FILE *f = NULL;
+    if (tmp_path) {
+        strcpy(tmp_path, path);
+        strcat(tmp_path, ".tmp");
+        f = fopen(tmp_path, "w");
+    }
+    if (!f) {
+        free(path);
+        free(tmp_path);
+        return false;
+    }
+    
+    /*
+     * A file modified in the same second the walk started could change
+     * again without its mtime moving on coarse-grained filesystems.
+     */
+    int64_t racy = ((int64_t)started - 1) * 1000000000;
+    size_t i;
+    fprintf(f, MANIFEST_TAG " %llu %lld %llu\n",
+            (unsigned long long)archive_st.st_size,
+            (long long)stat_mtime_ns(&archive_st),
+            (unsigned long long)archive_st.st_ino);
+    for (i = 0; i < files->count; i++) {
+        /* Names with newlines cannot be recorded; they are always re-read */
+        if (strchr(files->names[i], '\n')) {
+            continue;
+        }
+        fprintf(f, "%llu %lld %s\n",
+                (unsigned long long)files->sizes[i],
+                (long long)(files->mtimes[i] >= racy ? -1 : files->mtimes[i]),
+                files->names[i]);
+    }
+    
+    /* Replace the old manifest only once the new one is complete */
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+    if (ok) {
+        remove(path);
+    }
+#endif
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        ok = false;
+    }
+    free(path);
+    free(tmp_path);
+    return ok;
+}
+
+/*
+ * Checksum file, written next to the archive by -r --sum and read by
+ * -x --skip-unchanged.  It holds the hash of each member's contents in
+ * table order.  The archive's size and a hash of its entry table are
+ * recorded too, so the file still applies to a copy of the archive but
+ * not to a different one; br-ar removes it whenever it rewrites the
+ * archive, which could keep both:
+ *
+ *   br-ar-sum 1 <archive size> <table hash>
+ *   <hash> <name>
+ *   ...
+ *
+ * Hashes are content_hash() seeded with the member size, as 16 hex digits.
+ */
+#define SUM_TAG "br-ar-sum 1"
+
+static uint64_t member_sum(const void *data, uint64_t size) {
+    return content_hash(HASH_SEED ^ size, data, (size_t)size);
+}
+
+/* Hash of every entry's name, offset and size, laid out little-endian as in the file */
+static uint64_t table_sum(const brarchive *ar) {
+    uint32_t count = brarchive_count(ar);
+    uint64_t h = HASH_SEED ^ count;
+    uint32_t i;
+    int b;
+    for (i = 0; i < count; i++) {
+        struct brarchive_entry e;
+        uint8_t range[8];
+        if (brarchive_entry(ar, i, &e) != BRARCHIVE_OK) {
+            return 0;
+        }
+        for (b = 0; b < 4; b++) {
+            range[b] = (uint8_t)(e.offset >> (8 * b));
+            range[4 + b] = (uint8_t)(e.size >> (8 * b));
+        }
+        h = content_hash(h, range, sizeof(range));
+        h = content_hash(h, (const uint8_t *)e.name, e.name_len);
+    }
+    return h;
+}
+
+static int key_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Write the checksum file of an archive, reading its members back in data order */
+static bool sum_save(const char *archive_path) {
+    brarchive *ar = open_archive(archive_path, BRARCHIVE_READ_ALL);
+    if (!ar) {
+        return false;
+    }
+    uint32_t count = brarchive_count(ar);
+    uint64_t *hashes = malloc(((size_t)count + 1) * sizeof(uint64_t));
+    uint64_t *order = malloc(((size_t)count + 1) * sizeof(uint64_t));
+    bool ok = hashes && order && brarchive_table_count(ar) == count;
+    uint32_t i;
+    
+    /* Offset in the high half, index in the low, so a stream only reads forward */
+    for (i = 0; ok && i < count; i++) {
+        struct brarchive_entry e;
+        ok = brarchive_entry(ar, i, &e) == BRARCHIVE_OK;
+        order[i] = ok ? (uint64_t)e.offset << 32 | i : 0;
+    }
+    if (ok) {
+        qsort(order, count, sizeof(uint64_t), key_cmp);
+    }
+    for (i = 0; ok && i < count; i++) {
+        uint32_t k = (uint32_t)order[i];
+        struct brarchive_entry e;
+        const void *data;
+        ok = brarchive_entry(ar, k, &e) == BRARCHIVE_OK && brarchive_read(ar, &e, &data) == BRARCHIVE_OK;
+        hashes[k] = ok ? member_sum(data, e.size) : 0;
+    }
+    
+    struct stat archive_st;
+    char *path = sidecar_path(archive_path, SUM_SUFFIX);
+    char *tmp_path = path ? sidecar_path(path, ".tmp") : NULL;
+    FILE *f = NULL;
+    ok = ok && stat(archive_path, &archive_st) == 0 && tmp_path && (f = fopen(tmp_path, "w"));
+    if (ok) {
+        fprintf(f, SUM_TAG " %llu %016llx\n",
+                (unsigned long long)archive_st.st_size,
+                (unsigned long long)table_sum(ar));
+    }
+    for (i = 0; ok && i < count; i++) {
+        struct brarchive_entry e;
+        brarchive_entry(ar, i, &e);
+        fprintf(f, "%016llx %.*s\n", (unsigned long long)hashes[i], (int)e.name_len, e.name);
+    }
+    
+    /* Replace the old checksums only once the new ones are complete */
+    if (f) {
+        ok = !ferror(f) && ok;
+        ok = (fclose(f) == 0) && ok;
+#ifdef _WIN32
+        if (ok) {
+            remove(path);
+        }
+#endif
+        if (!ok || rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            ok = false;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to write checksums: %s\n", path ? path : archive_path);
+    }
+    free(path);
+    free(tmp_path);
+    free(order);
+    free(hashes);
+    brarchive_close(ar);
+    return ok;
+}
+
+/*
+ * Load the member hashes of an archive's checksum file, indexed by entry;
+ * NULL if it is missing, stale or does not match the entry table.
+ */
+static uint64_t *sum_load(const char *archive_path, brarchive *ar) {
+    char *path = sidecar_path(archive_path, SUM_SUFFIX);
+    FILE *f = path ? fopen(path, "r") : NULL;
+    free(path);
+    if (!f) {
+        return NULL;
+    }
+    
+    uint32_t count = brarchive_count(ar);
+    uint64_t *hashes = malloc(((size_t)count + 1) * sizeof(uint64_t));
+    char line[BRARCHIVE_MAX_NAME + 64];
+    unsigned long long archive_size;
+    unsigned long long table;
+    struct stat archive_st;
+    int used = 0;
+    bool ok = hashes && stat(archive_path, &archive_st) == 0 && fgets(line, sizeof(line), f) &&
+              sscanf(line, SUM_TAG " %llu %llx\n%n", &archive_size, &table, &used) == 2 &&
+              line[used] == '\0' &&
+              archive_size == (unsigned long long)archive_st.st_size &&
+              table == (unsigned long long)table_sum(ar);
+    uint32_t i;
+    
+    /* One line per entry, naming it */
+    for (i = 0; ok && i < count; i++) {
+        struct brarchive_entry e;
+        char *name;
+        ok = fgets(line, sizeof(line), f) && brarchive_entry(ar, i, &e) == BRARCHIVE_OK;
+        if (ok) {
+            hashes[i] = strtoull(line, &name, 16);
+            ok = name == line + 16 && *name++ == ' ' && strncmp(name, e.name, e.name_len) == 0 &&
+                 name[e.name_len] == '\n';
+        }
+    }
+    ok = ok && !fgets(line, sizeof(line), f);
+    fclose(f);
+    if (!ok) {
+        free(hashes);
+        return NULL;
+    }
+    return hashes;
+}
+
+/* Whether a file's contents equal len bytes of the archive at pos */
+static bool file_equals_range(const char *path, brarchive *ar, uint64_t pos, uint64_t len, uint8_t *buf, size_t buf_size) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        return false;
+    }
+    
+    size_t half = buf_size / 2;
+    bool same = true;
+    while (same && len > 0) {
+        size_t chunk = len < half ? (size_t)len : half;
+        const void *member = NULL;
+        if (fread(buf, 1, chunk, in) != chunk ||
+            brarchive_view(ar, pos, chunk, buf + half, &member) != BRARCHIVE_OK) {
+            same = false;
+        }
+        if (same && memcmp(buf, member, chunk) != 0) {
+            same = false;
+        }
+        pos += chunk;
+        len -= chunk;
+    }
+    fclose(in);
+    return same;
+}
+
+/* Update plan values besides an archive position */
+#define MEMBER_NEW     UINT64_MAX          /* Not in the old archive */
+#define MEMBER_CHANGED (UINT64_MAX - 1)    /* In the old archive, but modified */
+
+/*
+ * Decide which members of an update can be copied from the old archive.
+ * A file is unchanged when the manifest recorded the same size and mtime
+ * for it; without a usable manifest, same-size files are compared byte
+ * for byte with the old member instead.  Returns, per file, the archive
+ * position of the old contents or one of the MEMBER_* values.
+ */
+static uint64_t *plan_update(brarchive *old, const char *archive_path, const struct file_list *files,
+                             uint8_t *buf, size_t buf_size, size_t *reused) {
+    uint64_t *plan = malloc((files->count ? files->count : 1) * sizeof(uint64_t));
+    if (!plan) {
+        return NULL;
+    }
+    
+    struct manifest manifest;
+    bool have_manifest = manifest_load(&manifest, archive_path);
+    size_t i;
+    
+    *reused = 0;
+    for (i = 0; i < files->count; i++) {
+        struct brarchive_entry entry;
+        uint32_t index;
+        uint32_t record;
+        
+        plan[i] = MEMBER_NEW;
+        if (brarchive_find(old, files->names[i], strlen(files->names[i]), &index) != BRARCHIVE_OK) {
+            continue;
+        }
+        plan[i] = MEMBER_CHANGED;
+        if (brarchive_entry(old, index, &entry) != BRARCHIVE_OK || !brarchive_in_bounds(old, &entry) ||
+            entry.size != files->sizes[i]) {
+            continue;
+        }
+        
+        uint64_t pos = brarchive_data_start(old) + entry.offset;
+        bool unchanged;
+        if (have_manifest) {
+            unchanged = name_map_get(&manifest.map, files->names[i], strlen(files->names[i]), &record) &&
+                        manifest.sizes[record] == files->sizes[i] &&
+                        manifest.mtimes[record] != -1 &&
+                        manifest.mtimes[record] == files->mtimes[i];
+        } else {
+            unchanged = file_equals_range(files->paths[i], old, pos, entry.size, buf, buf_size);
+        }
+        if (unchanged) {
+            plan[i] = pos;
+            (*reused)++;
+        }
+    }
+    
+    if (have_manifest) {
+        manifest_free(&manifest);
+    }
+    return plan;
+}
+
+/* Contents of a member being created: the source file or an old archive range */
+struct member_source {
+    FILE *f;
+    brarchive *ar;
+    uint64_t pos;
+};
+
+static bool source_open(struct member_source *src, const struct file_list *files, size_t i,
+                        const uint64_t *plan, brarchive *old) {
+    src->f = NULL;
+    src->ar = NULL;
+    if (plan && plan[i] < MEMBER_CHANGED) {
+        src->ar = old;
+        src->pos = plan[i];
+        return true;
+    }
+    src->f = fopen(files->paths[i], "rb");
+    return src->f != NULL;
+}
+
+/* Next len bytes of the member; mapped archives return a view, not a copy */
+static const uint8_t *source_read(struct member_source *src, uint8_t *buf, size_t len) {
+    if (src->f) {
+        return fread(buf, 1, len, src->f) == len ? buf : NULL;
+    }
+    const void *data;
+    uint64_t pos = src->pos;
+    src->pos += len;
+    return brarchive_view(src->ar, pos, len, buf, &data) == BRARCHIVE_OK ? data : NULL;
+}
+
+static void source_close(struct member_source *src) {
+    if (src->f) {
+        fclose(src->f);
+    }
+}
+
+static bool source_hash(const struct file_list *files, size_t i, const uint64_t *plan,
+                        brarchive *old, uint8_t *buf, size_t buf_size, uint64_t *hash) {
+    struct member_source src;
+    uint64_t len = files->sizes[i];
+    uint64_t h = HASH_SEED ^ len;
+    bool ok = source_open(&src, files, i, plan, old);
+    
+    while (ok && len > 0) {
+        size_t chunk = len < buf_size ? (size_t)len : buf_size;
+        const uint8_t *data = source_read(&src, buf, chunk);
+        if (!data) {
+            ok = false;
+            break;
+        }
+        h = content_hash(h, data, chunk);
+        len -= chunk;
+    }
+    source_close(&src);
+    *hash = h;
+    return ok;
+}
+
+/* Byte-for-byte comparison of two same-size members */
+static bool sources_equal(const struct file_list *files, size_t a, size_t b, const uint64_t *plan,
+                          brarchive *old, uint8_t *buf, size_t buf_size) {
+    struct member_source sa, sb;
+    size_t half = buf_size / 2;
+    uint64_t len = files->sizes[a];
+    bool same = source_open(&sa, files, a, plan, old);
+    
+    if (!same) {
+        return false;
+    }
+    if (!source_open(&sb, files, b, plan, old)) {
+        source_close(&sa);
+        return false;
+    }
+    while (same && len > 0) {
+        size_t chunk = len < half ? (size_t)len : half;
+        const uint8_t *x = source_read(&sa, buf, chunk);
+        const uint8_t *y = source_read(&sb, buf + half, chunk);
+        same = x && y && memcmp(x, y, chunk) == 0;
+        len -= chunk;
+    }
+    source_close(&sa);
+    source_close(&sb);
+    return same;
+}
+
+struct dedup_key {
+    uint64_t size;
+    uint64_t hash;
+    size_t index;
+};
+
+static int dedup_key_cmp(const void *a, const void *b) {
+    const struct dedup_key *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * Find members with identical contents (--dedup).  Only files that share
+ * their size with another file are hashed; equal hashes are confirmed
+ * byte for byte before a member is pointed at an earlier one.  Returns,
+ * per file, the index of the earlier member whose range it shares, or
+ * SIZE_MAX.
+ */
+static size_t *dedup_members(const struct file_list *files, const uint64_t *plan, brarchive *old,
+                             uint8_t *buf, size_t buf_size, uint64_t *saved, size_t *shared) {
+    size_t *dup = malloc((files->count ? files->count : 1) * sizeof(size_t));
+    struct dedup_key *keys = malloc((files->count ? files->count : 1) * sizeof(struct dedup_key));
+    size_t *reps = malloc((files->count ? files->count : 1) * sizeof(size_t));
+    size_t i, k, n = 0;
+    
+    if (!dup || !keys || !reps) {
+        free(dup);
+        free(keys);
+        free(reps);
+        return NULL;
+    }
+    *saved = 0;
+    *shared = 0;
+    
+    /* Group by size first; empty files have nothing to share */
+    for (i = 0; i < files->count; i++) {
+        dup[i] = SIZE_MAX;
+        if (files->sizes[i] > 0) {
+            keys[n].size = files->sizes[i];
+            keys[n].hash = 0;
+            keys[n].index = i;
+            n++;
+        }
+    }
+    qsort(keys, n, sizeof(struct dedup_key), dedup_key_cmp);
+    
+    /* Hash files that share their size; unreadable ones are reported when written */
+    for (k = 0; k < n; k++) {
+        bool same_size = (k > 0 && keys[k - 1].size == keys[k].size) ||
+                         (k + 1 < n && keys[k + 1].size == keys[k].size);
+        keys[k].hash = 0;
+        if (!same_size || !source_hash(files, keys[k].index, plan, old, buf, buf_size, &keys[k].hash)) {
+            dup[keys[k].index] = 0;  /* Not a candidate, reset below */
+        }
+    }
+    size_t candidates = 0;
+    for (k = 0; k < n; k++) {
+        if (dup[keys[k].index] == SIZE_MAX) {
+            keys[candidates++] = keys[k];
+        } else {
+            dup[keys[k].index] = SIZE_MAX;
+        }
+    }
+    qsort(keys, candidates, sizeof(struct dedup_key), dedup_key_cmp);
+    
+    /* Within each (size, hash) group, keep distinct contents as representatives */
+    size_t start = 0;
+    while (start < candidates) {
+        size_t end = start + 1;
+        size_t rep_count = 1;
+        while (end < candidates && keys[end].size == keys[start].size && keys[end].hash == keys[start].hash) {
+            end++;
+        }
+        reps[0] = keys[start].index;
+        for (k = start + 1; k < end; k++) {
+            size_t r;
+            for (r = 0; r < rep_count; r++) {
+                if (sources_equal(files, reps[r], keys[k].index, plan, old, buf, buf_size)) {
+                    break;
+                }
+            }
+            if (r < rep_count) {
+                dup[keys[k].index] = reps[r];
+                *saved += keys[k].size;
+                (*shared)++;
+            } else {
+                reps[rep_count++] = keys[k].index;
+            }
+        }
+        start = end;
+    }
+    
+    free(keys);
+    free(reps);
+    return dup;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * Read-ahead for create with --io=uring.  Small files that must be read
+ * are opened, read and closed through the ring, up to a slot per file and
+ * io_buffer_size bytes ahead of the loop that appends them in order.
+ * Larger files stay on the stdio path.
+ */
+#define READ_AHEAD_MAX (64 * 1024)
+
+struct read_ahead_slot {
+    size_t file;
+    int fd;
+    int status;                 /* BRARCHIVE_OK, EIO if not readable, ESHORT if it shrank */
+    bool done;                  /* Closed, buffer ready */
+    uint64_t got;
+    uint8_t *buf;
+    size_t buf_size;
+};
+
+struct read_ahead {
+    struct uring ring;
+    const struct file_list *files;
+    bool *want;                 /* Files read through the ring */
+    struct read_ahead_slot *slots;
+    unsigned nslots;
+    unsigned head;              /* Slot of the next file to hand out */
+    unsigned used;              /* Slots in use from head, in file order */
+    bool held;                  /* Head was handed out by read_ahead_take() */
+    size_t next;                /* Next file to queue */
+    uint64_t bytes;             /* Bytes of files in the used slots */
+};
+
+static void read_ahead_free(struct read_ahead *ra);
+
+/* NULL (errno set) if the ring cannot be set up or out of memory */
+static struct read_ahead *read_ahead_open(const struct file_list *files, const size_t *dup, const uint64_t *plan) {
+    struct read_ahead *ra = calloc(1, sizeof(*ra));
+    if (!ra) {
+        return NULL;
+    }
+    ra->ring.fd = -1;
+    ra->files = files;
+    ra->nslots = io_slots();
+    ra->want = malloc(files->count * sizeof(bool));
+    ra->slots = calloc(ra->nslots, sizeof(struct read_ahead_slot));
+    if (!ra->want || !ra->slots || !uring_init(&ra->ring, ra->nslots)) {
+        int saved = errno;
+        read_ahead_free(ra);
+        errno = saved;
+        return NULL;
+    }
+    
+    uint64_t limit = io_buffer_size < READ_AHEAD_MAX ? io_buffer_size : READ_AHEAD_MAX;
+    size_t i;
+    for (i = 0; i < files->count; i++) {
+        bool shared = dup && dup[i] != SIZE_MAX;
+        bool reused = plan && plan[i] < MEMBER_CHANGED;
+        ra->want[i] = !shared && !reused && files->sizes[i] <= limit;
+    }
+    return ra;
+}
+
+/* Queue opens for the next wanted files while slots and buffer budget last */
+static void read_ahead_fill(struct read_ahead *ra) {
+    while (ra->used < ra->nslots && ra->next < ra->files->count) {
+        size_t i = ra->next;
+        uint64_t size = ra->files->sizes[i];
+        if (!ra->want[i]) {
+            ra->next++;
+            continue;
+        }
+        if (ra->used > 0 && ra->bytes + size > io_buffer_size) {
+            break;
+        }
+        
+        unsigned k = (ra->head + ra->used) % ra->nslots;
+        struct read_ahead_slot *s = &ra->slots[k];
+        if (s->buf_size < size) {
+            uint8_t *buf = realloc(s->buf, (size_t)size);
+            if (!buf) {
+                break;
+            }
+            s->buf = buf;
+            s->buf_size = (size_t)size;
+        }
+        if (!uring_openat(&ra->ring, AT_FDCWD, ra->files->paths[i], O_RDONLY | O_CLOEXEC, 0, SLOT_TAG(k, SLOT_OPEN))) {
+            break;
+        }
+        s->file = i;
+        s->fd = -1;
+        s->status = BRARCHIVE_OK;
+        s->done = false;
+        s->got = 0;
+        ra->used++;
+        ra->bytes += size;
+        ra->next++;
+    }
+}
+
+/* Advance a slot past one completed operation */
+static void read_ahead_complete(struct read_ahead *ra, uint64_t tag, int res) {
+    unsigned k = (unsigned)(tag >> 2);
+    struct read_ahead_slot *s = &ra->slots[k];
+    uint64_t size = ra->files->sizes[s->file];
+    
+    switch (tag & 3) {
+    case SLOT_OPEN:
+        if (res < 0) {
+            s->status = BRARCHIVE_EIO;
+            s->done = true;
+            return;
+        }
+        s->fd = res;
+        break;
+    case SLOT_RW:
+        if (res < 0) {
+            s->status = BRARCHIVE_EIO;
+        } else if (res == 0) {
+            s->status = BRARCHIVE_ESHORT;
+        } else {
+            s->got += (uint64_t)res;
+        }
+        break;
+    default:
+        s->done = true;
+        return;
+    }
+    
+    if (s->status == BRARCHIVE_OK && s->got < size) {
+        uint64_t left = size - s->got;
+        unsigned len = left < URING_MAX_CHUNK ? (unsigned)left : URING_MAX_CHUNK;
+        uring_read(&ra->ring, s->fd, s->buf + s->got, len, s->got, SLOT_TAG(k, SLOT_RW));
+    } else {
+        uring_close(&ra->ring, s->fd, SLOT_TAG(k, SLOT_CLOSE));
+    }
+}
+
+/* Submit what is queued, wait for at least one completion and handle all that arrived */
+static int read_ahead_pump(struct read_ahead *ra) {
+    uint64_t tag;
+    int res;
+    int err = uring_submit(&ra->ring, 1);
+    if (err != 0) {
+        return err;
+    }
+    while (uring_reap(&ra->ring, &tag, &res)) {
+        read_ahead_complete(ra, tag, res);
+    }
+    return 0;
+}
+
+/*
+ * Contents of file i, which must be the next wanted file; valid until the
+ * next call.  Returns BRARCHIVE_OK, EIO if it could not be opened or read,
+ * or ESHORT if it ended early.
+ */
+static int read_ahead_take(struct read_ahead *ra, size_t i, const void **data) {
+    if (ra->held) {
+        ra->bytes -= ra->files->sizes[ra->slots[ra->head].file];
+        ra->head = (ra->head + 1) % ra->nslots;
+        ra->used--;
+        ra->held = false;
+    }
+    read_ahead_fill(ra);
+    
+    struct read_ahead_slot *s = &ra->slots[ra->head];
+    if (ra->used == 0 || s->file != i) {
+        return BRARCHIVE_EIO;
+    }
+    while (!s->done) {
+        int err = read_ahead_pump(ra);
+        if (err != 0) {
+            fprintf(stderr, "io_uring: %s\n", strerror(-err));
+            return BRARCHIVE_EIO;
+        }
+        read_ahead_fill(ra);
+    }
+    ra->held = true;
+    *data = s->buf;
+    return s->status;
+}
+
+/* Wait out anything still in flight, so no fd or buffer is left behind */
+static void read_ahead_free(struct read_ahead *ra) {
+    unsigned k;
+    if (!ra) {
+        return;
+    }
+    if (ra->ring.fd >= 0) {
+        for (k = 0; k < ra->used; k++) {
+            while (!ra->slots[(ra->head + k) % ra->nslots].done) {
+                if (read_ahead_pump(ra) != 0) {
+                    break;
+                }
+            }
+        }
+        uring_exit(&ra->ring);
+    }
+    if (ra->slots) {
+        for (k = 0; k < ra->nslots; k++) {
+            free(ra->slots[k].buf);
+        }
+    }
+    free(ra->slots);
+    free(ra->want);
+    free(ra);
+}
+#endif /* HAVE_IO_URING */
+
+/* Padding written before a member with --align */
+static const uint8_t align_zeros[MAX_ALIGN];
+
+/* Bytes from file offset pos to the next multiple of data_align */
+static uint64_t align_pad(uint64_t pos) {
+    return data_align ? (data_align - pos % data_align) % data_align : 0;
+}
+
+/* One archive of a --split set: members [first, end) */
+struct volume {
+    size_t first;
+    size_t end;
+};
+
+/* Name of volume n (from 1) of the set named path: path.001 and so on */
+static char *volume_path(const char *path, size_t n) {
+    size_t len = strlen(path) + 24;
+    char *p = malloc(len);
+    if (p) {
+        snprintf(p, len, "%s.%03zu", path, n);
+    }
+    return p;
+}
+
+/* Name volume n is written under until the whole set has been written */
+static char *volume_part_path(const char *path, size_t n) {
+    char *volume = volume_path(path, n);
+    char *part = volume ? sidecar_path(volume, ".part") : NULL;
+    free(volume);
+    return part;
+}
+
+/*
+ * Move the first count volumes of a new set into place once all of them
+ * were written, or remove them if the set is incomplete, so an older set
+ * is never left mixed with part of a new one.
+ */
+static bool finish_volumes(const char *path, size_t count, bool complete) {
+    bool ok = complete;
+    size_t n;
+    for (n = 1; n <= count; n++) {
+        char *part = volume_part_path(path, n);
+        char *volume = volume_path(path, n);
+        char *sum = volume ? sidecar_path(volume, SUM_SUFFIX) : NULL;
+        if (!part || !volume || !sum) {
+            if (ok) {
+                fprintf(stderr, "Memory allocation failed\n");
+            }
+            ok = false;
+        } else if (ok) {
+#ifdef _WIN32
+            remove(volume);
+#endif
+            if (rename(part, volume) != 0) {
+                fprintf(stderr, "Failed to write archive: %s\n", volume);
+                ok = false;
+            }
+            remove(sum);
+        }
+        if (part && !ok) {
+            unlink(part);
+        }
+        free(part);
+        free(volume);
+        free(sum);
+    }
+    return ok;
+}
+
+/* Volumes of the set named path, or 0 when path itself exists (or is -) */
+static size_t volume_set_count(const char *path) {
+    struct stat st;
+    size_t n = 0;
+    if (is_stdio(path) || stat(path, &st) == 0) {
+        return 0;
+    }
+    for (;;) {
+        char *p = volume_path(path, n + 1);
+        bool found = p && stat(p, &st) == 0;
+        free(p);
+        if (!found) {
+            return n;
+        }
+        n++;
+    }
+}
+
+/* Remove a single archive named path, and volumes of an older set from n on */
+static void remove_stale_volumes(const char *path, size_t n) {
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        remove(path);
+    }
+    for (;;) {
+        char *p = volume_path(path, n++);
+        bool removed = p && remove(p) == 0;
+        free(p);
+        if (!removed) {
+            return;
+        }
+    }
+}
+
+/* Write checksums for an archive, or for each volume of a --split set */
+static bool save_sums(const char *archive_path) {
+    size_t volumes = volume_set_count(archive_path);
+    size_t v;
+    if (volumes == 0) {
+        return sum_save(archive_path);
+    }
+    for (v = 1; v <= volumes; v++) {
+        char *path = volume_path(archive_path, v);
+        bool ok = path && sum_save(path);
+        if (!path) {
+            fprintf(stderr, "Memory allocation failed\n");
+        }
+        free(path);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Lay out the data: split the members (in name order) into volumes and
+ * give each its offset in its volume's data block.  Without --split there
+ * is one volume, which must fit the format's 32-bit offsets; this is
+ * checked before anything is written.  With --split a volume takes
+ * members until the next would take it past split_size or 4 GiB of data,
+ * counting worst-case --align padding since the table size is not known
+ * yet; a member larger than split_size gets a volume to itself.  A
+ * --dedup member whose copy is in an earlier volume is stored again.
+ */
+static bool layout_volumes(const struct file_list *files, size_t *dup, uint64_t *offsets,
+                           struct volume **volumes_out, size_t *volume_count, uint64_t *data_size,
+                           uint64_t *padding, uint64_t *saved, size_t *shared) {
+    struct volume *volumes = malloc(sizeof(struct volume));
+    size_t *latest = split_size && dup ? malloc((files->count + 1) * sizeof(size_t)) : NULL;
+    size_t count = 0, capacity = 1;
+    uint64_t slack = data_align ? data_align - 1 : 0;
+    uint64_t used = 0;          /* Data bytes in the current volume, padding included */
+    size_t i, v;
+    
+    if (!volumes || (split_size && dup && !latest)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(volumes);
+        free(latest);
+        return false;
+    }
+    volumes[0].first = 0;
+    for (i = 0; i < files->count; i++) {
+        if (files->sizes[i] > UINT32_MAX) {
+            fprintf(stderr, "File too large for the format (4 GiB): %s\n", files->paths[i]);
+            free(volumes);
+            free(latest);
+            return false;
+        }
+        if (!split_size) {
+            continue;
+        }
+        size_t first = dup ? dup[i] : SIZE_MAX;
+        bool own = first == SIZE_MAX || latest[first] < volumes[count].first;
+        uint64_t need = own && files->sizes[i] > 0 ? files->sizes[i] + slack : 0;
+        uint64_t members = i - volumes[count].first + 1;
+        if (members > 1 && (BRARCHIVE_HEADER_SIZE + BRARCHIVE_ENTRY_SIZE * members + used + need > split_size ||
+                            used + need > UINT32_MAX)) {
+            if (count + 1 == capacity) {
+                struct volume *grown = realloc(volumes, capacity * 2 * sizeof(struct volume));
+                if (!grown) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    free(volumes);
+                    free(latest);
+                    return false;
+                }
+                volumes = grown;
+                capacity *= 2;
+            }
+            volumes[count++].end = i;
+            volumes[count].first = i;
+            used = 0;
+            own = true;
+            need = files->sizes[i] > 0 ? files->sizes[i] + slack : 0;
+        }
+        if (first != SIZE_MAX && own) {
+            dup[i] = SIZE_MAX;
+            latest[first] = i;
+            (*shared)--;
+            *saved -= files->sizes[i];
+        } else if (first != SIZE_MAX) {
+            dup[i] = latest[first];
+        } else if (latest) {
+            latest[i] = i;
+        }
+        used += need;
+    }
+    volumes[count++].end = files->count;
+    free(latest);
+    
+    /* Offsets, now that each volume's table size is known */
+    for (v = 0; v < count; v++) {
+        uint64_t data_start = BRARCHIVE_HEADER_SIZE + (uint64_t)BRARCHIVE_ENTRY_SIZE * (volumes[v].end - volumes[v].first);
+        uint64_t pos = 0;
+        for (i = volumes[v].first; i < volumes[v].end; i++) {
+            if (dup && dup[i] != SIZE_MAX) {
+                offsets[i] = offsets[dup[i]];
+                continue;
+            }
+            if (files->sizes[i] > 0) {
+                uint64_t pad = align_pad(data_start + pos);
+                pos += pad;
+                *padding += pad;
+            }
+            offsets[i] = pos;
+            pos += files->sizes[i];
+        }
+        if (pos > UINT32_MAX) {
+            fprintf(stderr, "Archive too large for the format: %llu bytes of data, over 4 GiB; use --split\n",
+                    (unsigned long long)pos);
+            free(volumes);
+            return false;
+        }
+        *data_size += pos;
+    }
+    
+    *volumes_out = volumes;
+    *volume_count = count;
+    return true;
+}
+
+/*
+ * Create archive from directory.  Only file names and sizes are held in
+ * memory: the header and entry table are laid out from the sizes, then
+ * each member is streamed into the output through a fixed-size buffer.
+ *
+ * With -u and an existing archive, unchanged members are copied from the
+ * old data block instead, merging adjacent ranges into one kernel-side
+ * copy, so only new and modified files are read from disk.  With --dedup,
+ * members identical to an earlier one share its range and are not written.
+ */
+static bool create_archive(const char *archive_path, const char *dir_path, int options, int threads) {
+    struct file_list files;
+    file_list_init(&files);
+    
+    time_t started = time(NULL);
+    STATS_PHASE("walk");
+    collect_files(dir_path, &files, threads);
+    
+    if (files.count == 0) {
+        fprintf(stderr, "No files found in directory: %s\n", dir_path);
+        file_list_free(&files);
+        return false;
+    }
+    STATS_PHASE("plan");
+    if (!file_list_sort(&files)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        file_list_free(&files);
+        return false;
+    }
+    
+    uint8_t *buf = malloc(io_buffer_size);
+    if (!buf) {
+        fprintf(stderr, "Memory allocation failed\n");
+        file_list_free(&files);
+        return false;
+    }
+    
+    brarchive *old = NULL;
+    uint64_t *plan = NULL;
+    size_t reused = 0;
+    struct stat archive_st;
+    if ((options & OPT_U) && stat(archive_path, &archive_st) == 0) {
+        if (!(old = open_archive(archive_path, BRARCHIVE_READ_SOME))) {
+            free(buf);
+            file_list_free(&files);
+            return false;
+        }
+        if (brarchive_version(old) != BRARCHIVE_VERSION) {
+            fprintf(stderr, "Unsupported version: %u\n", brarchive_version(old));
+        } else if (!(plan = plan_update(old, archive_path, &files, buf, io_buffer_size, &reused))) {
+            fprintf(stderr, "Memory allocation failed\n");
+        }
+        if (!plan) {
+            brarchive_close(old);
+            free(buf);
+            file_list_free(&files);
+            return false;
+        }
+    }
+    
+    size_t *dup = NULL;
+    uint64_t *offsets = malloc((files.count + 1) * sizeof(uint64_t));
+    uint64_t saved = 0;
+    size_t shared = 0;
+    if (offsets && (options & OPT_DEDUP)) {
+        dup = dedup_members(&files, plan, old, buf, io_buffer_size, &saved, &shared);
+    }
+    if (!offsets || ((options & OPT_DEDUP) && !dup)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        brarchive_close(old);
+        free(dup);
+        free(offsets);
+        free(plan);
+        free(buf);
+        file_list_free(&files);
+        return false;
+    }
+    
+    /* The writer has its own buffer from here on */
+    free(buf);
+    STATS_PHASE("layout");
+    struct volume *volumes = NULL;
+    size_t volume_count = 0;
+    uint64_t data_pos = 0;
+    uint64_t padding = 0;
+    bool success = layout_volumes(&files, dup, offsets, &volumes, &volume_count, &data_pos, &padding, &saved, &shared);
+    
+    STATS_PHASE("write");
+#ifdef HAVE_IO_URING
+    struct read_ahead *ra = NULL;
+    if (io_backend == IO_URING && success && !(ra = read_ahead_open(&files, dup, plan))) {
+        io_uring_unavailable();
+    }
+#endif
+    size_t v;
+    for (v = 0; success && v < volume_count; v++) {
+        const struct volume *vol = &volumes[v];
+        char *path = split_size ? volume_part_path(archive_path, v + 1) : (char *)archive_path;
+        brarchive_writer *out = path ? open_writer(path, old) : NULL;
+        int err = out ? brarchive_writer_begin(out, (uint32_t)(vol->end - vol->first)) : BRARCHIVE_EIO;
+        uint64_t data_start = BRARCHIVE_HEADER_SIZE + (uint64_t)BRARCHIVE_ENTRY_SIZE * (vol->end - vol->first);
+        size_t i;
+        
+        /* Entry descriptors; offsets are relative to the volume's data block */
+        for (i = vol->first; err == BRARCHIVE_OK && i < vol->end; i++) {
+            err = brarchive_writer_entry(out, files.names[i], strlen(files.names[i]), offsets[i], files.sizes[i]);
+        }
+        
+        /* Stream file contents; reused ranges are batched until a file must be read */
+        uint64_t run_pos = 0;
+        uint64_t run_len = 0;
+        uint64_t out_pos = 0;
+        for (i = vol->first; err == BRARCHIVE_OK && i <= vol->end; i++) {
+            if (i < vol->end && dup && dup[i] != SIZE_MAX) {
+                if ((options & OPT_V) && !(plan && plan[i] < MEMBER_CHANGED)) {
+                    printf("%c - %s\n", plan && plan[i] == MEMBER_CHANGED ? 'r' : 'a', files.names[i]);
+                }
+                continue;
+            }
+            uint64_t pad = i < vol->end && files.sizes[i] > 0 ? align_pad(data_start + out_pos) : 0;
+            bool reuse = i < vol->end && plan && plan[i] < MEMBER_CHANGED;
+            if (reuse && pad == 0 && (run_len == 0 || run_pos + run_len == plan[i])) {
+                if (run_len == 0) {
+                    run_pos = plan[i];
+                }
+                run_len += files.sizes[i];
+                out_pos += files.sizes[i];
+                continue;
+            }
+            if (run_len > 0) {
+                if ((err = brarchive_writer_copy_range(out, old, run_pos, run_len)) != BRARCHIVE_OK) {
+                    break;
+                }
+                run_len = 0;
+            }
+            if (pad > 0 && (err = brarchive_writer_write(out, align_zeros, (size_t)pad)) != BRARCHIVE_OK) {
+                break;
+            }
+            out_pos += pad + (i < vol->end ? files.sizes[i] : 0);
+            if (reuse) {
+                run_pos = plan[i];
+                run_len = files.sizes[i];
+                continue;
+            }
+            if (i == vol->end) {
+                break;
+            }
+            
+            uint64_t span = TRACE_START();
+            const void *data = NULL;
+            FILE *in = NULL;
+#ifdef HAVE_IO_URING
+            if (ra && ra->want[i]) {
+                err = read_ahead_take(ra, i, &data);
+            } else if (!(in = fopen(files.paths[i], "rb"))) {
+                err = BRARCHIVE_EIO;
+            }
+#else
+            if (!(in = fopen(files.paths[i], "rb"))) {
+                err = BRARCHIVE_EIO;
+            }
+#endif
+            if (err == BRARCHIVE_EIO) {
+                fprintf(stderr, "Failed to read file: %s\n", files.paths[i]);
+                brarchive_writer_abort(out);
+                out = NULL;
+                break;
+            }
+            
+            if (in) {
+                err = brarchive_writer_copy_file(out, in, files.sizes[i]);
+            } else if (err == BRARCHIVE_OK) {
+                err = brarchive_writer_write(out, data, (size_t)files.sizes[i]);
+            }
+            TRACE_SPAN("write", files.names[i], span);
+            if (err == BRARCHIVE_ESHORT) {
+                /* The layout is fixed by now, so a short read cannot be recovered */
+                fprintf(stderr, "File changed while archiving: %s\n", files.paths[i]);
+                brarchive_writer_abort(out);
+                out = NULL;
+            } else if (err == BRARCHIVE_OK && (options & OPT_V)) {
+                printf("%c - %s\n", plan && plan[i] == MEMBER_CHANGED ? 'r' : 'a', files.names[i]);
+            }
+            if (in) {
+                fclose(in);
+            }
+        }
+        
+        success = false;
+        if (out && err == BRARCHIVE_OK) {
+            err = commit_writer(out, path);
+            success = (err == BRARCHIVE_OK);
+        } else if (out) {
+            brarchive_writer_abort(out);
+        }
+        if (out && !success) {
+            fprintf(stderr, "Failed to write archive: %s\n", path);
+        } else if (!path) {
+            fprintf(stderr, "Memory allocation failed\n");
+        }
+        if (path != archive_path) {
+            free(path);
+        }
+    }
+#ifdef HAVE_IO_URING
+    read_ahead_free(ra);
+#endif
+    
+    /* A set replaces a single archive of the same name, and any volumes past its last */
+    if (split_size) {
+        success = finish_volumes(archive_path, v, success);
+    }
+    if (success && split_size) {
+        remove_stale_volumes(archive_path, volume_count + 1);
+    }
+    free(volumes);
+    
+    bool updated = (old != NULL);
+    brarchive_close(old);
+    if (success) {
+        STATS_COUNT(files.count, data_pos);
+    }
+    
+    /* A failed manifest only costs the next update a full comparison */
+    if (success && (options & OPT_U)) {
+        STATS_PHASE("manifest");
+        if (!manifest_save(archive_path, &files, started)) {
+            fprintf(stderr, "Warning: Failed to write manifest for %s\n", archive_path);
+        }
+    }
+    
+    if (success && !(options & OPT_C)) {
+        if (updated) {
+            printf("Updated archive: %s (%zu files, %zu unchanged)\n", archive_path, files.count, reused);
+        } else if (split_size) {
+            printf("Created archive: %s (%zu files in %zu volumes)\n", archive_path, files.count, volume_count);
+        } else {
+            printf("Created archive: %s (%zu files)\n", archive_path, files.count);
+        }
+        if (dup) {
+            printf("Deduplicated %zu files, %llu bytes saved\n", shared, (unsigned long long)saved);
+        }
+        if (data_align) {
+            printf("Aligned members to %llu bytes, %llu bytes of padding\n",
+                   (unsigned long long)data_align, (unsigned long long)padding);
+        }
+    }
+    
+    free(dup);
+    free(offsets);
+    free(plan);
+    file_list_free(&files);
+    return success;
+}
+
+/*
+ * Output directories made so far during extraction.  Each directory is
+ * created once, relative to its parent's fd, and kept open so members are
+ * created with openat() on their base name: no per-member stat, mkdir or
+ * path walk.  Past the fd budget, directories are still created once but
+ * members below them are opened by their full path.
+ */
+struct dir_cache {
+    const char *root;           /* Output directory, NULL for the current one */
+    int root_fd;
+    int fd_budget;              /* Directory fds that may still be kept open */
+    struct name_map map;        /* Relative path to index in paths/fds */
+    char **paths;
+    int *fds;                   /* -1 when not kept open */
+    size_t count;
+    size_t capacity;
+};
+
+static bool dir_cache_init(struct dir_cache *c, const char *root) {
+    memset(c, 0, sizeof(*c));
+    c->root = root;
+    c->root_fd = -1;
+#if USE_DIRFD_EXTRACT
+    c->root_fd = root ? open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : AT_FDCWD;
+    if (c->root_fd == -1) {
+        fprintf(stderr, "Failed to open directory: %s\n", root);
+        return false;
+    }
+    /* Leave half the fd limit for the archive, output files and threads */
+    c->fd_budget = 256;
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        c->fd_budget = rl.rlim_cur / 2 < 65536 ? (int)(rl.rlim_cur / 2) : 65536;
+    }
+#endif
+    c->fd_budget /= extract_sharing;
+#endif
+    if (!name_map_init(&c->map, 16)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    return true;
+}
+
+static void dir_cache_free(struct dir_cache *c) {
+    size_t i;
+    for (i = 0; i < c->count; i++) {
+#if USE_DIRFD_EXTRACT
+        if (c->fds[i] >= 0) {
+            close(c->fds[i]);
+        }
+#endif
+        free(c->paths[i]);
+    }
+#if USE_DIRFD_EXTRACT
+    if (c->root && c->root_fd >= 0) {
+        close(c->root_fd);
+    }
+#endif
+    free(c->paths);
+    free(c->fds);
+    name_map_free(&c->map);
+}
+
+/* Add a directory, rehashing the map once it is half full */
+static bool dir_cache_push(struct dir_cache *c, char *path, int fd) {
+    if (c->count == c->capacity) {
+        size_t capacity = c->capacity ? c->capacity * 2 : 64;
+        char **paths = realloc(c->paths, capacity * sizeof(char *));
+        if (paths) {
+            c->paths = paths;
+        }
+        int *fds = realloc(c->fds, capacity * sizeof(int));
+        if (fds) {
+            c->fds = fds;
+        }
+        if (!paths || !fds) {
+            return false;
+        }
+        c->capacity = capacity;
+    }
+    if ((c->count + 1) * 2 > c->map.capacity) {
+        struct name_map map;
+        size_t i;
+        if (!name_map_init(&map, c->count + 1)) {
+            return false;
+        }
+        name_map_free(&c->map);
+        c->map = map;
+        for (i = 0; i < c->count; i++) {
+            name_map_put(&c->map, c->paths[i], strlen(c->paths[i]), (uint32_t)i);
+        }
+    }
+    c->paths[c->count] = path;
+    c->fds[c->count] = fd;
+    name_map_put(&c->map, path, strlen(path), (uint32_t)c->count);
+    c->count++;
+    return true;
+}
+
+/*
+ * Make the directory name[0..len) and its parents; returns its index + 1,
+ * 0 for the output directory itself, or -1 if out of memory.  Creation
+ * errors are left for the member writes to report.
+ */
+static long dir_cache_get(struct dir_cache *c, const char *name, size_t len) {
+    uint32_t found;
+    if (len == 0) {
+        return 0;
+    }
+    if (name_map_get(&c->map, name, len, &found)) {
+        return (long)found + 1;
+    }
+    
+    size_t parent_len = len;
+    while (parent_len > 0 && name[parent_len - 1] != '/') {
+        parent_len--;
+    }
+    long parent = dir_cache_get(c, name, parent_len > 0 ? parent_len - 1 : 0);
+    char *path = malloc(len + 1);
+    if (parent < 0 || !path) {
+        free(path);
+        return -1;
+    }
+    memcpy(path, name, len);
+    path[len] = '\0';
+    
+    int fd = -1;
+#if USE_DIRFD_EXTRACT
+    int parent_fd = parent ? c->fds[parent - 1] : c->root_fd;
+    const char *component = path + parent_len;
+    if (parent_fd == -1) {
+        parent_fd = c->root_fd;
+        component = path;
+    }
+    mkdirat(parent_fd, component, 0755);
+    if (c->fd_budget > 0 && (fd = openat(parent_fd, component, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0) {
+        c->fd_budget--;
+    }
+#else
+    char full_path[PATH_MAX];
+    if (c->root) {
+        snprintf(full_path, sizeof(full_path), "%s/%s", c->root, path);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s", path);
+    }
+    mkdir(full_path, 0755);
+#endif
+    
+    if (!dir_cache_push(c, path, fd)) {
+#if USE_DIRFD_EXTRACT
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+        free(path);
+        return -1;
+    }
+    return (long)c->count;
+}
+
+/* Extraction job states */
+#define JOB_PENDING 0
+#define JOB_DONE    1
+#define JOB_FAILED  2  /* Write failed */
+#define JOB_BADNAME 3  /* Invalid name length, reported only */
+#define JOB_BOUNDS  4  /* Contents out of bounds, reported only */
+#define JOB_NOREAD  5  /* Contents could not be read */
+#define JOB_SAME    6  /* Already on disk (--skip-unchanged) */
+
+/* One resolved member to extract */
+struct extract_job {
+    uint32_t index;
+    int status;
+    uint32_t dir;               /* Parent in the directory cache, see dir_cache_get() */
+};
+
+/* Resolved entry table shared by the extraction workers */
+struct extract_plan {
+    brarchive *reader;
+    struct dir_cache *dirs;
+    struct extract_job *jobs;
+    size_t count;
+    bool skip_unchanged;
+    uint64_t *sums;             /* Member hashes from the checksum file, or NULL */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+};
+
+#if USE_DIRFD_EXTRACT
+/* Directory fd to create a member in, and its name relative to that */
+static const char *member_target(const struct extract_plan *plan, const struct extract_job *job,
+                                 const char *name, int *dir_fd) {
+    const struct dir_cache *c = plan->dirs;
+    const char *leaf = strrchr(name, '/');
+    *dir_fd = job->dir ? c->fds[job->dir - 1] : c->root_fd;
+    if (*dir_fd == -1 || !leaf) {
+        *dir_fd = c->root_fd;
+        return name;
+    }
+    return leaf + 1;
+}
+#endif
+
+/* Create a member's file: one open, one write (usually) and one close */
+static bool write_member(const struct extract_plan *plan, const struct extract_job *job,
+                         const char *name, const void *data, size_t size) {
+#if USE_DIRFD_EXTRACT
+    int dir_fd;
+    const char *leaf = member_target(plan, job, name, &dir_fd);
+    int fd = openat(dir_fd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        return false;
+    }
+    const uint8_t *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            close(fd);
+            return false;
+        }
+        p += n;
+        size -= (size_t)n;
+    }
+    return close(fd) == 0;
+#else
+    (void)job;
+    char output_path[PATH_MAX];
+    if (plan->dirs->root) {
+        snprintf(output_path, sizeof(output_path), "%s/%s", plan->dirs->root, name);
+    } else {
+        /* Extract to current directory (like ar -x) */
+        snprintf(output_path, sizeof(output_path), "%s", name);
+    }
+    return write_file(output_path, data, size);
+#endif
+}
+
+/*
+ * --skip-unchanged: whether a member's file is already on disk with its
+ * contents.  Sizes are compared first; a file of the same size is then
+ * hashed against the checksum file, which leaves the archive unread, or
+ * without one compared with the member's contents (data).
+ */
+static bool member_unchanged(const struct extract_plan *plan, const struct extract_job *job,
+                             const struct br_ar_entry *entry, const void *data) {
+#if USE_DIRFD_EXTRACT
+    int dir_fd;
+    const char *leaf = member_target(plan, job, entry->name, &dir_fd);
+    int fd = openat(dir_fd, leaf, O_RDONLY | O_CLOEXEC);
+    FILE *in = fd >= 0 ? fdopen(fd, "rb") : NULL;
+    if (fd >= 0 && !in) {
+        close(fd);
+    }
+#else
+    (void)job;
+    char path[PATH_MAX];
+    if (plan->dirs->root) {
+        snprintf(path, sizeof(path), "%s/%s", plan->dirs->root, entry->name);
+    } else {
+        snprintf(path, sizeof(path), "%s", entry->name);
+    }
+    FILE *in = fopen(path, "rb");
+#endif
+    if (!in) {
+        return false;
+    }
+    
+    struct stat st;
+    uint64_t left = entry->view.size;
+    uint64_t h = HASH_SEED ^ left;
+    const uint8_t *p = data;
+    uint8_t buf[16384];
+    bool same = fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size == left;
+    while (same && left > 0) {
+        size_t chunk = left < sizeof(buf) ? (size_t)left : sizeof(buf);
+        if (fread(buf, 1, chunk, in) != chunk) {
+            same = false;
+        } else if (plan->sums) {
+            h = content_hash(h, buf, chunk);
+        } else {
+            same = memcmp(buf, p, chunk) == 0;
+            p += chunk;
+        }
+        left -= chunk;
+    }
+    fclose(in);
+    return same && (!plan->sums || h == plan->sums[job->index]);
+}
+
+/* Read a member to write: JOB_PENDING with its contents, or JOB_SAME or JOB_NOREAD */
+static int extract_job_read(const struct extract_plan *plan, const struct extract_job *job,
+                            const struct br_ar_entry *entry, const void **contents) {
+    if (plan->sums && member_unchanged(plan, job, entry, NULL)) {
+        return JOB_SAME;
+    }
+    if (brarchive_read(plan->reader, &entry->view, contents) != BRARCHIVE_OK) {
+        return JOB_NOREAD;
+    }
+    if (plan->skip_unchanged && !plan->sums && member_unchanged(plan, job, entry, *contents)) {
+        return JOB_SAME;
+    }
+    return JOB_PENDING;
+}
+
+/* Write one member and record the outcome */
+static void extract_job_run(struct extract_plan *plan, struct extract_job *job) {
+    struct br_ar_entry entry;
+    int status = JOB_DONE;
+    
+    const void *contents;
+    uint64_t span = TRACE_START();
+    read_entry(plan->reader, job->index, &entry);
+    int state = extract_job_read(plan, job, &entry, &contents);
+    if (state != JOB_PENDING) {
+        status = state;
+    } else if (!write_member(plan, job, entry.name, contents, entry.view.size)) {
+        status = JOB_FAILED;
+    }
+    TRACE_SPAN("write", entry.name, span);
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&plan->lock);
+    job->status = status;
+    pthread_cond_broadcast(&plan->cond);
+    pthread_mutex_unlock(&plan->lock);
+#else
+    job->status = status;
+#endif
+}
+
+/* Print the outcome of a finished job, keeping table order */
+static void extract_job_report(const struct extract_plan *plan, const struct extract_job *job, int options) {
+    struct br_ar_entry entry;
+    
+    switch (job->status) {
+    case JOB_BADNAME:
+        fprintf(stderr, "Invalid name length in entry %u\n", job->index);
+        break;
+    case JOB_BOUNDS:
+        read_entry(plan->reader, job->index, &entry);
+        fprintf(stderr, "Archive corrupted: file %s out of bounds\n", entry.name);
+        break;
+    case JOB_NOREAD:
+        fprintf(stderr, "Failed to read archive: %s\n", brarchive_path(plan->reader));
+        break;
+    case JOB_SAME:
+        break;
+    case JOB_FAILED:
+        read_entry(plan->reader, job->index, &entry);
+        if (plan->dirs->root) {
+            fprintf(stderr, "Failed to write file: %s/%s\n", plan->dirs->root, entry.name);
+        } else {
+            fprintf(stderr, "Failed to write file: %s\n", entry.name);
+        }
+        break;
+    default:
+        if ((options & OPT_V) || stats_enabled) {
+            read_entry(plan->reader, job->index, &entry);
+            STATS_COUNT(1, entry.view.size);
+        }
+        if (options & OPT_V) {
+            printf("x - %s\n", entry.name);
+        }
+        break;
+    }
+}
+
+#ifdef HAVE_IO_URING
+/* A member being written through the ring */
+struct extract_slot {
+    size_t job;
+    int fd;
+    bool failed;
+    const uint8_t *data;
+    uint64_t size;
+    uint64_t put;
+    uint64_t span;
+    struct br_ar_entry entry;   /* Copied out, the open path points into it */
+#if !USE_DIRFD_EXTRACT
+    char path[PATH_MAX];
+#endif
+};
+
+/* Queue the next step for a slot after one of its operations completed; true when it is finished */
+static bool extract_slot_complete(struct uring *ring, struct extract_slot *s, unsigned k, int op, int res) {
+    switch (op) {
+    case SLOT_OPEN:
+        if (res < 0) {
+            s->failed = true;
+            return true;
+        }
+        s->fd = res;
+        break;
+    case SLOT_RW:
+        if (res <= 0) {
+            s->failed = true;
+        } else {
+            s->put += (uint64_t)res;
+        }
+        break;
+    default:
+        if (res < 0) {
+            s->failed = true;
+        }
+        return true;
+    }
+    
+    if (!s->failed && s->put < s->size) {
+        uint64_t left = s->size - s->put;
+        unsigned len = left < URING_MAX_CHUNK ? (unsigned)left : URING_MAX_CHUNK;
+        uring_write(ring, s->fd, s->data + s->put, len, s->put, SLOT_TAG(k, SLOT_RW));
+    } else {
+        uring_close(ring, s->fd, SLOT_TAG(k, SLOT_CLOSE));
+    }
+    return false;
+}
+
+/*
+ * Run the plan through io_uring: up to io_slots() members are in flight,
+ * each an openat, its writes and a close, and one io_uring_enter() submits
+ * and reaps a whole batch of them.  Results are reported in table order.
+ * Needs a mapped reader.  Returns false (errno set) if the ring could not
+ * be set up; nothing has been reported in that case.
+ */
+static bool extract_plan_run_uring(struct extract_plan *plan, int options) {
+    unsigned nslots = io_slots();
+    struct extract_slot *slots = malloc(nslots * sizeof(struct extract_slot));
+    unsigned *idle = malloc(nslots * sizeof(unsigned));
+    struct uring ring;
+    
+    if (!slots || !idle || !uring_init(&ring, nslots)) {
+        int saved = errno;
+        free(slots);
+        free(idle);
+        errno = saved;
+        return false;
+    }
+    unsigned nidle;
+    for (nidle = 0; nidle < nslots; nidle++) {
+        idle[nidle] = nslots - 1 - nidle;
+    }
+    
+    size_t next = 0;
+    size_t reported = 0;
+    while (reported < plan->count) {
+        /* Open the next members while slots are free */
+        while (nidle > 0 && next < plan->count) {
+            struct extract_job *job = &plan->jobs[next];
+            struct extract_slot *s = &slots[idle[nidle - 1]];
+            const void *contents;
+            if (job->status != JOB_PENDING) {
+                next++;
+                continue;
+            }
+            s->span = TRACE_START();
+            read_entry(plan->reader, job->index, &s->entry);
+            int state = extract_job_read(plan, job, &s->entry, &contents);
+            if (state != JOB_PENDING) {
+                job->status = state;
+                next++;
+                continue;
+            }
+            
+            unsigned k = idle[--nidle];
+            s->job = next;
+            s->fd = -1;
+            s->failed = false;
+            s->data = contents;
+            s->size = s->entry.view.size;
+            s->put = 0;
+#if USE_DIRFD_EXTRACT
+            int dir_fd;
+            const char *path = member_target(plan, job, s->entry.name, &dir_fd);
+#else
+            int dir_fd = AT_FDCWD;
+            const char *path = s->path;
+            if (plan->dirs->root) {
+                snprintf(s->path, sizeof(s->path), "%s/%s", plan->dirs->root, s->entry.name);
+            } else {
+                snprintf(s->path, sizeof(s->path), "%s", s->entry.name);
+            }
+#endif
+            uring_openat(&ring, dir_fd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666, SLOT_TAG(k, SLOT_OPEN));
+            next++;
+        }
+        
+        while (reported < next && plan->jobs[reported].status != JOB_PENDING) {
+            extract_job_report(plan, &plan->jobs[reported++], options);
+        }
+        if (nidle == nslots) {
+            continue;
+        }
+        
+        /* Waking for every completion would cost a system call per operation */
+        int err = uring_submit(&ring, (nslots - nidle + 1) / 2);
+        if (err != 0) {
+            /* Whatever is still in flight is torn down with the ring */
+            fprintf(stderr, "io_uring: %s\n", strerror(-err));
+            for (; reported < plan->count; reported++) {
+                if (plan->jobs[reported].status == JOB_PENDING) {
+                    plan->jobs[reported].status = JOB_FAILED;
+                }
+                extract_job_report(plan, &plan->jobs[reported], options);
+            }
+            break;
+        }
+        uint64_t tag;
+        int res;
+        while (uring_reap(&ring, &tag, &res)) {
+            unsigned k = (unsigned)(tag >> 2);
+            struct extract_slot *s = &slots[k];
+            if (extract_slot_complete(&ring, s, k, (int)(tag & 3), res)) {
+                struct extract_job *job = &plan->jobs[s->job];
+                job->status = s->failed ? JOB_FAILED : JOB_DONE;
+                TRACE_SPAN("write", s->entry.name, s->span);
+                idle[nidle++] = k;
+            }
+        }
+    }
+    
+    uring_exit(&ring);
+    free(slots);
+    free(idle);
+    return true;
+}
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_PTHREAD
+/* Per-worker deque over a contiguous range of jobs: owner pops the front, thieves take the back */
+struct job_queue {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+};
+
+struct extract_worker {
+    struct extract_plan *plan;
+    struct job_queue *queues;
+    int nthreads;
+    int self;
+};
+
+static bool job_queue_pop(struct job_queue *q, size_t *job) {
+    bool found = false;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail) {
+        *job = q->head++;
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return found;
+}
+
+/* Move the back half of another worker's queue into our own (empty) queue */
+static bool job_queue_steal(struct extract_worker *w) {
+    int k;
+    for (k = 1; k < w->nthreads; k++) {
+        struct job_queue *victim = &w->queues[(w->self + k) % w->nthreads];
+        size_t start = 0, end = 0;
+        
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            size_t take = (victim->tail - victim->head + 1) / 2;
+            end = victim->tail;
+            start = end - take;
+            victim->tail = start;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        
+        if (start < end) {
+            struct job_queue *own = &w->queues[w->self];
+            pthread_mutex_lock(&own->lock);
+            own->head = start;
+            own->tail = end;
+            pthread_mutex_unlock(&own->lock);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *extract_worker_main(void *arg) {
+    struct extract_worker *w = arg;
+    struct job_queue *own = &w->queues[w->self];
+    size_t job;
+    
+    for (;;) {
+        if (!job_queue_pop(own, &job)) {
+            if (!job_queue_steal(w)) {
+                break;
+            }
+            continue;
+        }
+        if (w->plan->jobs[job].status == JOB_PENDING) {
+            extract_job_run(w->plan, &w->plan->jobs[job]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Run the plan on a pool of workers.  The calling thread only reports
+ * results, in table order, as each job finishes.  Returns false if the
+ * pool could not be started; nothing has been reported in that case.
+ */
+static bool extract_plan_run_parallel(struct extract_plan *plan, int nthreads, int options) {
+    pthread_t *threads = malloc((size_t)nthreads * sizeof(pthread_t));
+    struct job_queue *queues = malloc((size_t)nthreads * sizeof(struct job_queue));
+    struct extract_worker *workers = malloc((size_t)nthreads * sizeof(struct extract_worker));
+    int started = 0;
+    int t;
+    
+    if (!threads || !queues || !workers) {
+        free(threads);
+        free(queues);
+        free(workers);
+        return false;
+    }
+    
+    /* Contiguous slices keep each worker's reads local in the data block */
+    for (t = 0; t < nthreads; t++) {
+        pthread_mutex_init(&queues[t].lock, NULL);
+        queues[t].head = plan->count * (size_t)t / (size_t)nthreads;
+        queues[t].tail = plan->count * (size_t)(t + 1) / (size_t)nthreads;
+        workers[t].plan = plan;
+        workers[t].queues = queues;
+        workers[t].nthreads = nthreads;
+        workers[t].self = t;
+    }
+    
+    for (t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, extract_worker_main, &workers[t]) != 0) {
+            break;
+        }
+        started++;
+    }
+    
+    if (started == 0) {
+        for (t = 0; t < nthreads; t++) {
+            pthread_mutex_destroy(&queues[t].lock);
+        }
+        free(threads);
+        free(queues);
+        free(workers);
+        return false;
+    }
+    
+    /* Queues of workers that failed to start are stolen by the others */
+    size_t k;
+    for (k = 0; k < plan->count; k++) {
+        pthread_mutex_lock(&plan->lock);
+        while (plan->jobs[k].status == JOB_PENDING) {
+            pthread_cond_wait(&plan->cond, &plan->lock);
+        }
+        pthread_mutex_unlock(&plan->lock);
+        extract_job_report(plan, &plan->jobs[k], options);
+    }
+    
+    for (t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    
+    for (t = 0; t < nthreads; t++) {
+        pthread_mutex_destroy(&queues[t].lock);
+    }
+    free(threads);
+    free(queues);
+    free(workers);
+    return true;
+}
+#endif /* HAVE_PTHREAD */
+
+/* A job (or member) and where its contents start, to run them in data order */
+struct job_offset {
+    uint64_t offset;
+    size_t job;
+};
+
+static int job_offset_cmp(const void *a, const void *b) {
+    const struct job_offset *x = a;
+    const struct job_offset *y = b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return x->job < y->job ? -1 : x->job > y->job;
+}
+
+/*
+ * A compressed or piped archive only reads forward, so write its members
+ * in data order (each byte read once, straight into the member writes)
+ * and report them in table order afterwards.
+ */
+static bool extract_plan_run_stream(struct extract_plan *plan, int options) {
+    struct job_offset *order = malloc(plan->count * sizeof(struct job_offset));
+    size_t k;
+    if (!order) {
+        return false;
+    }
+    for (k = 0; k < plan->count; k++) {
+        struct brarchive_entry view;
+        order[k].offset = brarchive_entry(plan->reader, plan->jobs[k].index, &view) == BRARCHIVE_OK ? view.offset : 0;
+        order[k].job = k;
+    }
+    qsort(order, plan->count, sizeof(struct job_offset), job_offset_cmp);
+    for (k = 0; k < plan->count; k++) {
+        if (plan->jobs[order[k].job].status == JOB_PENDING) {
+            extract_job_run(plan, &plan->jobs[order[k].job]);
+        }
+    }
+    for (k = 0; k < plan->count; k++) {
+        extract_job_report(plan, &plan->jobs[k], options);
+    }
+    free(order);
+    return true;
+}
+
+/* Number of online processors, for -j 0 */
+static int cpu_count(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > 0) {
+        return n > 1024 ? 1024 : (int)n;
+    }
+#endif
+    return 1;
+}
+
+/*
+ * Extract archive to directory (with optional file filter).  The entry
+ * table is resolved and parent directories are created up front; member
+ * writes are then independent and can be spread over threads workers.
+ */
+static bool extract_archive(const char *archive_path, const char *dir_path, const struct name_matcher *filter, int options, int threads) {
+    STATS_PHASE("open");
+    brarchive *reader = open_archive(archive_path, matcher_empty(filter) ? BRARCHIVE_READ_ALL : BRARCHIVE_READ_SOME);
+    if (!reader) {
+        return false;
+    }
+    
+    if (brarchive_version(reader) != BRARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported version: %u\n", brarchive_version(reader));
+        brarchive_close(reader);
+        return false;
+    }
+    
+    /* Create output directory if specified */
+    if (dir_path) {
+        struct stat st;
+        if (stat(dir_path, &st) != 0) {
+            if (mkdir(dir_path, 0755) != 0) {
+                fprintf(stderr, "Failed to create directory: %s\n", dir_path);
+                brarchive_close(reader);
+                return false;
+            }
+        }
+    }
+    
+    struct dir_cache dirs;
+    if (!dir_cache_init(&dirs, dir_path)) {
+        dir_cache_free(&dirs);
+        brarchive_close(reader);
+        return false;
+    }
+    
+    /* Exact names are looked up; anything else scans the table */
+    STATS_PHASE("resolve");
+    size_t selected;
+    bool failed;
+    uint32_t *indices = lookup_members(reader, filter, &selected, &failed);
+    uint32_t scan_count = indices ? (uint32_t)selected : brarchive_table_count(reader);
+    
+    struct extract_plan plan;
+    plan.reader = reader;
+    plan.dirs = &dirs;
+    plan.count = 0;
+    plan.skip_unchanged = (options & OPT_SKIP) != 0;
+    plan.sums = plan.skip_unchanged && !is_stdio(archive_path) ? sum_load(archive_path, reader) : NULL;
+    plan.jobs = failed ? NULL : malloc(((size_t)scan_count + 1) * sizeof(struct extract_job));
+    if (!plan.jobs) {
+        if (!failed) {
+            fprintf(stderr, "Memory allocation failed\n");
+        }
+        free(plan.sums);
+        free(indices);
+        dir_cache_free(&dirs);
+        brarchive_close(reader);
+        return false;
+    }
+#ifdef HAVE_PTHREAD
+    /* Jobs always record their status under the lock, even when run inline */
+    pthread_mutex_init(&plan.lock, NULL);
+    pthread_cond_init(&plan.cond, NULL);
+#endif
+    
+    /* Resolve entries */
+    bool truncated = brarchive_table_count(reader) < brarchive_count(reader);
+    bool success = true;
+    uint32_t pos;
+    
+    for (pos = 0; pos < scan_count; pos++) {
+        uint32_t i = indices ? indices[pos] : pos;
+        struct extract_job *job = &plan.jobs[plan.count];
+        job->index = i;
+        job->status = JOB_PENDING;
+        job->dir = 0;
+        
+        struct br_ar_entry entry;
+        if (!read_entry(reader, i, &entry)) {
+            job->status = JOB_BADNAME;
+            plan.count++;
+            continue;
+        }
+        const char *name = entry.name;
+        
+        /* Check if this file should be extracted (if filter is specified) */
+        bool should_extract = matcher_match(filter, name);
+        
+        if (!should_extract) {
+            continue;
+        }
+        plan.count++;
+        
+        if (!brarchive_in_bounds(reader, &entry.view)) {
+            job->status = JOB_BOUNDS;
+            continue;
+        }
+        
+        /* Create parent directories once, however many members they hold */
+        const char *slash = strrchr(name, '/');
+        long dir = slash ? dir_cache_get(&dirs, name, (size_t)(slash - name)) : 0;
+        if (dir < 0) {
+            fprintf(stderr, "Memory allocation failed\n");
+            success = false;
+            break;
+        }
+        job->dir = (uint32_t)dir;
+    }
+    
+    STATS_PHASE("write");
+    if (success) {
+        bool ran = false;
+#ifdef HAVE_IO_URING
+        /* One ring keeps more writes in flight than a thread pool; -j does not apply */
+        if (io_backend == IO_URING && brarchive_is_mapped(reader) && plan.count > 0) {
+            if (!(ran = extract_plan_run_uring(&plan, options))) {
+                io_uring_unavailable();
+            }
+        }
+#endif
+#ifdef HAVE_PTHREAD
+        /* Workers share the mapping; the buffered fallback reader is not thread-safe */
+        if (!ran && threads > 1 && brarchive_is_mapped(reader) && plan.count > 1) {
+            if ((size_t)threads > plan.count) {
+                threads = (int)plan.count;
+            }
+            ran = extract_plan_run_parallel(&plan, threads, options);
+        }
+#else
+        (void)threads;
+#endif
+        if (!ran && brarchive_is_streamed(reader) && plan.count > 1) {
+            ran = extract_plan_run_stream(&plan, options);
+        }
+        if (!ran) {
+            size_t k;
+            for (k = 0; k < plan.count; k++) {
+                if (plan.jobs[k].status == JOB_PENDING) {
+                    extract_job_run(&plan, &plan.jobs[k]);
+                }
+                extract_job_report(&plan, &plan.jobs[k], options);
+            }
+        }
+        
+        if (truncated) {
+            fprintf(stderr, "Archive corrupted: entry %u out of bounds\n", brarchive_table_count(reader));
+            success = false;
+        }
+    }
+    
+    free(plan.jobs);
+    free(plan.sums);
+    free(indices);
+#ifdef HAVE_PTHREAD
+    pthread_cond_destroy(&plan.cond);
+    pthread_mutex_destroy(&plan.lock);
+#endif
+    dir_cache_free(&dirs);
+    brarchive_close(reader);
+    return success;
+}
+
+/* A member -p prints from a streamed archive */
+struct print_member {
+    struct br_ar_entry entry;
+    uint8_t *held;              /* Contents read ahead of their turn */
+    bool done;                  /* Read (or failed), so nothing is left to read */
+};
+
+/* Bytes of members -p holds back while a stream is read ahead of them */
+#define PRINT_HOLD_MAX (64 * 1024 * 1024)
+
+/*
+ * Print members of a streamed archive in table order while reading them
+ * in data order, holding back those that come early.  Members that do
+ * not fit in PRINT_HOLD_MAX are read again in turn, which a pipe cannot
+ * do, so those are reported instead.
+ */
+static void print_members_stream(brarchive *reader, struct print_member *members, size_t count) {
+    struct job_offset *order = malloc(count * sizeof(struct job_offset));
+    size_t next = 0;
+    size_t held = 0;
+    size_t k;
+    
+    for (k = 0; order && k < count; k++) {
+        order[k].offset = members[k].entry.view.offset;
+        order[k].job = k;
+    }
+    if (order) {
+        qsort(order, count, sizeof(struct job_offset), job_offset_cmp);
+    }
+    for (k = 0; order && k < count; k++) {
+        struct print_member *m = &members[order[k].job];
+        size_t size = m->entry.view.size;
+        const void *contents;
+        int err = brarchive_read(reader, &m->entry.view, &contents);
+        if (err != BRARCHIVE_OK) {
+            fprintf(stderr, "Failed to read %s: %s\n", m->entry.name, brarchive_strerror(err));
+            m->done = true;
+        } else if (m == &members[next]) {
+            fwrite(contents, 1, size, stdout);
+            STATS_COUNT(1, size);
+            m->done = true;
+        } else if (held + size <= PRINT_HOLD_MAX && (m->held = malloc(size ? size : 1))) {
+            memcpy(m->held, contents, size);
+            held += size;
+            m->done = true;
+        }
+        
+        /* Write whatever is now next in table order */
+        while (next < count && members[next].done) {
+            if (members[next].held) {
+                fwrite(members[next].held, 1, members[next].entry.view.size, stdout);
+                STATS_COUNT(1, members[next].entry.view.size);
+                held -= members[next].entry.view.size;
+                free(members[next].held);
+                members[next].held = NULL;
+            }
+            next++;
+        }
+    }
+    free(order);
+    
+    /* Whatever could not be held is read where it belongs */
+    for (; next < count; next++) {
+        struct print_member *m = &members[next];
+        const void *contents;
+        if (m->held) {
+            fwrite(m->held, 1, m->entry.view.size, stdout);
+            STATS_COUNT(1, m->entry.view.size);
+            free(m->held);
+        } else if (!m->done) {
+            int err = brarchive_read(reader, &m->entry.view, &contents);
+            if (err != BRARCHIVE_OK) {
+                fprintf(stderr, "Failed to read %s: %s\n", m->entry.name, brarchive_strerror(err));
+                continue;
+            }
+            fwrite(contents, 1, m->entry.view.size, stdout);
+            STATS_COUNT(1, m->entry.view.size);
+        }
+    }
+}
+
+/* Print archive contents to stdout (with optional file filter) */
+static bool print_archive(const char *archive_path, const struct name_matcher *filter) {
+    STATS_PHASE("open");
+    brarchive *reader = open_archive(archive_path, matcher_empty(filter) ? BRARCHIVE_READ_ALL : BRARCHIVE_READ_SOME);
+    if (!reader) {
+        return false;
+    }
+    
+    /* Exact names are looked up; anything else scans the table */
+    size_t selected;
+    bool failed;
+    uint32_t *indices = lookup_members(reader, filter, &selected, &failed);
+    uint32_t scan_count = indices ? (uint32_t)selected : brarchive_count(reader);
+    uint32_t pos;
+    
+    /* A streamed archive collects the members first and prints them in one pass */
+    struct print_member *members = NULL;
+    size_t member_count = 0;
+    if (!failed && brarchive_is_streamed(reader) &&
+        !(members = calloc((size_t)scan_count + 1, sizeof(struct print_member)))) {
+        fprintf(stderr, "Memory allocation failed\n");
+        failed = true;
+    }
+    if (failed) {
+        free(indices);
+        brarchive_close(reader);
+        return false;
+    }
+    
+    STATS_PHASE("write");
+    for (pos = 0; pos < scan_count; pos++) {
+        uint32_t i = indices ? indices[pos] : pos;
+        if (i >= brarchive_table_count(reader)) {
+            fprintf(stderr, "Archive corrupted: entry %u out of bounds\n", i);
+            break;
+        }
+        
+        struct br_ar_entry entry;
+        if (!read_entry(reader, i, &entry)) {
+            fprintf(stderr, "Invalid name length in entry %u\n", i);
+            continue;
+        }
+        const char *name = entry.name;
+        
+        /* Check if this file should be printed (if filter is specified) */
+        bool should_print = matcher_match(filter, name);
+        
+        if (should_print) {
+            if (!brarchive_in_bounds(reader, &entry.view)) {
+                fprintf(stderr, "Archive corrupted: file %s out of bounds\n", name);
+                continue;
+            }
+            if (members) {
+                members[member_count++].entry = entry;
+                continue;
+            }
+            
+            const void *contents;
+            if (brarchive_read(reader, &entry.view, &contents) != BRARCHIVE_OK) {
+                fprintf(stderr, "Failed to read archive: %s\n", archive_path);
+                continue;
+            }
+            
+            /* Print file contents to stdout */
+            fwrite(contents, 1, entry.view.size, stdout);
+            STATS_COUNT(1, entry.view.size);
+        }
+    }
+    if (members) {
+        print_members_stream(reader, members, member_count);
+        free(members);
+    }
+    
+    free(indices);
+    brarchive_close(reader);
+    return true;
+}
+
+/* List archive contents (with optional file filter) */
+static bool list_archive(const char *archive_path, const struct name_matcher *filter) {
+    STATS_PHASE("open");
+    brarchive *reader = open_archive(archive_path, BRARCHIVE_READ_TABLE);
+    if (!reader) {
+        return false;
+    }
+    
+    /* Exact names are looked up; anything else scans the table */
+    size_t selected;
+    bool failed;
+    uint32_t *indices = lookup_members(reader, filter, &selected, &failed);
+    uint32_t scan_count = indices ? (uint32_t)selected : brarchive_count(reader);
+    uint32_t pos;
+    if (failed) {
+        brarchive_close(reader);
+        return false;
+    }
+    
+    STATS_PHASE("list");
+    for (pos = 0; pos < scan_count; pos++) {
+        uint32_t i = indices ? indices[pos] : pos;
+        if (i >= brarchive_table_count(reader)) {
+            fprintf(stderr, "Archive corrupted: entry %u out of bounds\n", i);
+            break;
+        }
+        
+        struct br_ar_entry entry;
+        if (!read_entry(reader, i, &entry)) {
+            fprintf(stderr, "Invalid name length in entry %u\n", i);
+            continue;
+        }
+        const char *name = entry.name;
+        
+        /* Check if this file should be listed (if filter is specified) */
+        bool should_list = matcher_match(filter, name);
+        
+        if (should_list) {
+            printf("%s\n", name);
+            STATS_COUNT(1, 0);
+        }
+    }
+    
+    free(indices);
+    brarchive_close(reader);
+    return true;
+}
+
+/* The volumes of a set being extracted, handed out to threads one at a time */
+struct volume_set {
+    const char *path;
+    size_t count;
+    size_t next;
+    const struct name_matcher *filter;
+    int options;
+    int threads;                /* Per volume */
+    bool success;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static void *volume_worker(void *arg) {
+    struct volume_set *set = arg;
+    for (;;) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&set->lock);
+#endif
+        size_t n = ++set->next;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_unlock(&set->lock);
+#endif
+        if (n > set->count) {
+            return NULL;
+        }
+        char *path = volume_path(set->path, n);
+        bool ok = path && extract_archive(path, NULL, set->filter, set->options, set->threads);
+        if (!path) {
+            fprintf(stderr, "Memory allocation failed\n");
+        }
+        free(path);
+        if (!ok) {
+#ifdef HAVE_PTHREAD
+            pthread_mutex_lock(&set->lock);
+#endif
+            set->success = false;
+#ifdef HAVE_PTHREAD
+            pthread_mutex_unlock(&set->lock);
+#endif
+        }
+    }
+}
+
+/*
+ * Run -t, -p, -x or -V on the count volumes of a --split set.  Listing,
+ * printing and verifying go volume by volume, so output comes in the same
+ * order as for one archive.  Volumes hold disjoint members, so they are
+ * extracted side by side, each with a share of the threads (one at a time
+ * with io_uring, which already keeps many writes in flight).
+ */
+static bool read_volume_set(const char *archive_path, size_t count, int operation,
+                            const struct name_matcher *filter, int options, int threads) {
+    if (operation == 'x') {
+        struct volume_set set;
+        set.path = archive_path;
+        set.count = count;
+        set.next = 0;
+        set.filter = filter;
+        set.options = options;
+        set.success = true;
+        
+        int workers = (size_t)threads < count ? threads : (int)count;
+#ifdef HAVE_IO_URING
+        if (io_backend == IO_URING) {
+            workers = 1;
+        }
+#endif
+#ifndef HAVE_PTHREAD
+        workers = 1;
+#endif
+        set.threads = threads / workers > 1 ? threads / workers : 1;
+        extract_sharing = workers;
+#ifdef HAVE_PTHREAD
+        pthread_mutex_init(&set.lock, NULL);
+        pthread_t *started = workers > 1 ? malloc((size_t)(workers - 1) * sizeof(pthread_t)) : NULL;
+        int n = 0;
+        while (started && n < workers - 1 && pthread_create(&started[n], NULL, volume_worker, &set) == 0) {
+            n++;
+        }
+#endif
+        
+        /* The calling thread takes volumes too */
+        volume_worker(&set);
+        
+#ifdef HAVE_PTHREAD
+        while (n > 0) {
+            pthread_join(started[--n], NULL);
+        }
+        free(started);
+        pthread_mutex_destroy(&set.lock);
+#endif
+        extract_sharing = 1;
+        return set.success;
+    }
+    
+    bool success = true;
+    size_t v;
+    for (v = 1; v <= count; v++) {
+        char *path = volume_path(archive_path, v);
+        if (!path) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return false;
+        }
+        if (operation == 't') {
+            success = list_archive(path, filter) && success;
+        } else if (operation == 'p') {
+            success = print_archive(path, filter) && success;
+        } else {
+            success = verify_archive(path, filter, threads) && success;
+        }
+        free(path);
+    }
+    return success;
+}
+
+/* Compare two archives (--diff), optionally writing a delta */
+static bool diff_command(const char *old_path, const char *new_path, const char *delta_path, int threads) {
+    STATS_PHASE("open");
+    brarchive *old = open_archive(old_path, BRARCHIVE_READ_ALL);
+    brarchive *new_ar = old ? open_archive(new_path, BRARCHIVE_READ_ALL) : NULL;
+    bool success = false;
+    
+    if (new_ar) {
+        uint32_t version = brarchive_version(old) != BRARCHIVE_VERSION ? brarchive_version(old) : brarchive_version(new_ar);
+        if (version != BRARCHIVE_VERSION) {
+            fprintf(stderr, "Unsupported version: %u\n", version);
+        } else if (!delta_path) {
+            success = diff_archives(old, new_ar, NULL, NULL, threads);
+        } else {
+            /* A delta on stdout sends the report to stderr */
+            FILE *f = is_stdio(delta_path) ? claim_stdout() : fopen(delta_path, "wb");
+            if (!f) {
+                fprintf(stderr, "Failed to create delta: %s\n", delta_path);
+            } else {
+                success = diff_archives(old, new_ar, f, delta_path, threads);
+                if (fclose(f) != 0 && success) {
+                    fprintf(stderr, "Failed to write delta: %s\n", delta_path);
+                    success = false;
+                }
+                if (!success && !is_stdio(delta_path)) {
+                    remove(delta_path);
+                }
+            }
+        }
+    }
+    brarchive_close(new_ar);
+    brarchive_close(old);
+    return success;
+}
+
+/* Rebuild an archive from an older one and a delta (--apply) */
+static bool apply_command(const char *delta_path, const char *old_path, const char *new_path, int options) {
+    STATS_PHASE("open");
+    brarchive *old = open_archive(old_path, BRARCHIVE_READ_SOME);
+    if (!old) {
+        return false;
+    }
+    if (brarchive_version(old) != BRARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported version: %u\n", brarchive_version(old));
+        brarchive_close(old);
+        return false;
+    }
+    
+    STATS_PHASE("apply");
+    brarchive_writer *out = open_writer(new_path, old);
+    bool success = out && apply_delta(delta_path, old, out);
+    if (success) {
+        remove_sums(new_path);
+    }
+    if (out && !success) {
+        fprintf(stderr, "Failed to write archive: %s\n", new_path);
+    }
+    if (success && !(options & OPT_C)) {
+        printf("Created archive: %s (from %s)\n", new_path, delta_path);
+    }
+    brarchive_close(old);
+    return success;
+}
+
+static void print_usage(const char *prog_name) {
+    fprintf(stderr, "Usage: %s -r [-u] archive directory\n", prog_name);
+    fprintf(stderr, "       %s -r archive file ...\n", prog_name);
+    fprintf(stderr, "       %s -t [-T list] archive [file ...]\n", prog_name);
+    fprintf(stderr, "       %s -x [-j N] [-T list] archive [file ...]\n", prog_name);
+    fprintf(stderr, "       %s -p [-T list] archive [file ...]\n", prog_name);
+    fprintf(stderr, "       %s -d [-T list] archive file ...\n", prog_name);
+    fprintf(stderr, "       %s -V [-j N] [-T list] archive [file ...]\n", prog_name);
+    fprintf(stderr, "       %s --serve=SOCKET [-j N]\n", prog_name);
+    fprintf(stderr, "       %s --diff [-j N] [--delta=FILE] old new\n", prog_name);
+    fprintf(stderr, "       %s --apply=DELTA old new\n", prog_name);
+    fprintf(stderr, "       %s --merge[=first|last|error] archive input ...\n", prog_name);
+    fprintf(stderr, "       %s --repack[=LOG] archive\n", prog_name);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Operations (one required):\n");
+    fprintf(stderr, "  -r  Replace/add files to archive (creates if doesn't exist);\n");
+    fprintf(stderr, "      a directory rebuilds the archive, files are merged into it\n");
+    fprintf(stderr, "  -t  List archive contents\n");
+    fprintf(stderr, "  -x  Extract files from archive to current directory\n");
+    fprintf(stderr, "  -p  Print file contents to stdout\n");
+    fprintf(stderr, "  -d  Delete files from archive\n");
+    fprintf(stderr, "  -V  Verify the archive layout and that member contents are UTF-8\n");
+    fprintf(stderr, "  --serve=SOCKET  Serve list, stat and read requests on a Unix socket\n");
+    fprintf(stderr, "  --diff  List members added (A), removed (D) and changed (M) from old to new\n");
+    fprintf(stderr, "  --apply=DELTA  Rebuild new from old and a delta written by --diff --delta\n");
+    fprintf(stderr, "  --merge[=POLICY]  Write archive from the members of each input; of members with\n");
+    fprintf(stderr, "                    the same name keep the first, the last, or fail (default)\n");
+    fprintf(stderr, "  --repack[=LOG]  Reorder the data block in the order members are loaded, as read\n");
+    fprintf(stderr, "                  from LOG (one name per line) or guessed for a Bedrock pack\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -c  Suppress 'creating archive' message (silent mode)\n");
+    fprintf(stderr, "  -u  With -r, only read files changed since the last update\n");
+    fprintf(stderr, "  -v  Verbose mode (show extracted files)\n");
+    fprintf(stderr, "  -j N  Use N worker threads for -x, -r, -V, --diff and --serve (0 = one per CPU)\n");
+    fprintf(stderr, "  -T list, --files-from=list  Read names/patterns, one per line (- = stdin)\n");
+    fprintf(stderr, "  --max-memory=SIZE  Cap the streaming buffer (e.g. 64K, 4M)\n");
+    fprintf(stderr, "  --dedup  With -r, store identical files once\n");
+    fprintf(stderr, "  --align=N  With -r, start each member on an N-byte boundary (8 to 4K)\n");
+    fprintf(stderr, "  --split=SIZE  With -r, write volumes archive.001, .002, ... of at most SIZE each;\n");
+    fprintf(stderr, "                -t, -x, -p and -V read the set by the archive name\n");
+    fprintf(stderr, "  --sum  With -r, write member hashes to archive.sum for --skip-unchanged\n");
+    fprintf(stderr, "  --skip-unchanged  With -x, leave files that already have the member's contents\n");
+    fprintf(stderr, "  --io=sync|uring  Batch -x writes and -r reads through io_uring (default sync)\n");
+    fprintf(stderr, "  --compress=none|gzip|zstd  Compress the written archive (default: by .gz/.zst suffix)\n");
+    fprintf(stderr, "  --compress-level=N  Compression level (gzip 1-9, zstd 1-22); -j sets zstd workers\n");
+    fprintf(stderr, "  --delta=FILE  With --diff, write a delta that turns old into new\n");
+    fprintf(stderr, "  --stats  Print per-phase time, read/write syscalls and peak memory to stderr\n");
+    fprintf(stderr, "  --trace=FILE  Write Chrome trace-event JSON to FILE\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Note: Options can be combined (e.g., -rc, -xv)\n");
+    fprintf(stderr, "      Names may be glob patterns: '*' and '?' stay within a directory,\n");
+    fprintf(stderr, "      '**' spans directories (e.g. 'textures/**/*.png')\n");
+    fprintf(stderr, "      gzip and zstd compressed archives are read transparently\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Examples:\n");
+    fprintf(stderr, "  %s -r pack.brarchive ./mydir\n", prog_name);
+    fprintf(stderr, "  %s -rc pack.brarchive ./mydir         # Silent create\n", prog_name);
+    fprintf(stderr, "  %s -ru pack.brarchive ./mydir         # Incremental update\n", prog_name);
+    fprintf(stderr, "  %s -r -j 4 pack.brarchive.zst ./mydir  # Compressed, 4 zstd workers\n", prog_name);
+    fprintf(stderr, "  %s -r pack.brarchive textures/a.png    # Replace/add one member\n", prog_name);
+    fprintf(stderr, "  %s -t pack.brarchive\n", prog_name);
+    fprintf(stderr, "  %s -x pack.brarchive\n", prog_name);
+    fprintf(stderr, "  %s -d pack.brarchive file1.json\n", prog_name);
+    fprintf(stderr, "  %s -xv pack.brarchive                  # Verbose extract\n", prog_name);
+    fprintf(stderr, "  %s -p pack.brarchive file1.json\n", prog_name);
+    fprintf(stderr, "  %s -x pack.brarchive 'textures/**/*.png'\n", prog_name);
+}
+
+/* A kept member during compaction */
+struct kept_entry {
+    uint32_t index;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t new_offset;
+};
+
+/* A maximal run of referenced bytes in the old data block */
+struct copy_run {
+    uint64_t start;
+    uint64_t end;
+    uint64_t new_start;
+};
+
+static int kept_entry_cmp_offset(const void *a, const void *b) {
+    const struct kept_entry *x = a, *y = b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/*
+ * Merge the kept ranges into runs in data-block order and assign every
+ * kept entry its offset in the compacted block.  Bytes referenced only
+ * by removed entries (or by nothing) are dropped; ranges shared by
+ * several entries stay shared.  Returns the number of runs, or -1.
+ */
+static long compact_ranges(struct kept_entry *kept, size_t count, struct copy_run **runs_out, uint64_t *data_size) {
+    struct kept_entry *sorted = malloc((count + 1) * sizeof(struct kept_entry));
+    struct copy_run *runs = malloc((count + 1) * sizeof(struct copy_run));
+    size_t run_count = 0;
+    uint64_t new_pos = 0;
+    size_t i;
+    
+    if (!sorted || !runs) {
+        free(sorted);
+        free(runs);
+        return -1;
+    }
+    if (count > 0) {
+        memcpy(sorted, kept, count * sizeof(struct kept_entry));
+    }
+    qsort(sorted, count, sizeof(struct kept_entry), kept_entry_cmp_offset);
+    
+    for (i = 0; i < count; i++) {
+        uint64_t start = sorted[i].offset;
+        uint64_t end = start + sorted[i].len;
+        if (start == end) {
+            continue;
+        }
+        if (run_count > 0 && start <= runs[run_count - 1].end) {
+            if (end > runs[run_count - 1].end) {
+                new_pos += end - runs[run_count - 1].end;
+                runs[run_count - 1].end = end;
+            }
+            continue;
+        }
+        runs[run_count].start = start;
+        runs[run_count].end = end;
+        runs[run_count].new_start = new_pos;
+        new_pos += end - start;
+        run_count++;
+    }
+    free(sorted);
+    
+    /* Map each entry through the last run starting at or before it */
+    for (i = 0; i < count; i++) {
+        size_t lo = 0, hi = run_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (runs[mid].start <= kept[i].offset) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == 0) {
+            kept[i].new_offset = 0;
+        } else {
+            const struct copy_run *run = &runs[lo - 1];
+            uint64_t off = kept[i].offset < run->end ? kept[i].offset : run->end;
+            kept[i].new_offset = (uint32_t)(run->new_start + (off - run->start));
+        }
+    }
+    
+    *runs_out = runs;
+    *data_size = new_pos;
+    return (long)run_count;
+}
+
+/*
+ * The --align boundary (8 to MAX_ALIGN) every non-empty member of ar
+ * starts on, or 0.  A few members are needed before a common boundary
+ * counts, since small archives line up by chance.
+ */
+static uint64_t archive_alignment(const brarchive *ar) {
+    uint64_t align = MAX_ALIGN;
+    uint32_t count = brarchive_table_count(ar), i, members = 0;
+    
+    for (i = 0; i < count && align >= 8; i++) {
+        struct brarchive_entry entry;
+        if (brarchive_entry(ar, i, &entry) != BRARCHIVE_OK || entry.size == 0) {
+            continue;
+        }
+        while ((brarchive_data_start(ar) + entry.offset) % align != 0) {
+            align >>= 1;
+        }
+        members++;
+    }
+    return align >= 8 && members >= 4 ? align : 0;
+}
+
+/*
+ * Rewrites pack members back to back, dropping --align padding.  Warn
+ * when the archive just written no longer keeps the old alignment.
+ */
+static void warn_alignment_lost(const char *archive_path, uint64_t old_align) {
+    brarchive *ar;
+    
+    if (old_align == 0 || is_stdio(archive_path) || brarchive_open(&ar, archive_path, BRARCHIVE_READ_TABLE) != BRARCHIVE_OK) {
+        return;
+    }
+    if (archive_alignment(ar) < old_align) {
+        fprintf(stderr, "Warning: %s is no longer aligned to %llu bytes; create it again with --align\n",
+                archive_path, (unsigned long long)old_align);
+    }
+    brarchive_close(ar);
+}
+
+/*
+ * Delete files from archive.  The new archive is written next to the old
+ * one and renamed over it, so an interrupted delete leaves the original
+ * intact.  Only the entry table is rebuilt in memory; surviving data is
+ * copied range by range, skipping the removed ranges.
+ */
+static bool delete_from_archive(const char *archive_path, const struct name_matcher *filter, int options) {
+    STATS_PHASE("open");
+    brarchive *reader = open_archive(archive_path, BRARCHIVE_READ_ALL);
+    if (!reader) {
         return false;
     }
     
-    uint32_t entries = read_u32_le(archive_data + 8);
-    uint32_t version = read_u32_le(archive_data + 12);
-    
-    if (version != ARCHIVE_VERSION) {
-        fprintf(stderr, "Unsupported version: %u\n", version);
-        free(archive_data);
+    if (brarchive_version(reader) != BRARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported version: %u\n", brarchive_version(reader));
+        brarchive_close(reader);
         return false;
     }
     
-    /* Create output directory if specified */
-    if (dir_path) {
-        struct stat st;
-        if (stat(dir_path, &st) != 0) {
-            if (mkdir(dir_path, 0755) != 0) {
-                fprintf(stderr, "Failed to create directory: %s\n", dir_path);
-                free(archive_data);
-                return false;
-            }
-        }
+    /* Collect entries to keep */
+    STATS_PHASE("plan");
+    struct kept_entry *kept = malloc(((size_t)brarchive_table_count(reader) + 1) * sizeof(struct kept_entry));
+    if (!kept) {
+        fprintf(stderr, "Memory allocation failed\n");
+        brarchive_close(reader);
+        return false;
     }
     
-    /* Read entries */
-    size_t entry_offset = HEADER_SIZE;
-    size_t data_block_start = HEADER_SIZE + (ENTRY_SIZE * entries);
+    size_t keep_count = 0;
     uint32_t i;
+    int deleted_count = 0;
     
-    for (i = 0; i < entries; i++) {
-        if (entry_offset + ENTRY_SIZE > archive_size) {
-            fprintf(stderr, "Archive corrupted: entry %u out of bounds\n", i);
-            free(archive_data);
-            return false;
-        }
-        
-        uint8_t name_len = archive_data[entry_offset];
-        if (name_len > MAX_NAME_LEN) {
-            fprintf(stderr, "Invalid name length in entry %u\n", i);
-            entry_offset += ENTRY_SIZE;
-            continue;
-        }
-        
-        char name[248];
-        memcpy(name, archive_data + entry_offset + 1, name_len);
-        name[name_len] = '\0';
-        
-        /* Check if this file should be extracted (if filter is specified) */
-        bool should_extract = true;
-        if (filter_count > 0) {
-            should_extract = false;
-            int j;
-            for (j = 0; j < filter_count; j++) {
-                /* Match by basename (like ar does) */
-                const char *basename = strrchr(name, '/');
-                const char *filter_basename = strrchr(file_filter[j], '/');
-                const char *name_to_match = basename ? basename + 1 : name;
-                const char *filter_to_match = filter_basename ? filter_basename + 1 : file_filter[j];
-                if (strcmp(name_to_match, filter_to_match) == 0) {
-                    should_extract = true;
-                    break;
-                }
-            }
-        }
-        
-        if (!should_extract) {
-            entry_offset += ENTRY_SIZE;
-            continue;
-        }
-        
-        uint32_t contents_offset = read_u32_le(archive_data + entry_offset + 248);
-        uint32_t contents_len = read_u32_le(archive_data + entry_offset + 252);
-        
-        /* contents_offset is relative to data block start */
-        size_t actual_offset = data_block_start + contents_offset;
-        if (actual_offset + contents_len > archive_size) {
-            fprintf(stderr, "Archive corrupted: file %s out of bounds\n", name);
-            entry_offset += ENTRY_SIZE;
+    for (i = 0; i < brarchive_table_count(reader); i++) {
+        struct br_ar_entry entry;
+        if (!read_entry(reader, i, &entry)) {
             continue;
         }
+        const char *name = entry.name;
         
-        /* Create output file path */
-        char output_path[PATH_MAX];
-        if (dir_path) {
-            snprintf(output_path, sizeof(output_path), "%s/%s", dir_path, name);
-        } else {
-            /* Extract to current directory (like ar -x) */
-            snprintf(output_path, sizeof(output_path), "%s", name);
-        }
-        
-        /* Create parent directories if needed */
-        char *last_slash = strrchr(output_path, '/');
-        if (last_slash) {
-            *last_slash = '\0';
-            struct stat dir_st;
-            if (stat(output_path, &dir_st) != 0) {
-                /* Create parent directories recursively */
-                char *path = output_path;
-                char *p;
-                for (p = path + 1; *p; p++) {
-                    if (*p == '/') {
-                        *p = '\0';
-                        if (stat(path, &dir_st) != 0) {
-                            mkdir(path, 0755);
-                        }
-                        *p = '/';
-                    }
-                }
-                mkdir(path, 0755);
+        /* Check if this file should be deleted */
+        /* Match by exact name (like ar command) */
+        bool should_delete = matcher_match(filter, name);
+        if (should_delete) {
+            deleted_count++;
+            if (options & OPT_V) {
+                printf("d - %s\n", name);
             }
-            *last_slash = '/';
         }
         
-        /* Write file (contents_offset is relative to data block start) */
-        if (!write_file(output_path, archive_data + actual_offset, contents_len)) {
-            fprintf(stderr, "Failed to write file: %s\n", output_path);
-        } else {
-            if (options & OPT_V) {
-                printf("x - %s\n", name);
+        if (!should_delete) {
+            if (!brarchive_in_bounds(reader, &entry.view)) {
+                fprintf(stderr, "Warning: Invalid entry, skipping: %s\n", name);
+                continue;
             }
+            kept[keep_count].index = i;
+            kept[keep_count].offset = entry.view.offset;
+            kept[keep_count].len = entry.view.size;
+            keep_count++;
         }
-        
-        entry_offset += ENTRY_SIZE;
     }
     
-    free(archive_data);
-    return true;
-}
-
-/* Print archive contents to stdout (with optional file filter) */
-static bool print_archive(const char *archive_path, char **file_filter, int filter_count) {
-    size_t archive_size;
-    uint8_t *archive_data = (uint8_t*)read_file(archive_path, &archive_size);
-    if (!archive_data) {
-        fprintf(stderr, "Failed to read archive: %s\n", archive_path);
+    if (deleted_count == 0) {
+        fprintf(stderr, "No files deleted (files not found in archive)\n");
+        free(kept);
+        brarchive_close(reader);
         return false;
     }
     
-    if (archive_size < HEADER_SIZE) {
-        fprintf(stderr, "Archive too small\n");
-        free(archive_data);
-        return false;
+    /* Recreate archive with remaining files */
+    if (keep_count == 0) {
+        fprintf(stderr, "Warning: All files deleted, archive will be empty\n");
     }
     
-    /* Read header */
-    uint64_t magic = read_u64_le(archive_data);
-    if (magic != MAGIC) {
-        fprintf(stderr, "Invalid magic number: 0x%016llx\n", (unsigned long long)magic);
-        free(archive_data);
+    STATS_PHASE("layout");
+    struct copy_run *runs;
+    uint64_t data_size;
+    long run_count = compact_ranges(kept, keep_count, &runs, &data_size);
+    if (run_count < 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(kept);
+        brarchive_close(reader);
+        return false;
+    }
+    brarchive_writer *out = open_writer(archive_path, reader);
+    if (!out) {
+        free(runs);
+        free(kept);
+        brarchive_close(reader);
         return false;
     }
     
-    uint32_t entries = read_u32_le(archive_data + 8);
+    /* Header and entry table */
+    int err = brarchive_writer_begin(out, (uint32_t)keep_count);
+    size_t k;
+    for (k = 0; err == BRARCHIVE_OK && k < keep_count; k++) {
+        struct brarchive_entry entry;
+        brarchive_entry(reader, kept[k].index, &entry);
+        err = brarchive_writer_entry(out, entry.name, entry.name_len, kept[k].new_offset, kept[k].len);
+    }
     
-    /* Read entries */
-    size_t entry_offset = HEADER_SIZE;
-    size_t data_block_start = HEADER_SIZE + (ENTRY_SIZE * entries);
-    uint32_t i;
+    /* Surviving data, one contiguous run at a time */
+    STATS_PHASE("write");
+    long r;
+    for (r = 0; err == BRARCHIVE_OK && r < run_count; r++) {
+        err = brarchive_writer_copy_range(out, reader, brarchive_data_start(reader) + runs[r].start,
+                                          runs[r].end - runs[r].start);
+    }
     
-    for (i = 0; i < entries; i++) {
-        if (entry_offset + ENTRY_SIZE > archive_size) {
-            fprintf(stderr, "Archive corrupted: entry %u out of bounds\n", i);
-            break;
-        }
-        
-        uint8_t name_len = archive_data[entry_offset];
-        if (name_len > MAX_NAME_LEN) {
-            fprintf(stderr, "Invalid name length in entry %u\n", i);
-            entry_offset += ENTRY_SIZE;
-            continue;
+    if (err == BRARCHIVE_OK) {
+        err = commit_writer(out, archive_path);
+    } else {
+        brarchive_writer_abort(out);
+    }
+    if (err != BRARCHIVE_OK) {
+        fprintf(stderr, "Failed to write archive: %s\n", archive_path);
+    } else {
+        STATS_COUNT(keep_count, data_size);
+        warn_alignment_lost(archive_path, archive_alignment(reader));
+    }
+    
+    free(runs);
+    free(kept);
+    brarchive_close(reader);
+    
+    return err == BRARCHIVE_OK;
+}
+
+/* Byte order of two names, as file_list_sort() and brarchive_find() see it */
+static int name_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (r != 0) {
+        return r;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/* --merge conflict policies: which of several members with one name is kept */
+#define MERGE_ERROR 0
+#define MERGE_FIRST 1
+#define MERGE_LAST  2
+
+/* A member of one of the merged archives */
+struct merge_member {
+    const char *name;
+    size_t name_len;
+    uint32_t input;
+    uint32_t index;
+    uint32_t offset;
+    uint32_t len;
+    size_t kept;                /* Position in its archive's kept entries */
+};
+
+static int merge_member_cmp(const void *a, const void *b) {
+    const struct merge_member *x = a, *y = b;
+    int r = name_cmp(x->name, x->name_len, y->name, y->name_len);
+    if (r != 0) {
+        return r;
+    }
+    if (x->input != y->input) {
+        return x->input < y->input ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/*
+ * Merge archives into one, like extracting them over each other and
+ * creating an archive from the tree, without either.  The combined table
+ * is sorted by name; each input's kept ranges are then copied in data
+ * order (as for delete), so contents never pass through a user-space
+ * buffer where the kernel can copy them.
+ */
+static bool merge_archives(const char *archive_path, char **inputs, int input_count, int policy, int options) {
+    STATS_PHASE("open");
+    brarchive **readers = calloc((size_t)input_count, sizeof(brarchive *));
+    struct merge_member *members = NULL;
+    struct kept_entry **kept = calloc((size_t)input_count, sizeof(struct kept_entry *));
+    size_t *keep_count = calloc((size_t)input_count, sizeof(size_t));
+    struct copy_run **runs = calloc((size_t)input_count, sizeof(struct copy_run *));
+    long *run_count = calloc((size_t)input_count, sizeof(long));
+    uint64_t *base = calloc((size_t)input_count + 1, sizeof(uint64_t));
+    size_t member_count = 0, total = 0, chosen = 0, conflicts = 0;
+    brarchive_writer *out = NULL;
+    int err = BRARCHIVE_EIO;
+    bool ok = readers && kept && keep_count && runs && run_count && base;
+    size_t k;
+    int n;
+    
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+    for (n = 0; ok && n < input_count; n++) {
+        if (!(readers[n] = open_archive(inputs[n], BRARCHIVE_READ_ALL))) {
+            ok = false;
+        } else if (brarchive_version(readers[n]) != BRARCHIVE_VERSION) {
+            fprintf(stderr, "Unsupported version: %u\n", brarchive_version(readers[n]));
+            ok = false;
+        } else {
+            total += brarchive_table_count(readers[n]);
         }
-        
-        char name[248];
-        memcpy(name, archive_data + entry_offset + 1, name_len);
-        name[name_len] = '\0';
-        
-        /* Check if this file should be printed (if filter is specified) */
-        bool should_print = true;
-        if (filter_count > 0) {
-            should_print = false;
-            int j;
-            for (j = 0; j < filter_count; j++) {
-                /* Match by basename (like ar does) */
-                const char *basename = strrchr(name, '/');
-                const char *filter_basename = strrchr(file_filter[j], '/');
-                const char *name_to_match = basename ? basename + 1 : name;
-                const char *filter_to_match = filter_basename ? filter_basename + 1 : file_filter[j];
-                if (strcmp(name_to_match, filter_to_match) == 0) {
-                    should_print = true;
-                    break;
-                }
+    }
+    
+    /* Every member of every archive, in name order and then input order */
+    if (ok) {
+        STATS_PHASE("plan");
+        members = malloc((total + 1) * sizeof(struct merge_member));
+        for (n = 0; members && n < input_count; n++) {
+            kept[n] = malloc(((size_t)brarchive_table_count(readers[n]) + 1) * sizeof(struct kept_entry));
+            if (!kept[n]) {
+                break;
             }
         }
-        
-        if (should_print) {
-            uint32_t contents_offset = read_u32_le(archive_data + entry_offset + 248);
-            uint32_t contents_len = read_u32_le(archive_data + entry_offset + 252);
-            size_t actual_offset = data_block_start + contents_offset;
-            
-            if (actual_offset + contents_len > archive_size) {
-                fprintf(stderr, "Archive corrupted: file %s out of bounds\n", name);
-                entry_offset += ENTRY_SIZE;
+        if (!members || n < input_count) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ok = false;
+        }
+    }
+    for (n = 0; ok && n < input_count; n++) {
+        uint32_t i;
+        for (i = 0; i < brarchive_table_count(readers[n]); i++) {
+            struct br_ar_entry entry;
+            if (!read_entry(readers[n], i, &entry)) {
                 continue;
             }
-            
-            /* Print file contents to stdout */
-            fwrite(archive_data + actual_offset, 1, contents_len, stdout);
+            if (!brarchive_in_bounds(readers[n], &entry.view)) {
+                fprintf(stderr, "Warning: Invalid entry, skipping: %s\n", entry.name);
+                continue;
+            }
+            members[member_count].name = entry.view.name;
+            members[member_count].name_len = entry.view.name_len;
+            members[member_count].input = (uint32_t)n;
+            members[member_count].index = i;
+            members[member_count].offset = entry.view.offset;
+            members[member_count].len = entry.view.size;
+            member_count++;
         }
-        
-        entry_offset += ENTRY_SIZE;
+    }
+    if (ok) {
+        qsort(members, member_count, sizeof(struct merge_member), merge_member_cmp);
     }
     
-    free(archive_data);
-    return true;
+    /* Keep one member of each name, as the policy says */
+    for (k = 0; ok && k < member_count; ) {
+        size_t end = k + 1;
+        while (end < member_count &&
+               name_cmp(members[k].name, members[k].name_len, members[end].name, members[end].name_len) == 0) {
+            end++;
+        }
+        size_t pick = policy == MERGE_LAST ? end - 1 : k;
+        if (end - k > 1) {
+            if (policy == MERGE_ERROR) {
+                fprintf(stderr, "Conflict: %.*s is in %s and %s\n", (int)members[k].name_len, members[k].name,
+                        inputs[members[k].input], inputs[members[k + 1].input]);
+                ok = false;
+                break;
+            }
+            conflicts++;
+            if (options & OPT_V) {
+                printf("%.*s: kept from %s\n", (int)members[pick].name_len, members[pick].name,
+                       inputs[members[pick].input]);
+            }
+        }
+        struct merge_member *m = &members[pick];
+        struct kept_entry *e = &kept[m->input][keep_count[m->input]];
+        e->index = m->index;
+        e->offset = m->offset;
+        e->len = m->len;
+        m->kept = keep_count[m->input]++;
+        members[chosen++] = *m;
+        k = end;
+    }
+    
+    /* Each archive's ranges are compacted and placed after the last one's */
+    if (ok) {
+        STATS_PHASE("layout");
+    }
+    for (n = 0; ok && n < input_count; n++) {
+        uint64_t data_size;
+        if ((run_count[n] = compact_ranges(kept[n], keep_count[n], &runs[n], &data_size)) < 0) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ok = false;
+        }
+        base[n + 1] = base[n] + (ok ? data_size : 0);
+    }
+    if (ok) {
+        out = open_writer(archive_path, NULL);
+        ok = out != NULL;
+    }
+    
+    if (ok) {
+        err = brarchive_writer_begin(out, (uint32_t)chosen);
+        for (k = 0; err == BRARCHIVE_OK && k < chosen; k++) {
+            const struct merge_member *m = &members[k];
+            err = brarchive_writer_entry(out, m->name, m->name_len,
+                                         base[m->input] + kept[m->input][m->kept].new_offset, m->len);
+        }
+        STATS_PHASE("write");
+        for (n = 0; err == BRARCHIVE_OK && n < input_count; n++) {
+            long r;
+            for (r = 0; err == BRARCHIVE_OK && r < run_count[n]; r++) {
+                err = brarchive_writer_copy_range(out, readers[n], brarchive_data_start(readers[n]) + runs[n][r].start,
+                                                  runs[n][r].end - runs[n][r].start);
+            }
+        }
+        if (err == BRARCHIVE_OK) {
+            err = commit_writer(out, archive_path);
+        } else {
+            brarchive_writer_abort(out);
+        }
+        if (err != BRARCHIVE_OK) {
+            fprintf(stderr, "Failed to write archive: %s: %s\n", archive_path, brarchive_strerror(err));
+            ok = false;
+        } else {
+            uint64_t align = MAX_ALIGN;
+            for (n = 0; n < input_count; n++) {
+                uint64_t input_align = archive_alignment(readers[n]);
+                align = input_align < align ? input_align : align;
+            }
+            STATS_COUNT(chosen, base[input_count]);
+            warn_alignment_lost(archive_path, align);
+            if (!(options & OPT_C)) {
+                printf("Created archive: %s (%zu files from %d archives, %zu conflicts)\n", archive_path,
+                       chosen, input_count, conflicts);
+            }
+        }
+    }
+    
+    for (n = 0; n < input_count; n++) {
+        if (runs) {
+            free(runs[n]);
+        }
+        if (kept) {
+            free(kept[n]);
+        }
+        if (readers) {
+            brarchive_close(readers[n]);
+        }
+    }
+    free(members);
+    free(kept);
+    free(keep_count);
+    free(runs);
+    free(run_count);
+    free(base);
+    free(readers);
+    return ok;
 }
 
-/* List archive contents (with optional file filter) */
-static bool list_archive(const char *archive_path, char **file_filter, int filter_count) {
-    size_t archive_size;
-    uint8_t *archive_data = (uint8_t*)read_file(archive_path, &archive_size);
-    if (!archive_data) {
-        fprintf(stderr, "Failed to read archive: %s\n", archive_path);
-        return false;
+/* A member of a repacked archive, and where its contents go */
+struct repack_member {
+    uint32_t index;
+    uint32_t offset;
+    uint32_t len;
+    uint32_t logged;            /* Line of the access log that first read it, or UINT32_MAX */
+    uint32_t rank;              /* bedrock_rank() */
+    uint32_t order;             /* Position in the load order */
+    uint32_t run;               /* Run holding its contents, or UINT32_MAX if empty */
+};
+
+/* A run of overlapping member contents, moved as one */
+struct repack_run {
+    uint64_t start;
+    uint64_t end;
+    uint64_t new_start;
+    uint32_t first;             /* Earliest load order of a member in it */
+};
+
+/* Whether a path has a directory named dir */
+static bool path_has_dir(const char *name, size_t len, const char *dir) {
+    size_t dir_len = strlen(dir);
+    size_t i = 0;
+    while (i + dir_len < len) {
+        if (memcmp(name + i, dir, dir_len) == 0 && name[i + dir_len] == '/') {
+            return true;
+        }
+        const char *slash = memchr(name + i, '/', len - i);
+        if (!slash) {
+            break;
+        }
+        i = (size_t)(slash - name) + 1;
+    }
+    return false;
+}
+
+static bool name_ends_with(const char *name, size_t len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && memcmp(name + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+/*
+ * Where a member falls in the order Minecraft: Bedrock Edition loads a
+ * pack: the manifest, then entity definitions, then other definitions,
+ * then textures, then the rest (sounds and so on).
+ */
+static uint32_t bedrock_rank(const char *name, size_t len) {
+    const char *base = name + len;
+    while (base > name && base[-1] != '/') {
+        base--;
     }
+    size_t base_len = len - (size_t)(base - name);
     
-    if (archive_size < HEADER_SIZE) {
-        fprintf(stderr, "Archive too small\n");
-        free(archive_data);
-        return false;
+    if ((base_len == 13 && memcmp(base, "manifest.json", 13) == 0) ||
+        (base_len == 18 && memcmp(base, "pack_manifest.json", 18) == 0)) {
+        return 0;
+    }
+    if (path_has_dir(name, len, "textures") || name_ends_with(name, len, ".png") ||
+        name_ends_with(name, len, ".tga") || name_ends_with(name, len, ".jpg")) {
+        return 3;
+    }
+    if (path_has_dir(name, len, "entity") || path_has_dir(name, len, "entities")) {
+        return 1;
+    }
+    return name_ends_with(name, len, ".json") ? 2 : 4;
+}
+
+static int repack_load_cmp(const void *a, const void *b) {
+    const struct repack_member *x = *(const struct repack_member *const *)a;
+    const struct repack_member *y = *(const struct repack_member *const *)b;
+    if (x->logged != y->logged) {
+        return x->logged < y->logged ? -1 : 1;
+    }
+    if (x->rank != y->rank) {
+        return x->rank < y->rank ? -1 : 1;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static int repack_offset_cmp(const void *a, const void *b) {
+    const struct repack_member *x = *(const struct repack_member *const *)a;
+    const struct repack_member *y = *(const struct repack_member *const *)b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
     }
+    return (x->len < y->len) - (x->len > y->len);
+}
+
+static int repack_run_cmp(const void *a, const void *b) {
+    const struct repack_run *x = *(const struct repack_run *const *)a;
+    const struct repack_run *y = *(const struct repack_run *const *)b;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/* Note the first line of the access log naming each member */
+static bool read_access_log(brarchive *ar, const char *log_path, struct repack_member *members,
+                            const uint32_t *slot_of, size_t *logged) {
+    FILE *f = is_stdio(log_path) ? stdin : fopen(log_path, "rb");
+    char line[BRARCHIVE_MAX_NAME + 3];
+    uint32_t line_no = 0;
     
-    /* Read header */
-    uint64_t magic = read_u64_le(archive_data);
-    if (magic != MAGIC) {
-        fprintf(stderr, "Invalid magic number: 0x%016llx\n", (unsigned long long)magic);
-        free(archive_data);
+    if (!f) {
+        fprintf(stderr, "Failed to read access log: %s\n", log_path);
+        return false;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        uint32_t index;
+        line_no++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            len--;
+        }
+        if (len > 0 && brarchive_find(ar, line, len, &index) == BRARCHIVE_OK &&
+            slot_of[index] != UINT32_MAX && members[slot_of[index]].logged == UINT32_MAX) {
+            members[slot_of[index]].logged = line_no;
+            (*logged)++;
+        }
+    }
+    bool ok = !ferror(f);
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to read access log: %s\n", log_path);
+    }
+    return ok;
+}
+
+/*
+ * Rewrite the data block in load order: members named by an access log
+ * (one name per line, in the order they were read) first, the rest by
+ * bedrock_rank(), so a cold load reads the file front to back.  Members
+ * whose contents overlap (as --dedup shares them) move as one run, which
+ * is placed where its first member is loaded.  Gaps and ranges no entry
+ * refers to are dropped.  The entry table keeps its order.
+ */
+static bool repack_archive(const char *archive_path, const char *log_path, int options) {
+    STATS_PHASE("open");
+    brarchive *reader = open_archive(archive_path, BRARCHIVE_READ_SOME);
+    if (!reader) {
+        return false;
+    }
+    if (brarchive_version(reader) != BRARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported version: %u\n", brarchive_version(reader));
+        brarchive_close(reader);
         return false;
     }
     
-    uint32_t entries = read_u32_le(archive_data + 8);
-    
-    /* Read entries */
-    size_t entry_offset = HEADER_SIZE;
+    STATS_PHASE("plan");
+    uint32_t table_count = brarchive_table_count(reader);
+    struct repack_member *members = malloc(((size_t)table_count + 1) * sizeof(struct repack_member));
+    struct repack_member **sorted = malloc(((size_t)table_count + 1) * sizeof(struct repack_member *));
+    struct repack_run *runs = malloc(((size_t)table_count + 1) * sizeof(struct repack_run));
+    struct repack_run **run_order = malloc(((size_t)table_count + 1) * sizeof(struct repack_run *));
+    uint32_t *slot_of = malloc(((size_t)table_count + 1) * sizeof(uint32_t));
+    size_t count = 0, run_count = 0, logged = 0, k;
+    uint64_t new_pos = 0;
+    brarchive_writer *out = NULL;
+    int err = BRARCHIVE_EIO;
+    bool ok = members && sorted && runs && run_order && slot_of;
     uint32_t i;
     
-    for (i = 0; i < entries; i++) {
-        if (entry_offset + ENTRY_SIZE > archive_size) {
-            fprintf(stderr, "Archive corrupted: entry %u out of bounds\n", i);
-            break;
+    if (!ok) {
+        fprintf(stderr, "Memory allocation failed\n");
+    }
+    for (i = 0; ok && i < table_count; i++) {
+        struct br_ar_entry entry;
+        slot_of[i] = UINT32_MAX;
+        if (!read_entry(reader, i, &entry)) {
+            continue;
         }
-        
-        uint8_t name_len = archive_data[entry_offset];
-        if (name_len > MAX_NAME_LEN) {
-            fprintf(stderr, "Invalid name length in entry %u\n", i);
-            entry_offset += ENTRY_SIZE;
+        if (!brarchive_in_bounds(reader, &entry.view)) {
+            fprintf(stderr, "Warning: Invalid entry, skipping: %s\n", entry.name);
             continue;
         }
-        
-        char name[248];
-        memcpy(name, archive_data + entry_offset + 1, name_len);
-        name[name_len] = '\0';
-        
-        /* Check if this file should be listed (if filter is specified) */
-        bool should_list = true;
-        if (filter_count > 0) {
-            should_list = false;
-            int j;
-            for (j = 0; j < filter_count; j++) {
-                /* Match by basename (like ar does) */
-                const char *basename = strrchr(name, '/');
-                const char *filter_basename = strrchr(file_filter[j], '/');
-                const char *name_to_match = basename ? basename + 1 : name;
-                const char *filter_to_match = filter_basename ? filter_basename + 1 : file_filter[j];
-                if (strcmp(name_to_match, filter_to_match) == 0) {
-                    should_list = true;
-                    break;
-                }
-            }
+        members[count].index = i;
+        members[count].offset = entry.view.offset;
+        members[count].len = entry.view.size;
+        members[count].logged = UINT32_MAX;
+        members[count].rank = bedrock_rank(entry.view.name, entry.view.name_len);
+        members[count].run = UINT32_MAX;
+        slot_of[i] = (uint32_t)count++;
+    }
+    if (ok && log_path) {
+        ok = read_access_log(reader, log_path, members, slot_of, &logged);
+    }
+    
+    /* Load order, then runs of overlapping contents in file order */
+    if (ok) {
+        for (k = 0; k < count; k++) {
+            sorted[k] = &members[k];
         }
-        
-        if (should_list) {
-            printf("%s\n", name);
+        qsort(sorted, count, sizeof(struct repack_member *), repack_load_cmp);
+        for (k = 0; k < count; k++) {
+            sorted[k]->order = (uint32_t)k;
         }
-        
-        entry_offset += ENTRY_SIZE;
+        qsort(sorted, count, sizeof(struct repack_member *), repack_offset_cmp);
+    }
+    for (k = 0; ok && k < count; k++) {
+        struct repack_member *m = sorted[k];
+        uint64_t start = m->offset, end = start + m->len;
+        if (start == end) {
+            continue;
+        }
+        if (run_count == 0 || start >= runs[run_count - 1].end) {
+            runs[run_count].start = start;
+            runs[run_count].end = end;
+            runs[run_count].first = m->order;
+            run_order[run_count] = &runs[run_count];
+            run_count++;
+        } else {
+            struct repack_run *run = &runs[run_count - 1];
+            run->end = end > run->end ? end : run->end;
+            run->first = m->order < run->first ? m->order : run->first;
+        }
+        m->run = (uint32_t)(run_count - 1);
+    }
+    if (ok) {
+        qsort(run_order, run_count, sizeof(struct repack_run *), repack_run_cmp);
+        for (k = 0; k < run_count; k++) {
+            run_order[k]->new_start = new_pos;
+            new_pos += run_order[k]->end - run_order[k]->start;
+        }
+        STATS_PHASE("write");
+        out = open_writer(archive_path, reader);
+        ok = out != NULL;
     }
     
-    free(archive_data);
-    return true;
-}
-
-static void print_usage(const char *prog_name) {
-    fprintf(stderr, "Usage: %s -r archive directory\n", prog_name);
-    fprintf(stderr, "       %s -t archive [file ...]\n", prog_name);
-    fprintf(stderr, "       %s -x archive [file ...]\n", prog_name);
-    fprintf(stderr, "       %s -p archive [file ...]\n", prog_name);
-    fprintf(stderr, "       %s -d archive file ...\n", prog_name);
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Operations (one required):\n");
-    fprintf(stderr, "  -r  Replace/add files to archive (creates if doesn't exist)\n");
-    fprintf(stderr, "  -t  List archive contents\n");
-    fprintf(stderr, "  -x  Extract files from archive to current directory\n");
-    fprintf(stderr, "  -p  Print file contents to stdout\n");
-    fprintf(stderr, "  -d  Delete files from archive\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  -c  Suppress 'creating archive' message (silent mode)\n");
-    fprintf(stderr, "  -v  Verbose mode (show extracted files)\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Note: Options can be combined (e.g., -rc, -xv)\n");
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Examples:\n");
-    fprintf(stderr, "  %s -r pack.brarchive ./mydir\n", prog_name);
-    fprintf(stderr, "  %s -rc pack.brarchive ./mydir         # Silent create\n", prog_name);
-    fprintf(stderr, "  %s -t pack.brarchive\n", prog_name);
-    fprintf(stderr, "  %s -x pack.brarchive\n", prog_name);
-    fprintf(stderr, "  %s -d pack.brarchive file1.json\n", prog_name);
-    fprintf(stderr, "  %s -xv pack.brarchive                  # Verbose extract\n", prog_name);
-    fprintf(stderr, "  %s -p pack.brarchive file1.json\n", prog_name);
+    if (ok) {
+        err = brarchive_writer_begin(out, (uint32_t)count);
+        for (k = 0; err == BRARCHIVE_OK && k < count; k++) {
+            const struct repack_member *m = &members[k];
+            struct brarchive_entry entry;
+            uint64_t offset = 0;
+            if (m->run != UINT32_MAX) {
+                offset = runs[m->run].new_start + (m->offset - runs[m->run].start);
+            }
+            brarchive_entry(reader, m->index, &entry);
+            err = brarchive_writer_entry(out, entry.name, entry.name_len, offset, m->len);
+        }
+        for (k = 0; err == BRARCHIVE_OK && k < run_count; k++) {
+            err = brarchive_writer_copy_range(out, reader, brarchive_data_start(reader) + run_order[k]->start,
+                                              run_order[k]->end - run_order[k]->start);
+        }
+        if (err == BRARCHIVE_OK) {
+            err = commit_writer(out, archive_path);
+        } else {
+            brarchive_writer_abort(out);
+        }
+        if (err != BRARCHIVE_OK) {
+            fprintf(stderr, "Failed to write archive: %s\n", archive_path);
+            ok = false;
+        } else {
+            uint64_t old_size = brarchive_size(reader) - brarchive_data_start(reader);
+            STATS_COUNT(count, new_pos);
+            warn_alignment_lost(archive_path, archive_alignment(reader));
+            if (!(options & OPT_C)) {
+                printf("Repacked archive: %s (%zu files, %zu from the access log, %llu bytes of gaps dropped)\n",
+                       archive_path, count, logged,
+                       (unsigned long long)(old_size > new_pos ? old_size - new_pos : 0));
+            }
+        }
+    }
+    
+    free(members);
+    free(sorted);
+    free(runs);
+    free(run_order);
+    free(slot_of);
+    brarchive_close(reader);
+    return ok;
+}
+
+/* Member name for a file named on the command line: the path without leading "./" or "/" */
+static const char *member_name(const char *path) {
+    for (;;) {
+        if (path[0] == '/') {
+            path++;
+        } else if (path[0] == '.' && path[1] == '/') {
+            path += 2;
+        } else {
+            return path;
+        }
+    }
+}
+
+/* One entry of a rewritten table: an old member, a new file, or both */
+struct member_slot {
+    uint32_t index;             /* Old entry, or UINT32_MAX for an appended file */
+    size_t added;               /* New file, or SIZE_MAX to keep the old contents */
+};
+
+/* Name of a slot's member */
+static const char *slot_name(brarchive *ar, const struct file_list *added, const struct member_slot *slot, size_t *len) {
+    if (slot->index == UINT32_MAX) {
+        *len = strlen(added->names[slot->added]);
+        return added->names[slot->added];
+    }
+    struct brarchive_entry entry;
+    brarchive_entry(ar, slot->index, &entry);
+    *len = entry.name_len;
+    return entry.name;
 }
 
-/* Delete files from archive */
-static bool delete_from_archive(const char *archive_path, char **files_to_delete, int file_count, int options) {
-    /* Read existing archive */
-    size_t archive_size;
-    uint8_t *archive_data = (uint8_t*)read_file(archive_path, &archive_size);
-    if (!archive_data) {
-        fprintf(stderr, "Failed to read archive: %s\n", archive_path);
+/* Merge the sorted slots [0, split) and [split, count) by name */
+static bool merge_slots(brarchive *ar, const struct file_list *added, struct member_slot *slots,
+                        size_t split, size_t count) {
+    struct member_slot *merged = malloc((count + 1) * sizeof(struct member_slot));
+    size_t a = 0, b = split, k = 0;
+    if (!merged) {
         return false;
     }
+    while (a < split || b < count) {
+        bool take_a = (b == count);
+        if (a < split && b < count) {
+            size_t a_len, b_len;
+            const char *a_name = slot_name(ar, added, &slots[a], &a_len);
+            const char *b_name = slot_name(ar, added, &slots[b], &b_len);
+            take_a = name_cmp(a_name, a_len, b_name, b_len) <= 0;
+        }
+        merged[k++] = take_a ? slots[a++] : slots[b++];
+    }
+    memcpy(slots, merged, count * sizeof(struct member_slot));
+    free(merged);
+    return true;
+}
+
+/*
+ * Replace or add individual files, like "ar r archive file...".  Members
+ * with the same name as a file are replaced in place in the entry table;
+ * other files are appended.  Kept members are copied range by range from
+ * the old data block (as for delete) and the new contents are streamed
+ * after them, so only the table and the named files pass through memory.
+ */
+static bool replace_in_archive(const char *archive_path, char **paths, int path_count, int options) {
+    struct file_list added;
+    struct name_map names;
+    bool success = true;
+    int a;
     
-    if (archive_size < HEADER_SIZE) {
-        fprintf(stderr, "Archive too small\n");
-        free(archive_data);
+    /* A name given more than once takes the last file */
+    STATS_PHASE("walk");
+    file_list_init(&added);
+    if (!name_map_init(&names, (size_t)path_count)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        file_list_free(&added);
         return false;
     }
-    
-    uint64_t magic = read_u64_le(archive_data);
-    if (magic != MAGIC) {
-        fprintf(stderr, "Invalid magic number\n");
-        free(archive_data);
+    for (a = path_count - 1; a >= 0; a--) {
+        const char *name = member_name(paths[a]);
+        if (*name == '\0' || strlen(name) > BRARCHIVE_MAX_NAME) {
+            fprintf(stderr, "Invalid member name: %s\n", paths[a]);
+            success = false;
+        } else {
+            name_map_put(&names, name, strlen(name), (uint32_t)a);
+        }
+    }
+    for (a = 0; success && a < path_count; a++) {
+        const char *name = member_name(paths[a]);
+        struct stat st;
+        uint32_t last = UINT32_MAX;
+        
+        name_map_get(&names, name, strlen(name), &last);
+        if (last != (uint32_t)a) {
+            continue;
+        }
+        if (stat(paths[a], &st) != 0 || !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Not a regular file: %s\n", paths[a]);
+            success = false;
+        } else if (!file_list_add(&added, paths[a], name, (uint64_t)st.st_size, stat_mtime_ns(&st))) {
+            fprintf(stderr, "Memory allocation failed\n");
+            success = false;
+        }
+    }
+    name_map_free(&names);
+    if (success && !file_list_sort(&added)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        success = false;
+    }
+    if (!success) {
+        file_list_free(&added);
         return false;
     }
     
-    uint32_t entries = read_u32_le(archive_data + 8);
-    uint32_t version = read_u32_le(archive_data + 12);
+    /* A missing archive is created from the files alone */
+    STATS_PHASE("plan");
+    brarchive *reader = NULL;
+    struct stat archive_st;
+    if (!is_stdio(archive_path) && stat(archive_path, &archive_st) == 0) {
+        if (!(reader = open_archive(archive_path, BRARCHIVE_READ_ALL))) {
+            file_list_free(&added);
+            return false;
+        }
+        if (brarchive_version(reader) != BRARCHIVE_VERSION) {
+            fprintf(stderr, "Unsupported version: %u\n", brarchive_version(reader));
+            brarchive_close(reader);
+            file_list_free(&added);
+            return false;
+        }
+    }
+    uint32_t old_count = reader ? brarchive_table_count(reader) : 0;
     
-    if (version != ARCHIVE_VERSION) {
-        fprintf(stderr, "Unsupported version: %u\n", version);
-        free(archive_data);
+    struct kept_entry *kept = malloc(((size_t)old_count + 1) * sizeof(struct kept_entry));
+    struct member_slot *slots = malloc(((size_t)old_count + added.count) * sizeof(struct member_slot));
+    bool *replaces = calloc(added.count, sizeof(bool));
+    uint64_t *added_offsets = malloc(added.count * sizeof(uint64_t));
+    if (!kept || !slots || !replaces || !added_offsets ||
+        !name_map_init(&names, added.count)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(kept);
+        free(slots);
+        free(replaces);
+        free(added_offsets);
+        brarchive_close(reader);
+        file_list_free(&added);
         return false;
     }
+    size_t j;
+    for (j = 0; j < added.count; j++) {
+        name_map_put(&names, added.names[j], strlen(added.names[j]), (uint32_t)j);
+    }
     
-    /* Collect entries to keep */
-    struct file_list files;
-    file_list_init(&files);
-    
-    size_t entry_offset = HEADER_SIZE;
-    size_t data_block_start = HEADER_SIZE + (ENTRY_SIZE * entries);
+    /*
+     * Walk the old table: each entry is replaced, kept or dropped (if
+     * invalid).  Only the first entry of a duplicated name is replaced.
+     */
+    size_t keep_count = 0;
+    size_t slot_count = 0;
+    size_t replaced_count = 0;
+    size_t k;
     uint32_t i;
-    int deleted_count = 0;
-    
-    for (i = 0; i < entries; i++) {
-        uint8_t name_len = archive_data[entry_offset];
-        if (name_len > MAX_NAME_LEN) {
-            entry_offset += ENTRY_SIZE;
+    for (i = 0; i < old_count; i++) {
+        struct br_ar_entry entry;
+        uint32_t match;
+        if (!read_entry(reader, i, &entry)) {
             continue;
         }
         
-        char name[248];
-        memcpy(name, archive_data + entry_offset + 1, name_len);
-        name[name_len] = '\0';
-        
-        /* Check if this file should be deleted */
-        /* Match by exact name (like ar command) */
-        bool should_delete = false;
-        int j;
-        for (j = 0; j < file_count; j++) {
-            if (strcmp(name, files_to_delete[j]) == 0) {
-                should_delete = true;
-                deleted_count++;
-                if (options & OPT_V) {
-                    printf("d - %s\n", name);
-                }
-                break;
-            }
+        if (name_map_get(&names, entry.name, entry.view.name_len, &match) && !replaces[match]) {
+            replaces[match] = true;
+            replaced_count++;
+            slots[slot_count].index = i;
+            slots[slot_count].added = match;
+            slot_count++;
+            continue;
         }
         
-        if (!should_delete) {
-            /* Keep this file - read its contents */
-            uint32_t contents_offset = read_u32_le(archive_data + entry_offset + 248);
-            uint32_t contents_len = read_u32_le(archive_data + entry_offset + 252);
-            size_t actual_offset = data_block_start + contents_offset;
-            
-            if (actual_offset + contents_len > archive_size) {
-                fprintf(stderr, "Warning: Invalid entry, skipping: %s\n", name);
-                entry_offset += ENTRY_SIZE;
-                continue;
-            }
-            
-            char *content = malloc(contents_len);
-            if (content) {
-                memcpy(content, archive_data + actual_offset, contents_len);
-                
-                files.paths[files.count] = NULL;
-#ifdef HAVE_STRDUP
-                files.names[files.count] = strdup(name);
-#else
-                size_t name_len_dup = strlen(name) + 1;
-                files.names[files.count] = malloc(name_len_dup);
-                if (files.names[files.count]) {
-                    memcpy(files.names[files.count], name, name_len_dup);
-                }
-#endif
-                files.contents[files.count] = content;
-                files.sizes[files.count] = contents_len;
-                files.count++;
-            }
+        if (!brarchive_in_bounds(reader, &entry.view)) {
+            fprintf(stderr, "Warning: Invalid entry, skipping: %s\n", entry.name);
+            continue;
         }
-        
-        entry_offset += ENTRY_SIZE;
-    }
-    
-    free(archive_data);
-    
-    if (deleted_count == 0) {
-        fprintf(stderr, "No files deleted (files not found in archive)\n");
-        file_list_free(&files);
-        return false;
+        kept[keep_count].index = i;
+        kept[keep_count].offset = entry.view.offset;
+        kept[keep_count].len = entry.view.size;
+        keep_count++;
+        slots[slot_count].index = i;
+        slots[slot_count].added = SIZE_MAX;
+        slot_count++;
     }
+    name_map_free(&names);
     
-    /* Recreate archive with remaining files */
-    if (files.count == 0) {
-        fprintf(stderr, "Warning: All files deleted, archive will be empty\n");
+    /* New files go in name order, merged into a sorted table or else appended */
+    size_t old_slots = slot_count;
+    bool sorted = true;
+    for (k = 1; sorted && k < old_slots; k++) {
+        size_t a_len, b_len;
+        const char *a_name = slot_name(reader, &added, &slots[k - 1], &a_len);
+        const char *b_name = slot_name(reader, &added, &slots[k], &b_len);
+        sorted = name_cmp(a_name, a_len, b_name, b_len) <= 0;
     }
-    
-    /* Calculate total size needed */
-    size_t header_and_entries_size = HEADER_SIZE + (ENTRY_SIZE * files.count);
-    size_t data_offset = header_and_entries_size;
-    size_t total_data_size = 0;
-    
-    for (i = 0; i < files.count; i++) {
-        total_data_size += files.sizes[i];
+    for (j = 0; j < added.count; j++) {
+        if (!replaces[j]) {
+            slots[slot_count].index = UINT32_MAX;
+            slots[slot_count].added = j;
+            slot_count++;
+        }
     }
-    
-    size_t total_size = header_and_entries_size + total_data_size;
-    uint8_t *archive = malloc(total_size);
-    if (!archive) {
+    if (sorted && !merge_slots(reader, &added, slots, old_slots, slot_count)) {
         fprintf(stderr, "Memory allocation failed\n");
-        file_list_free(&files);
-        return false;
+        success = false;
     }
     
-    memset(archive, 0, total_size);
+    /* Kept data is compacted first; new contents follow it */
+    STATS_PHASE("layout");
+    struct copy_run *runs = NULL;
+    uint64_t data_size;
+    long run_count = success ? compact_ranges(kept, keep_count, &runs, &data_size) : 0;
+    brarchive_writer *out = NULL;
+    int err = BRARCHIVE_OK;
     
-    /* Write header */
-    write_u64_le(archive, MAGIC);
-    write_u32_le(archive + 8, (uint32_t)files.count);
-    write_u32_le(archive + 12, ARCHIVE_VERSION);
+    if (run_count < 0) {
+        fprintf(stderr, "Memory allocation failed\n");
+        success = false;
+    } else if (success) {
+        for (j = 0; j < added.count; j++) {
+            added_offsets[j] = data_size;
+            data_size += added.sizes[j];
+        }
+        out = open_writer(archive_path, reader);
+        success = (out != NULL);
+    }
     
-    /* Write entry descriptors and calculate offsets */
-    entry_offset = HEADER_SIZE;
-    size_t data_pos = data_offset;
+    /* Header and entry table */
+    if (success) {
+        err = brarchive_writer_begin(out, (uint32_t)slot_count);
+    }
+    size_t kept_pos = 0;
+    for (k = 0; success && err == BRARCHIVE_OK && k < slot_count; k++) {
+        j = slots[k].added;
+        if (j == SIZE_MAX) {
+            struct brarchive_entry entry;
+            brarchive_entry(reader, slots[k].index, &entry);
+            err = brarchive_writer_entry(out, entry.name, entry.name_len,
+                                         kept[kept_pos].new_offset, kept[kept_pos].len);
+            kept_pos++;
+        } else {
+            err = brarchive_writer_entry(out, added.names[j], strlen(added.names[j]),
+                                         added_offsets[j], added.sizes[j]);
+        }
+    }
     
-    for (i = 0; i < files.count; i++) {
-        uint8_t name_len_val = (uint8_t)strlen(files.names[i]);
-        archive[entry_offset] = name_len_val;
-        
-        memcpy(archive + entry_offset + 1, files.names[i], name_len_val);
-        /* Rest is already zeroed */
-        
-        /* contents_offset is relative to data block start */
-        write_u32_le(archive + entry_offset + 248, (uint32_t)(data_pos - data_offset));
-        write_u32_le(archive + entry_offset + 252, (uint32_t)files.sizes[i]);
-        
-        data_pos += files.sizes[i];
-        entry_offset += ENTRY_SIZE;
+    /* Surviving data, one contiguous run at a time */
+    STATS_PHASE("write");
+    long r;
+    for (r = 0; success && err == BRARCHIVE_OK && r < run_count; r++) {
+        err = brarchive_writer_copy_range(out, reader, brarchive_data_start(reader) + runs[r].start,
+                                          runs[r].end - runs[r].start);
     }
     
-    /* Write file contents */
-    data_pos = data_offset;
-    for (i = 0; i < files.count; i++) {
-        memcpy(archive + data_pos, files.contents[i], files.sizes[i]);
-        data_pos += files.sizes[i];
+    /* Then the named files */
+    for (j = 0; success && err == BRARCHIVE_OK && j < added.count; j++) {
+        uint64_t span = TRACE_START();
+        FILE *in = fopen(added.paths[j], "rb");
+        if (!in) {
+            fprintf(stderr, "Failed to read file: %s\n", added.paths[j]);
+            success = false;
+            break;
+        }
+        err = brarchive_writer_copy_file(out, in, added.sizes[j]);
+        TRACE_SPAN("write", added.names[j], span);
+        if (err == BRARCHIVE_ESHORT) {
+            fprintf(stderr, "File changed while archiving: %s\n", added.paths[j]);
+            success = false;
+        } else if (err == BRARCHIVE_OK && (options & OPT_V)) {
+            printf("%c - %s\n", replaces[j] ? 'r' : 'a', added.names[j]);
+        }
+        fclose(in);
     }
     
-    bool success = write_file(archive_path, archive, total_size);
+    if (success && err == BRARCHIVE_OK) {
+        err = commit_writer(out, archive_path);
+    } else if (out) {
+        brarchive_writer_abort(out);
+    }
+    if (success && err != BRARCHIVE_OK) {
+        fprintf(stderr, "Failed to write archive: %s\n", archive_path);
+        success = false;
+    }
+    if (success) {
+        STATS_COUNT(slot_count, data_size);
+        if (reader) {
+            warn_alignment_lost(archive_path, archive_alignment(reader));
+        }
+    }
     
-    free(archive);
-    file_list_free(&files);
+    if (success && !(options & OPT_C)) {
+        if (reader) {
+            printf("Updated archive: %s (%zu added, %zu replaced)\n", archive_path,
+                   added.count - replaced_count, replaced_count);
+        } else {
+            printf("Created archive: %s (%zu files)\n", archive_path, added.count);
+        }
+    }
     
+    free(runs);
+    free(kept);
+    free(slots);
+    free(replaces);
+    free(added_offsets);
+    brarchive_close(reader);
+    file_list_free(&added);
     return success;
 }
 
 int main(int argc, char *argv[]) {
     int c;
     int options = 0;
-    int operation = 0;  /* 'r', 't', 'x', 'p', 'd' */
+    int operation = 0;  /* 'r', 't', 'x', 'p', 'd', 'V' */
+    int threads = 0;    /* 0 until -j: one for most operations, one per CPU for --serve */
+    bool stats = false;
+    bool diff = false;
+    const char *trace_path = NULL;
+    const char *serve_path = NULL;
+    const char *delta_path = NULL;
+    const char *apply_path = NULL;
+    int merge = -1;     /* MERGE_* policy once --merge is given */
+    bool repack = false;
+    const char *repack_log = NULL;
     char *p;
     char *progname = argv[0];
     
-    if (argc < 3) {
+    if (argc < 2 || (argc < 3 && strncmp(argv[1], "--serve", 7) != 0)) {
         print_usage(progname);
         return 1;
     }
@@ -1064,46 +4793,210 @@ int main(int argc, char *argv[]) {
         argv[1] = p;
     }
     
+    /* Name list files for -T, applied once the operation is known */
+    char **files_from = malloc((size_t)argc * sizeof(char *));
+    int files_from_count = 0;
+    if (!files_from) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    
+    static const struct option long_options[] = {
+        {"files-from", required_argument, NULL, 'T'},
+        {"max-memory", required_argument, NULL, LOPT_MAX_MEMORY},
+        {"dedup", no_argument, NULL, LOPT_DEDUP},
+        {"stats", no_argument, NULL, LOPT_STATS},
+        {"trace", required_argument, NULL, LOPT_TRACE},
+        {"serve", required_argument, NULL, LOPT_SERVE},
+        {"io", required_argument, NULL, LOPT_IO},
+        {"compress", required_argument, NULL, LOPT_COMPRESS},
+        {"compress-level", required_argument, NULL, LOPT_LEVEL},
+        {"diff", no_argument, NULL, LOPT_DIFF},
+        {"delta", required_argument, NULL, LOPT_DELTA},
+        {"apply", required_argument, NULL, LOPT_APPLY},
+        {"merge", optional_argument, NULL, LOPT_MERGE},
+        {"repack", optional_argument, NULL, LOPT_REPACK},
+        {"align", required_argument, NULL, LOPT_ALIGN},
+        {"split", required_argument, NULL, LOPT_SPLIT},
+        {"sum", no_argument, NULL, LOPT_SUM},
+        {"skip-unchanged", no_argument, NULL, LOPT_SKIP},
+        {NULL, 0, NULL, 0}
+    };
+    
     /* Parse options using getopt (handles combined flags like -rc automatically) */
-    while ((c = getopt(argc, argv, "cdptvxr")) != -1) {
+    while ((c = getopt_long(argc, argv, "cdj:pT:tuVvxr", long_options, NULL)) != -1) {
         switch (c) {
+        case LOPT_MAX_MEMORY: {
+            uint64_t cap;
+            if (!parse_size(optarg, &cap) || cap < MIN_IO_BUFFER) {
+                fprintf(stderr, "Invalid --max-memory value: %s (minimum 4K)\n", optarg);
+                return 1;
+            }
+            if (cap < io_buffer_size) {
+                io_buffer_size = (size_t)cap;
+            }
+            break;
+        }
+        case LOPT_DEDUP:
+            options |= OPT_DEDUP;
+            break;
+        case LOPT_SUM:
+            options |= OPT_SUM;
+            break;
+        case LOPT_SKIP:
+            options |= OPT_SKIP;
+            break;
+        case LOPT_ALIGN:
+            if (!parse_size(optarg, &data_align) || data_align < 8 || data_align > MAX_ALIGN ||
+                (data_align & (data_align - 1)) != 0) {
+                fprintf(stderr, "Invalid --align value: %s (a power of two from 8 to 4K)\n", optarg);
+                free(files_from);
+                return 1;
+            }
+            break;
+        case LOPT_SPLIT:
+            if (!parse_size(optarg, &split_size) || split_size < MIN_IO_BUFFER) {
+                fprintf(stderr, "Invalid --split value: %s (minimum 4K)\n", optarg);
+                free(files_from);
+                return 1;
+            }
+            break;
+        case LOPT_STATS:
+            stats = true;
+            break;
+        case LOPT_TRACE:
+            trace_path = optarg;
+            break;
+        case LOPT_SERVE:
+            serve_path = optarg;
+            break;
+        case LOPT_DIFF:
+            diff = true;
+            break;
+        case LOPT_DELTA:
+            delta_path = optarg;
+            break;
+        case LOPT_APPLY:
+            apply_path = optarg;
+            break;
+        case LOPT_REPACK:
+            repack = true;
+            repack_log = optarg;
+            break;
+        case LOPT_MERGE:
+            if (!optarg || strcmp(optarg, "error") == 0) {
+                merge = MERGE_ERROR;
+            } else if (strcmp(optarg, "first") == 0) {
+                merge = MERGE_FIRST;
+            } else if (strcmp(optarg, "last") == 0) {
+                merge = MERGE_LAST;
+            } else {
+                fprintf(stderr, "Invalid --merge policy: %s (use first, last or error)\n", optarg);
+                free(files_from);
+                return 1;
+            }
+            break;
+        case LOPT_IO:
+            if (strcmp(optarg, "sync") == 0) {
+                io_backend = IO_SYNC;
+            } else if (strcmp(optarg, "uring") == 0) {
+#ifdef HAVE_IO_URING
+                io_backend = IO_URING;
+#else
+                fprintf(stderr, "io_uring support not built in\n");
+                return 1;
+#endif
+            } else {
+                fprintf(stderr, "Invalid --io value: %s (sync or uring)\n", optarg);
+                return 1;
+            }
+            break;
+        case LOPT_COMPRESS:
+            if (strcmp(optarg, "none") == 0) {
+                compress_method = BRARCHIVE_RAW;
+            } else if (strcmp(optarg, "gzip") == 0) {
+                compress_method = BRARCHIVE_GZIP;
+            } else if (strcmp(optarg, "zstd") == 0) {
+                compress_method = BRARCHIVE_ZSTD;
+            } else {
+                fprintf(stderr, "Invalid --compress value: %s (none, gzip or zstd)\n", optarg);
+                return 1;
+            }
+            if (!brarchive_compression_supported(compress_method)) {
+                fprintf(stderr, "%s support not built in\n", optarg);
+                return 1;
+            }
+            break;
+        case LOPT_LEVEL: {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 1 || n > 22) {
+                fprintf(stderr, "Invalid compression level: %s\n", optarg);
+                return 1;
+            }
+            compress_level = (int)n;
+            break;
+        }
         case 'c':
             options |= OPT_C;
             break;
         case 'd':
             if (operation && operation != 'd') {
-                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -x) allowed\n");
+                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -V, -x) allowed\n");
                 return 1;
             }
             operation = 'd';
             break;
+        case 'j': {
+            char *end;
+            long n = strtol(optarg, &end, 10);
+            if (*optarg == '\0' || *end != '\0' || n < 0 || n > 1024) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return 1;
+            }
+            threads = n == 0 ? cpu_count() : (int)n;
+            break;
+        }
         case 'p':
             if (operation && operation != 'p') {
-                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -x) allowed\n");
+                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -V, -x) allowed\n");
                 return 1;
             }
             operation = 'p';
             break;
         case 'r':
             if (operation && operation != 'r') {
-                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -x) allowed\n");
+                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -V, -x) allowed\n");
                 return 1;
             }
             operation = 'r';
             break;
+        case 'T':
+            files_from[files_from_count++] = optarg;
+            break;
         case 't':
             if (operation && operation != 't') {
-                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -x) allowed\n");
+                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -V, -x) allowed\n");
                 return 1;
             }
             operation = 't';
             break;
+        case 'u':
+            options |= OPT_U;
+            break;
+        case 'V':
+            if (operation && operation != 'V') {
+                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -V, -x) allowed\n");
+                return 1;
+            }
+            operation = 'V';
+            break;
         case 'v':
             options |= OPT_V;
             break;
         case 'x':
             if (operation && operation != 'x') {
-                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -x) allowed\n");
+                fprintf(stderr, "Only one operation (-d, -p, -r, -t, -V, -x) allowed\n");
                 return 1;
             }
             operation = 'x';
@@ -1114,12 +5007,138 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (serve_path) {
+        if (operation || optind < argc) {
+            fprintf(stderr, "Option --serve takes no operation or archive\n");
+            return 1;
+        }
+        free(files_from);
+        return serve_archives(serve_path, threads ? threads : cpu_count()) ? 0 : 1;
+    }
+    if (threads == 0) {
+        threads = operation == 'V' || diff ? cpu_count() : 1;
+    }
+    compress_threads = threads;
+    
+    /* --diff and --apply work on a pair of archives */
+    if (diff || apply_path) {
+        bool success;
+        free(files_from);
+        if (operation || (diff && apply_path) || merge >= 0 || repack || argc - optind != 2) {
+            fprintf(stderr, "Usage: %s --diff [-j N] [--delta=FILE] old new\n", progname);
+            fprintf(stderr, "       %s --apply=DELTA old new\n", progname);
+            return 1;
+        }
+        if (delta_path && !diff) {
+            fprintf(stderr, "Option --delta is only valid with --diff\n");
+            return 1;
+        }
+        /* Both inputs cannot come from stdin */
+        if (is_stdio(argv[optind]) && is_stdio(diff ? argv[optind + 1] : apply_path)) {
+            fprintf(stderr, "Only one input can be -\n");
+            return 1;
+        }
+        /* A delta reads new (for --diff) or old (for --apply) twice, which a pipe cannot do */
+        if ((diff && delta_path && is_stdio(argv[optind + 1])) || (apply_path && is_stdio(argv[optind]))) {
+            fprintf(stderr, "The %s archive cannot be - with %s\n", diff ? "new" : "old",
+                    diff ? "--delta" : "--apply");
+            return 1;
+        }
+        if (!stats_init(stats, trace_path)) {
+            return 1;
+        }
+        if (diff) {
+            success = diff_command(argv[optind], argv[optind + 1], delta_path, threads);
+        } else {
+            success = apply_command(apply_path, argv[optind], argv[optind + 1], options);
+        }
+        stats_finish();
+        return success ? 0 : 1;
+    }
+    if (delta_path) {
+        fprintf(stderr, "Option --delta is only valid with --diff\n");
+        free(files_from);
+        return 1;
+    }
+    
+    /* --repack rewrites one archive in place */
+    if (repack) {
+        bool success;
+        free(files_from);
+        if (operation || merge >= 0 || argc - optind != 1) {
+            fprintf(stderr, "Usage: %s --repack[=LOG] archive\n", progname);
+            return 1;
+        }
+        if (is_stdio(argv[optind])) {
+            fprintf(stderr, "Option --repack needs an archive file, not -\n");
+            return 1;
+        }
+        if (!stats_init(stats, trace_path)) {
+            return 1;
+        }
+        success = repack_archive(argv[optind], repack_log, options);
+        stats_finish();
+        return success ? 0 : 1;
+    }
+    
+    /* --merge writes one archive from several */
+    if (merge >= 0) {
+        bool success;
+        int n, stdin_inputs = 0;
+        free(files_from);
+        if (operation || argc - optind < 2) {
+            fprintf(stderr, "Usage: %s --merge[=first|last|error] archive input ...\n", progname);
+            return 1;
+        }
+        for (n = optind + 1; n < argc; n++) {
+            stdin_inputs += is_stdio(argv[n]);
+        }
+        if (stdin_inputs > 1) {
+            fprintf(stderr, "Only one input can be -\n");
+            return 1;
+        }
+        if (!stats_init(stats, trace_path)) {
+            return 1;
+        }
+        success = merge_archives(argv[optind], argv + optind + 1, argc - optind - 1, merge, options);
+        stats_finish();
+        return success ? 0 : 1;
+    }
+    
     if (!operation) {
-        fprintf(stderr, "One of options -d, -p, -r, -t, -x is required\n");
+        fprintf(stderr, "One of options -d, -p, -r, -t, -V, -x is required\n");
         print_usage(argv[0]);
         return 1;
     }
     
+    if ((options & OPT_U) && operation != 'r') {
+        fprintf(stderr, "Option -u is only valid with -r\n");
+        return 1;
+    }
+    if ((options & OPT_DEDUP) && operation != 'r') {
+        fprintf(stderr, "Option --dedup is only valid with -r\n");
+        return 1;
+    }
+    if (data_align && operation != 'r') {
+        fprintf(stderr, "Option --align is only valid with -r\n");
+        return 1;
+    }
+    if (split_size && (operation != 'r' || (options & OPT_U))) {
+        fprintf(stderr, "Option --split is only valid with -r, without -u\n");
+        free(files_from);
+        return 1;
+    }
+    if ((options & OPT_SUM) && operation != 'r') {
+        fprintf(stderr, "Option --sum is only valid with -r\n");
+        free(files_from);
+        return 1;
+    }
+    if ((options & OPT_SKIP) && operation != 'x') {
+        fprintf(stderr, "Option --skip-unchanged is only valid with -x\n");
+        free(files_from);
+        return 1;
+    }
+    
     /* Get remaining arguments (archive and files) */
     argc -= optind;
     argv += optind;
@@ -1133,50 +5152,106 @@ int main(int argc, char *argv[]) {
     argc--;
     argv++;
     
+    /* Volumes are named after the archive, so their suffix does not give the compression */
+    if ((split_size || (options & OPT_SUM)) && is_stdio(archive_path)) {
+        fprintf(stderr, "Options --split and --sum need an archive name\n");
+        free(files_from);
+        return 1;
+    }
+    if (split_size && compress_method < 0) {
+        compress_method = path_compression(archive_path);
+    }
+    
+    /* "-" streams: only a new archive can be written, and stdin holds one thing */
+    if (is_stdio(archive_path)) {
+        if (operation == 'd' || (options & OPT_U)) {
+            fprintf(stderr, "Archive - (stdin or stdout) cannot be updated in place\n");
+            free(files_from);
+            return 1;
+        }
+        int k;
+        for (k = 0; k < files_from_count; k++) {
+            if (strcmp(files_from[k], "-") == 0 && operation != 'r') {
+                fprintf(stderr, "Archive - and -T - cannot both read stdin\n");
+                free(files_from);
+                return 1;
+            }
+        }
+    }
+    
+    /* Build member selection from the remaining names and any -T lists */
+    struct name_matcher filter;
+    matcher_init(&filter, operation == 'd' ? MATCH_EXACT : MATCH_BASENAME);
+    if (operation != 'r') {
+        int k;
+        for (k = 0; k < argc; k++) {
+            if (!matcher_add(&filter, argv[k])) {
+                fprintf(stderr, "Memory allocation failed\n");
+                return 1;
+            }
+        }
+        for (k = 0; k < files_from_count; k++) {
+            if (!matcher_add_file(&filter, files_from[k])) {
+                return 1;
+            }
+        }
+    }
+    free(files_from);
+    
+    if (!stats_init(stats, trace_path)) {
+        matcher_free(&filter);
+        return 1;
+    }
+    
     /* Execute operation */
+    bool success = true;
+    size_t volumes;
     if (operation == 'r') {
-        /* Replace/add: brar -r archive directory */
-        if (argc != 1) {
-            fprintf(stderr, "Usage: %s -r archive directory\n", progname);
-            return 1;
+        /* Replace/add: brar -r archive directory, or brar -r archive file ... */
+        struct stat st;
+        if (argc < 1) {
+            fprintf(stderr, "Usage: %s -r [-u] archive directory\n", progname);
+            fprintf(stderr, "       %s -r archive file ...\n", progname);
+            success = false;
+        } else if (argc == 1 && stat(argv[0], &st) == 0 && S_ISDIR(st.st_mode)) {
+            success = create_archive(archive_path, argv[0], options, threads);
+        } else if ((options & (OPT_U | OPT_DEDUP)) || data_align || split_size) {
+            fprintf(stderr, "Options -u, --dedup, --align and --split require a directory\n");
+            success = false;
+        } else {
+            success = replace_in_archive(archive_path, argv, argc, options);
         }
-        if (!create_archive(archive_path, argv[0], options)) {
-            return 1;
+        if (success && (options & OPT_SUM)) {
+            STATS_PHASE("sum");
+            success = save_sums(archive_path);
         }
+    } else if (operation != 'd' && (volumes = volume_set_count(archive_path)) > 0) {
+        /* A --split set: archive.001, archive.002, ... */
+        success = read_volume_set(archive_path, volumes, operation, &filter, options, threads);
     } else if (operation == 't') {
         /* List: brar -t archive [file ...] */
-        char **file_filter = (argc > 0) ? argv : NULL;
-        int filter_count = argc;
-        if (!list_archive(archive_path, file_filter, filter_count)) {
-            return 1;
-        }
+        success = list_archive(archive_path, &filter);
     } else if (operation == 'x') {
         /* Extract: brar -x archive [file ...] */
-        char **file_filter = (argc > 0) ? argv : NULL;
-        int filter_count = argc;
-        if (!extract_archive(archive_path, NULL, file_filter, filter_count, options)) {
-            return 1;
-        }
+        success = extract_archive(archive_path, NULL, &filter, options, threads);
+    } else if (operation == 'V') {
+        /* Verify: br-ar -V archive [file ...] */
+        success = verify_archive(archive_path, &filter, threads);
     } else if (operation == 'p') {
         /* Print: brar -p archive [file ...] */
-        char **file_filter = (argc > 0) ? argv : NULL;
-        int filter_count = argc;
-        if (!print_archive(archive_path, file_filter, filter_count)) {
-            return 1;
-        }
+        success = print_archive(archive_path, &filter);
     } else if (operation == 'd') {
         /* Delete: br-ar -d archive file ... */
-        if (argc < 1) {
+        if (matcher_empty(&filter)) {
             fprintf(stderr, "Usage: %s -d archive file ...\n", progname);
-            return 1;
-        }
-        char **files_to_delete = argv;
-        int file_count = argc;
-        if (!delete_from_archive(archive_path, files_to_delete, file_count, options)) {
-            return 1;
+            success = false;
+        } else {
+            success = delete_from_archive(archive_path, &filter, options);
         }
     }
     
-    return 0;
+    stats_finish();
+    matcher_free(&filter);
+    return success ? 0 : 1;
 }
 
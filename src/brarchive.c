@@ -0,0 +1,1373 @@
+/*
+ * libbrarchive - read and write .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* Feature test macros for POSIX and GNU extensions (copy_file_range) */
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#include <unistd.h>
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+#include "brarchive.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Memory-mapped archive access, with a buffered stdio fallback */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP) && defined(HAVE_MUNMAP)
+#include <sys/mman.h>
+#define USE_MMAP 1
+#else
+#define USE_MMAP 0
+#endif
+
+#ifndef MADV_NORMAL
+#define MADV_NORMAL 0
+#define MADV_RANDOM 1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED 3
+#endif
+
+/* Platform-specific endian headers */
+#if defined(HAVE_DARWIN_ENDIAN) && defined(HAVE_LIBKERN_OSBYTEORDER_H)
+#include <libkern/OSByteOrder.h>
+#endif
+
+#if defined(HAVE_FREEBSD_ENDIAN) && defined(HAVE_SYS_ENDIAN_H)
+#include <sys/endian.h>
+#endif
+
+#if defined(HAVE_OPENBSD_ENDIAN) && defined(HAVE_SYS_ENDIAN_H)
+#include <sys/endian.h>
+#endif
+
+#if defined(HAVE_LINUX_ENDIAN) && defined(HAVE_ENDIAN_H)
+#include <endian.h>
+#include <byteswap.h>
+#endif
+
+
+/* Endian conversion functions */
+#if USE_PLATFORM_ENDIAN
+
+#if defined(HAVE_DARWIN_ENDIAN)
+/* Darwin/macOS endian operations */
+static inline void write_u32_le(uint8_t *buf, uint32_t value) {
+    uint32_t le = OSSwapHostToLittleInt32(value);
+    memcpy(buf, &le, 4);
+}
+
+static inline void write_u64_le(uint8_t *buf, uint64_t value) {
+    uint64_t le = OSSwapHostToLittleInt64(value);
+    memcpy(buf, &le, 8);
+}
+
+static inline uint32_t read_u32_le(const uint8_t *buf) {
+    uint32_t le;
+    memcpy(&le, buf, 4);
+    return OSSwapLittleToHostInt32(le);
+}
+
+static inline uint64_t read_u64_le(const uint8_t *buf) {
+    uint64_t le;
+    memcpy(&le, buf, 8);
+    return OSSwapLittleToHostInt64(le);
+}
+
+#elif defined(HAVE_FREEBSD_ENDIAN) || defined(HAVE_OPENBSD_ENDIAN)
+/* FreeBSD/OpenBSD endian operations */
+static inline void write_u32_le(uint8_t *buf, uint32_t value) {
+    uint32_t le = htole32(value);
+    memcpy(buf, &le, 4);
+}
+
+static inline void write_u64_le(uint8_t *buf, uint64_t value) {
+    uint64_t le = htole64(value);
+    memcpy(buf, &le, 8);
+}
+
+static inline uint32_t read_u32_le(const uint8_t *buf) {
+    uint32_t le;
+    memcpy(&le, buf, 4);
+    return le32toh(le);
+}
+
+static inline uint64_t read_u64_le(const uint8_t *buf) {
+    uint64_t le;
+    memcpy(&le, buf, 8);
+    return le64toh(le);
+}
+
+#elif defined(HAVE_LINUX_ENDIAN)
+/* Linux endian operations */
+static inline void write_u32_le(uint8_t *buf, uint32_t value) {
+    uint32_t le = htole32(value);
+    memcpy(buf, &le, 4);
+}
+
+static inline void write_u64_le(uint8_t *buf, uint64_t value) {
+    uint64_t le = htole64(value);
+    memcpy(buf, &le, 8);
+}
+
+static inline uint32_t read_u32_le(const uint8_t *buf) {
+    uint32_t le;
+    memcpy(&le, buf, 4);
+    return le32toh(le);
+}
+
+static inline uint64_t read_u64_le(const uint8_t *buf) {
+    uint64_t le;
+    memcpy(&le, buf, 8);
+    return le64toh(le);
+}
+
+#else
+/* Fallback to generic implementation */
+#define USE_PLATFORM_ENDIAN 0
+#endif
+
+#endif /* USE_PLATFORM_ENDIAN */
+
+#if !USE_PLATFORM_ENDIAN
+/* Generic portable endian operations */
+static void write_u32_le(uint8_t *buf, uint32_t value) {
+    buf[0] = (uint8_t)(value & 0xFF);
+    buf[1] = (uint8_t)((value >> 8) & 0xFF);
+    buf[2] = (uint8_t)((value >> 16) & 0xFF);
+    buf[3] = (uint8_t)((value >> 24) & 0xFF);
+}
+
+static void write_u64_le(uint8_t *buf, uint64_t value) {
+    buf[0] = (uint8_t)(value & 0xFF);
+    buf[1] = (uint8_t)((value >> 8) & 0xFF);
+    buf[2] = (uint8_t)((value >> 16) & 0xFF);
+    buf[3] = (uint8_t)((value >> 24) & 0xFF);
+    buf[4] = (uint8_t)((value >> 32) & 0xFF);
+    buf[5] = (uint8_t)((value >> 40) & 0xFF);
+    buf[6] = (uint8_t)((value >> 48) & 0xFF);
+    buf[7] = (uint8_t)((value >> 56) & 0xFF);
+}
+
+static uint32_t read_u32_le(const uint8_t *buf) {
+    return (uint32_t)buf[0] |
+           ((uint32_t)buf[1] << 8) |
+           ((uint32_t)buf[2] << 16) |
+           ((uint32_t)buf[3] << 24);
+}
+
+static uint64_t read_u64_le(const uint8_t *buf) {
+    return (uint64_t)buf[0] |
+           ((uint64_t)buf[1] << 8) |
+           ((uint64_t)buf[2] << 16) |
+           ((uint64_t)buf[3] << 24) |
+           ((uint64_t)buf[4] << 32) |
+           ((uint64_t)buf[5] << 40) |
+           ((uint64_t)buf[6] << 48) |
+           ((uint64_t)buf[7] << 56);
+}
+#endif
+
+
+/* Open archive: header and entry table, plus on-demand member access */
+struct brarchive {
+    char *path;
+    FILE *f;
+    const uint8_t *map;         /* Whole-file mapping, or NULL */
+    uint8_t *table;             /* Header + entry table copy when not mapped */
+    const uint8_t *base;        /* Header + entry table (map or table) */
+    uint64_t size;
+    uint64_t data_start;
+    uint32_t entries;
+    uint32_t version;
+    uint32_t table_entries;     /* Entries whose descriptors fit in the file */
+    int hint;
+    uint8_t *scratch;           /* Member buffer for the fallback path */
+    size_t scratch_size;
+    uint64_t scratch_pos;       /* File offset of a compressed archive's member in scratch */
+    uint64_t scratch_len;       /* Its size, or UINT64_MAX when scratch holds none */
+    uint32_t *index;            /* Open-addressed entry indices, built on first lookup */
+    size_t index_mask;
+    int order;                  /* TABLE_*, checked on the first failed binary search */
+    int scanned;                /* An unsorted table was searched once without the index */
+    int method;                 /* BRARCHIVE_RAW, or how the file is compressed */
+    int streamed;               /* Read in one pass: compressed, or from a pipe */
+    int pipe;                   /* The input cannot seek, so the stream cannot start over */
+    void *stream;               /* z_stream or ZSTD_DCtx of a compressed archive */
+    uint64_t stream_pos;        /* Archive bytes consumed */
+    uint8_t *stream_buf;        /* File input, then a chunk for skipped bytes */
+    size_t in_pos;
+    size_t in_size;
+};
+
+/* Decompression and compression buffer chunk */
+#define STREAM_CHUNK (128 * 1024)
+
+/* Magic number of a zstd frame */
+#define ZSTD_FRAME_MAGIC 0xFD2FB528U
+
+/* Entry table order */
+#define TABLE_UNKNOWN  0
+#define TABLE_SORTED   1
+#define TABLE_UNSORTED 2
+
+/* Writer states, in call order */
+#define WRITER_OPEN  0
+#define WRITER_TABLE 1
+#define WRITER_DATA  2
+
+struct brarchive_writer {
+    char *path;
+    char *tmp_path;
+    FILE *f;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t pending;             /* Descriptor bytes waiting in buf */
+    uint32_t count;
+    uint32_t added;
+    int state;
+    int method;                 /* BRARCHIVE_RAW, or how the output is compressed */
+    void *stream;               /* gzFile or ZSTD_CCtx */
+    uint8_t *zbuf;              /* zstd output */
+};
+
+const char *brarchive_strerror(int err) {
+    switch (err) {
+    case BRARCHIVE_OK:      return "Success";
+    case BRARCHIVE_EIO:     return "Input/output error";
+    case BRARCHIVE_ENOMEM:  return "Memory allocation failed";
+    case BRARCHIVE_ESMALL:  return "Archive too small";
+    case BRARCHIVE_EMAGIC:  return "Invalid magic number";
+    case BRARCHIVE_ENAME:   return "Invalid name length";
+    case BRARCHIVE_EBOUNDS: return "Out of bounds";
+    case BRARCHIVE_ENOENT:  return "No such member";
+    case BRARCHIVE_ESHORT:  return "File changed while archiving";
+    case BRARCHIVE_ERANGE:  return "Value too large for the archive format";
+    case BRARCHIVE_EINVAL:  return "Invalid argument";
+    case BRARCHIVE_ENOTSUP: return "Compression method not supported by this build";
+    case BRARCHIVE_ESEEK:   return "Member out of order in a pipe";
+    default:                return "Unknown error";
+    }
+}
+
+static char *copy_string(const char *s, const char *suffix) {
+    size_t len = strlen(s);
+    size_t suffix_len = suffix ? strlen(suffix) : 0;
+    char *copy = malloc(len + suffix_len + 1);
+    if (copy) {
+        memcpy(copy, s, len);
+        memcpy(copy + len, suffix ? suffix : "", suffix_len + 1);
+    }
+    return copy;
+}
+
+int brarchive_compression_supported(int method) {
+    switch (method) {
+    case BRARCHIVE_RAW:
+        return 1;
+#ifdef HAVE_ZLIB
+    case BRARCHIVE_GZIP:
+        return 1;
+#endif
+#ifdef HAVE_ZSTD
+    case BRARCHIVE_ZSTD:
+        return 1;
+#endif
+    default:
+        return 0;
+    }
+}
+
+/* Compression method from the first bytes of a file (at least a header's worth) */
+static int sniff_method(const uint8_t *p) {
+    if (p[0] == 0x1F && p[1] == 0x8B) {
+        return BRARCHIVE_GZIP;
+    }
+    if (read_u32_le(p) == ZSTD_FRAME_MAGIC) {
+        return BRARCHIVE_ZSTD;
+    }
+    return BRARCHIVE_RAW;
+}
+
+/* Go back to the start of the stream */
+static int stream_rewind(brarchive *ar) {
+    if (ar->pipe) {
+        return BRARCHIVE_ESEEK;
+    }
+    if (fseek(ar->f, 0, SEEK_SET) != 0) {
+        return BRARCHIVE_EIO;
+    }
+#ifdef HAVE_ZLIB
+    if (ar->method == BRARCHIVE_GZIP && inflateReset((z_stream *)ar->stream) != Z_OK) {
+        return BRARCHIVE_EIO;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (ar->method == BRARCHIVE_ZSTD) {
+        ZSTD_DCtx_reset((ZSTD_DCtx *)ar->stream, ZSTD_reset_session_only);
+    }
+#endif
+    ar->in_pos = 0;
+    ar->in_size = 0;
+    ar->stream_pos = 0;
+    return BRARCHIVE_OK;
+}
+
+/*
+ * Set up reading the archive file as a stream from its first byte.  head
+ * holds bytes already taken from a pipe, which are read again first.
+ */
+static int stream_open(brarchive *ar, int method, const uint8_t *head, size_t head_len) {
+    if (!brarchive_compression_supported(method)) {
+        return BRARCHIVE_ENOTSUP;
+    }
+    ar->method = method;
+    ar->streamed = 1;
+    if (!(ar->stream_buf = malloc(2 * STREAM_CHUNK))) {
+        return BRARCHIVE_ENOMEM;
+    }
+#ifdef HAVE_ZLIB
+    if (method == BRARCHIVE_GZIP) {
+        z_stream *zs = calloc(1, sizeof(z_stream));
+        /* 16 selects the gzip wrapper */
+        if (!zs || inflateInit2(zs, 15 + 16) != Z_OK) {
+            free(zs);
+            return BRARCHIVE_ENOMEM;
+        }
+        ar->stream = zs;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (method == BRARCHIVE_ZSTD && !(ar->stream = ZSTD_createDCtx())) {
+        return BRARCHIVE_ENOMEM;
+    }
+#endif
+    if (head) {
+        memcpy(ar->stream_buf, head, head_len);
+        ar->in_size = head_len;
+        ar->pipe = 1;
+        return BRARCHIVE_OK;
+    }
+    return stream_rewind(ar);
+}
+
+static void stream_close(brarchive *ar) {
+#ifdef HAVE_ZLIB
+    if (ar->method == BRARCHIVE_GZIP && ar->stream) {
+        inflateEnd((z_stream *)ar->stream);
+        free(ar->stream);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (ar->method == BRARCHIVE_ZSTD) {
+        ZSTD_freeDCtx((ZSTD_DCtx *)ar->stream);
+    }
+#endif
+    free(ar->stream_buf);
+}
+
+/* Turn buffered input into at most len bytes at dst */
+static int stream_decode(brarchive *ar, uint8_t *dst, size_t len, size_t *made) {
+    const uint8_t *in = ar->stream_buf + ar->in_pos;
+    size_t avail = ar->in_size - ar->in_pos;
+    
+    *made = 0;
+#ifdef HAVE_ZLIB
+    if (ar->method == BRARCHIVE_GZIP) {
+        z_stream *zs = ar->stream;
+        zs->next_in = (Bytef *)in;
+        zs->avail_in = (uInt)avail;
+        zs->next_out = dst;
+        zs->avail_out = len > (1U << 30) ? (1U << 30) : (uInt)len;
+        int ret = inflate(zs, Z_NO_FLUSH);
+        *made = (size_t)(zs->next_out - dst);
+        ar->in_pos += avail - zs->avail_in;
+        /* gzip members may follow each other; the next one continues the stream */
+        if (ret == Z_STREAM_END) {
+            return inflateReset(zs) == Z_OK ? BRARCHIVE_OK : BRARCHIVE_EIO;
+        }
+        return ret == Z_OK || ret == Z_BUF_ERROR ? BRARCHIVE_OK : BRARCHIVE_EIO;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (ar->method == BRARCHIVE_ZSTD) {
+        ZSTD_inBuffer zin = { in, avail, 0 };
+        ZSTD_outBuffer zout = { dst, len, 0 };
+        if (ZSTD_isError(ZSTD_decompressStream((ZSTD_DCtx *)ar->stream, &zout, &zin))) {
+            return BRARCHIVE_EIO;
+        }
+        *made = zout.pos;
+        ar->in_pos += zin.pos;
+        return BRARCHIVE_OK;
+    }
+#endif
+    *made = avail < len ? avail : len;
+    memcpy(dst, in, *made);
+    ar->in_pos += *made;
+    return BRARCHIVE_OK;
+}
+
+/* The next len bytes of the archive into dst; *got is short only at the end of the stream */
+static int stream_next(brarchive *ar, uint8_t *dst, size_t len, size_t *got) {
+    int err = BRARCHIVE_OK;
+    size_t made;
+    
+    *got = 0;
+    while (err == BRARCHIVE_OK && *got < len) {
+        if (ar->in_pos == ar->in_size) {
+            ar->in_pos = 0;
+            ar->in_size = fread(ar->stream_buf, 1, STREAM_CHUNK, ar->f);
+            if (ar->in_size == 0) {
+                err = ferror(ar->f) ? BRARCHIVE_EIO : BRARCHIVE_OK;
+                break;
+            }
+        }
+        err = stream_decode(ar, dst + *got, len - *got, &made);
+        *got += made;
+    }
+    ar->stream_pos += *got;
+    return err;
+}
+
+/* Exactly len bytes at pos, skipping forward or starting over to get there */
+static int stream_pread(brarchive *ar, uint64_t pos, void *buf, size_t len) {
+    int err = pos < ar->stream_pos ? stream_rewind(ar) : BRARCHIVE_OK;
+    size_t got;
+    
+    while (err == BRARCHIVE_OK && ar->stream_pos < pos) {
+        uint64_t skip = pos - ar->stream_pos;
+        err = stream_next(ar, ar->stream_buf + STREAM_CHUNK, skip < STREAM_CHUNK ? (size_t)skip : STREAM_CHUNK, &got);
+        if (err == BRARCHIVE_OK && got == 0) {
+            err = BRARCHIVE_EIO;
+        }
+    }
+    if (err == BRARCHIVE_OK) {
+        err = stream_next(ar, buf, len, &got);
+    }
+    return err == BRARCHIVE_OK && got != len ? BRARCHIVE_EIO : err;
+}
+
+/* Seek the fallback stream and read exactly len bytes */
+static int archive_pread(brarchive *ar, uint64_t pos, void *buf, size_t len) {
+    if (ar->streamed) {
+        return stream_pread(ar, pos, buf, len);
+    }
+#ifdef HAVE_FSEEKO
+    if (fseeko(ar->f, (off_t)pos, SEEK_SET) != 0) {
+        return BRARCHIVE_EIO;
+    }
+#else
+    if (pos > LONG_MAX || fseek(ar->f, (long)pos, SEEK_SET) != 0) {
+        return BRARCHIVE_EIO;
+    }
+#endif
+    return fread(buf, 1, len, ar->f) == len ? BRARCHIVE_OK : BRARCHIVE_EIO;
+}
+
+/* Pass a paging hint for part of the mapping (no-op without madvise) */
+static void archive_advise(const brarchive *ar, uint64_t pos, uint64_t len, int advice) {
+#if USE_MMAP && defined(HAVE_MADVISE)
+    static uintptr_t page_mask;
+    if (!ar->map || len == 0) {
+        return;
+    }
+    if (!page_mask) {
+        long page = sysconf(_SC_PAGESIZE);
+        page_mask = (uintptr_t)(page > 0 ? page : 4096) - 1;
+    }
+    uintptr_t start = (uintptr_t)(ar->map + pos) & ~page_mask;
+    uintptr_t end = (uintptr_t)(ar->map + pos + len);
+    madvise((void *)start, (size_t)(end - start), advice);
+#else
+    (void)ar;
+    (void)pos;
+    (void)len;
+    (void)advice;
+#endif
+}
+
+void brarchive_close(brarchive *ar) {
+    if (!ar) {
+        return;
+    }
+#if USE_MMAP
+    if (ar->map) {
+        munmap((void *)ar->map, (size_t)ar->size);
+    }
+#endif
+    stream_close(ar);
+    if (ar->f) {
+        fclose(ar->f);
+    }
+    free(ar->path);
+    free(ar->table);
+    free(ar->scratch);
+    free(ar->index);
+    free(ar);
+}
+
+/*
+ * Load the header and entry table of a compressed archive or a pipe.  The
+ * table is grown as it is read, so a bogus count costs no more memory
+ * than the stream holds, and the size is taken from the furthest member.
+ */
+static int open_stream(brarchive *ar, int method, const uint8_t *head, size_t head_len) {
+    uint8_t header[BRARCHIVE_HEADER_SIZE];
+    size_t got;
+#if USE_MMAP
+    if (ar->map) {
+        munmap((void *)ar->map, (size_t)ar->size);
+        ar->map = NULL;
+    }
+#endif
+    ar->base = NULL;
+    int err = stream_open(ar, method, head, head_len);
+    if (err == BRARCHIVE_OK && (err = stream_next(ar, header, BRARCHIVE_HEADER_SIZE, &got)) == BRARCHIVE_OK &&
+        got < BRARCHIVE_HEADER_SIZE) {
+        err = BRARCHIVE_ESMALL;
+    }
+    if (err == BRARCHIVE_OK && read_u64_le(header) != BRARCHIVE_MAGIC) {
+        err = BRARCHIVE_EMAGIC;
+    }
+    if (err != BRARCHIVE_OK) {
+        return err;
+    }
+    ar->entries = read_u32_le(header + 8);
+    ar->version = read_u32_le(header + 12);
+    ar->data_start = BRARCHIVE_HEADER_SIZE + (uint64_t)BRARCHIVE_ENTRY_SIZE * ar->entries;
+    if (!(ar->table = malloc(BRARCHIVE_HEADER_SIZE))) {
+        return BRARCHIVE_ENOMEM;
+    }
+    memcpy(ar->table, header, BRARCHIVE_HEADER_SIZE);
+    
+    size_t used = BRARCHIVE_HEADER_SIZE;
+    while (ar->table_entries < ar->entries) {
+        uint32_t batch = ar->entries - ar->table_entries < 4096 ? ar->entries - ar->table_entries : 4096;
+        size_t want = (size_t)batch * BRARCHIVE_ENTRY_SIZE;
+        uint8_t *grown = realloc(ar->table, used + want);
+        if (!grown) {
+            return BRARCHIVE_ENOMEM;
+        }
+        ar->table = grown;
+        if ((err = stream_next(ar, ar->table + used, want, &got)) != BRARCHIVE_OK) {
+            return err;
+        }
+        ar->table_entries += (uint32_t)(got / BRARCHIVE_ENTRY_SIZE);
+        used += got - got % BRARCHIVE_ENTRY_SIZE;
+        if (got < want) {
+            break;
+        }
+    }
+    ar->base = ar->table;
+    
+    ar->size = used;
+    if (ar->table_entries == ar->entries) {
+        uint32_t i;
+        ar->size = ar->data_start;
+        for (i = 0; i < ar->entries; i++) {
+            const uint8_t *desc = ar->table + BRARCHIVE_HEADER_SIZE + (size_t)BRARCHIVE_ENTRY_SIZE * i;
+            uint64_t end = ar->data_start + read_u32_le(desc + 248) + read_u32_le(desc + 252);
+            if (end > ar->size) {
+                ar->size = end;
+            }
+        }
+    }
+    return BRARCHIVE_OK;
+}
+
+int brarchive_open(brarchive **out, const char *path, int hint) {
+    *out = NULL;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return BRARCHIVE_EIO;
+    }
+    return brarchive_open_stream(out, f, path, hint);
+}
+
+/* Open a pipe: sniff the first bytes, then hand them back to the stream */
+static int open_pipe(brarchive *ar) {
+    uint8_t head[BRARCHIVE_HEADER_SIZE];
+    size_t got = fread(head, 1, sizeof(head), ar->f);
+    if (got < sizeof(head)) {
+        return ferror(ar->f) ? BRARCHIVE_EIO : BRARCHIVE_ESMALL;
+    }
+    int method = sniff_method(head);
+    if (method == BRARCHIVE_RAW && read_u64_le(head) != BRARCHIVE_MAGIC) {
+        return BRARCHIVE_EMAGIC;
+    }
+    return open_stream(ar, method, head, got);
+}
+
+/*
+ * Open an archive and validate its header.  A regular file is mapped when
+ * possible, so only the pages that are actually used get read; otherwise
+ * just the header and entry table are loaded and members are read on
+ * demand.  The version is left for the caller to check.
+ */
+int brarchive_open_stream(brarchive **out, FILE *f, const char *name, int hint) {
+    *out = NULL;
+    brarchive *ar = calloc(1, sizeof(brarchive));
+    if (!ar || !(ar->path = copy_string(name, NULL))) {
+        free(ar);
+        fclose(f);
+        return BRARCHIVE_ENOMEM;
+    }
+    ar->hint = hint;
+    ar->scratch_len = UINT64_MAX;
+    ar->f = f;
+    
+    struct stat st;
+    if (fstat(fileno(ar->f), &st) != 0 || st.st_size < 0) {
+        brarchive_close(ar);
+        return BRARCHIVE_EIO;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        int err = open_pipe(ar);
+        if (err != BRARCHIVE_OK) {
+            brarchive_close(ar);
+            return err;
+        }
+        *out = ar;
+        return BRARCHIVE_OK;
+    }
+    ar->size = (uint64_t)st.st_size;
+    
+    if (ar->size < BRARCHIVE_HEADER_SIZE) {
+        brarchive_close(ar);
+        return BRARCHIVE_ESMALL;
+    }
+    
+    uint8_t header[BRARCHIVE_HEADER_SIZE];
+#if USE_MMAP
+    if ((uint64_t)(size_t)ar->size == ar->size) {
+        void *map = mmap(NULL, (size_t)ar->size, PROT_READ, MAP_PRIVATE, fileno(ar->f), 0);
+        if (map != MAP_FAILED) {
+            ar->map = map;
+            ar->base = ar->map;
+        }
+    }
+#endif
+    if (!ar->map) {
+        if (archive_pread(ar, 0, header, BRARCHIVE_HEADER_SIZE) != BRARCHIVE_OK) {
+            brarchive_close(ar);
+            return BRARCHIVE_EIO;
+        }
+        ar->base = header;
+    }
+    
+    if (read_u64_le(ar->base) != BRARCHIVE_MAGIC) {
+        int method = sniff_method(ar->base);
+        int err = method == BRARCHIVE_RAW ? BRARCHIVE_EMAGIC : open_stream(ar, method, NULL, 0);
+        if (err != BRARCHIVE_OK) {
+            brarchive_close(ar);
+            return err;
+        }
+        *out = ar;
+        return BRARCHIVE_OK;
+    }
+    
+    ar->entries = read_u32_le(ar->base + 8);
+    ar->version = read_u32_le(ar->base + 12);
+    ar->data_start = BRARCHIVE_HEADER_SIZE + (uint64_t)BRARCHIVE_ENTRY_SIZE * ar->entries;
+    
+    uint64_t fit = (ar->size - BRARCHIVE_HEADER_SIZE) / BRARCHIVE_ENTRY_SIZE;
+    ar->table_entries = fit < ar->entries ? (uint32_t)fit : ar->entries;
+    size_t table_size = BRARCHIVE_HEADER_SIZE + (size_t)BRARCHIVE_ENTRY_SIZE * ar->table_entries;
+    
+    if (ar->map) {
+        /* Filtered and table-only access should not trigger readahead */
+        archive_advise(ar, 0, ar->size, hint == BRARCHIVE_READ_ALL ? MADV_SEQUENTIAL : MADV_RANDOM);
+        archive_advise(ar, 0, table_size, MADV_WILLNEED);
+        *out = ar;
+        return BRARCHIVE_OK;
+    }
+    
+    ar->table = malloc(table_size);
+    if (!ar->table) {
+        brarchive_close(ar);
+        return BRARCHIVE_ENOMEM;
+    }
+    memcpy(ar->table, header, BRARCHIVE_HEADER_SIZE);
+    if (table_size > BRARCHIVE_HEADER_SIZE &&
+        archive_pread(ar, BRARCHIVE_HEADER_SIZE, ar->table + BRARCHIVE_HEADER_SIZE,
+                      table_size - BRARCHIVE_HEADER_SIZE) != BRARCHIVE_OK) {
+        brarchive_close(ar);
+        return BRARCHIVE_EIO;
+    }
+    ar->base = ar->table;
+    *out = ar;
+    return BRARCHIVE_OK;
+}
+
+const char *brarchive_path(const brarchive *ar) {
+    return ar->path;
+}
+
+uint32_t brarchive_version(const brarchive *ar) {
+    return ar->version;
+}
+
+uint32_t brarchive_count(const brarchive *ar) {
+    return ar->entries;
+}
+
+uint32_t brarchive_table_count(const brarchive *ar) {
+    return ar->table_entries;
+}
+
+uint64_t brarchive_data_start(const brarchive *ar) {
+    return ar->data_start;
+}
+
+uint64_t brarchive_size(const brarchive *ar) {
+    return ar->size;
+}
+
+int brarchive_is_mapped(const brarchive *ar) {
+    return ar->map != NULL;
+}
+
+int brarchive_compression(const brarchive *ar) {
+    return ar->method;
+}
+
+int brarchive_is_streamed(const brarchive *ar) {
+    return ar->streamed;
+}
+
+static const uint8_t *entry_desc(const brarchive *ar, uint32_t index) {
+    return ar->base + BRARCHIVE_HEADER_SIZE + (size_t)BRARCHIVE_ENTRY_SIZE * index;
+}
+
+int brarchive_entry(const brarchive *ar, uint32_t index, struct brarchive_entry *entry) {
+    if (index >= ar->table_entries) {
+        return BRARCHIVE_EBOUNDS;
+    }
+    const uint8_t *desc = entry_desc(ar, index);
+    if (desc[0] > BRARCHIVE_MAX_NAME) {
+        return BRARCHIVE_ENAME;
+    }
+    entry->name = (const char *)desc + 1;
+    entry->name_len = desc[0];
+    entry->offset = read_u32_le(desc + 248);
+    entry->size = read_u32_le(desc + 252);
+    return BRARCHIVE_OK;
+}
+
+int brarchive_in_bounds(const brarchive *ar, const struct brarchive_entry *entry) {
+    return ar->data_start + entry->offset + entry->size <= ar->size;
+}
+
+/* FNV-1a over a name */
+static uint64_t name_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int desc_name_equals(const uint8_t *desc, const char *name, size_t len) {
+    return desc[0] == len && memcmp(desc + 1, name, len) == 0;
+}
+
+/* Byte order of names, a prefix before the longer name (the order br_ar writes) */
+static int desc_name_cmp(const uint8_t *desc, const char *name, size_t len) {
+    size_t desc_len = desc[0] > BRARCHIVE_MAX_NAME ? BRARCHIVE_MAX_NAME : desc[0];
+    int r = memcmp(desc + 1, name, desc_len < len ? desc_len : len);
+    if (r != 0) {
+        return r;
+    }
+    return desc_len < len ? -1 : desc_len > len;
+}
+
+/* Whether every descriptor is valid and names never decrease */
+static int table_sorted(const brarchive *ar) {
+    uint32_t i;
+    for (i = 0; i < ar->table_entries; i++) {
+        const uint8_t *desc = entry_desc(ar, i);
+        if (desc[0] > BRARCHIVE_MAX_NAME) {
+            return 0;
+        }
+        if (i > 0 && desc_name_cmp(entry_desc(ar, i - 1), (const char *)desc + 1, desc[0]) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* First entry whose name is not below name, assuming a sorted table */
+static uint32_t lower_bound(const brarchive *ar, const char *name, size_t len) {
+    uint32_t lo = 0;
+    uint32_t hi = ar->table_entries;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (desc_name_cmp(entry_desc(ar, mid), name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Index the entry table by name, keeping the table at most half full */
+static int build_index(brarchive *ar) {
+    size_t capacity = 16;
+    uint32_t i;
+    while (capacity < (size_t)ar->table_entries * 2) {
+        capacity *= 2;
+    }
+    ar->index = malloc(capacity * sizeof(uint32_t));
+    if (!ar->index) {
+        return BRARCHIVE_ENOMEM;
+    }
+    memset(ar->index, 0xff, capacity * sizeof(uint32_t));
+    ar->index_mask = capacity - 1;
+    
+    for (i = 0; i < ar->table_entries; i++) {
+        const uint8_t *desc = entry_desc(ar, i);
+        if (desc[0] > BRARCHIVE_MAX_NAME) {
+            continue;
+        }
+        size_t slot = (size_t)name_hash((const char *)desc + 1, desc[0]) & ar->index_mask;
+        while (ar->index[slot] != UINT32_MAX &&
+               !desc_name_equals(entry_desc(ar, ar->index[slot]), (const char *)desc + 1, desc[0])) {
+            slot = (slot + 1) & ar->index_mask;
+        }
+        if (ar->index[slot] == UINT32_MAX) {
+            ar->index[slot] = i;
+        }
+    }
+    return BRARCHIVE_OK;
+}
+
+int brarchive_find(brarchive *ar, const char *name, size_t name_len, uint32_t *index) {
+    if (name_len > BRARCHIVE_MAX_NAME) {
+        return BRARCHIVE_ENOENT;
+    }
+    
+    /*
+     * Try a binary search first: a hit names a matching member whatever
+     * the order.  Only a miss has to know the table is really sorted.
+     */
+    if (ar->order != TABLE_UNSORTED) {
+        uint32_t i = lower_bound(ar, name, name_len);
+        if (i < ar->table_entries && desc_name_equals(entry_desc(ar, i), name, name_len)) {
+            *index = i;
+            return BRARCHIVE_OK;
+        }
+        if (ar->order == TABLE_UNKNOWN) {
+            ar->order = table_sorted(ar) ? TABLE_SORTED : TABLE_UNSORTED;
+        }
+        if (ar->order == TABLE_SORTED) {
+            return BRARCHIVE_ENOENT;
+        }
+    }
+    
+    /* One lookup is cheaper as a scan; the index pays off from the second */
+    if (!ar->index && !ar->scanned) {
+        uint32_t i;
+        ar->scanned = 1;
+        for (i = 0; i < ar->table_entries; i++) {
+            if (desc_name_equals(entry_desc(ar, i), name, name_len)) {
+                *index = i;
+                return BRARCHIVE_OK;
+            }
+        }
+        return BRARCHIVE_ENOENT;
+    }
+    if (!ar->index) {
+        int err = build_index(ar);
+        if (err != BRARCHIVE_OK) {
+            return err;
+        }
+    }
+    size_t slot = (size_t)name_hash(name, name_len) & ar->index_mask;
+    while (ar->index[slot] != UINT32_MAX) {
+        if (desc_name_equals(entry_desc(ar, ar->index[slot]), name, name_len)) {
+            *index = ar->index[slot];
+            return BRARCHIVE_OK;
+        }
+        slot = (slot + 1) & ar->index_mask;
+    }
+    return BRARCHIVE_ENOENT;
+}
+
+int brarchive_sorted(brarchive *ar) {
+    if (ar->order == TABLE_UNKNOWN) {
+        ar->order = table_sorted(ar) ? TABLE_SORTED : TABLE_UNSORTED;
+    }
+    return ar->order == TABLE_SORTED;
+}
+
+int brarchive_read(brarchive *ar, const struct brarchive_entry *entry, const void **data) {
+    uint64_t pos = ar->data_start + entry->offset;
+    
+    if (!brarchive_in_bounds(ar, entry)) {
+        return BRARCHIVE_EBOUNDS;
+    }
+    if (ar->map) {
+        if (ar->hint == BRARCHIVE_READ_SOME) {
+            archive_advise(ar, pos, entry->size, MADV_WILLNEED);
+        }
+        *data = ar->map + pos;
+        return BRARCHIVE_OK;
+    }
+    
+    /* Shared ranges of a streamed archive come back to back; do not start over for them */
+    if (ar->streamed && pos == ar->scratch_pos && entry->size == ar->scratch_len) {
+        *data = ar->scratch;
+        return BRARCHIVE_OK;
+    }
+    ar->scratch_len = UINT64_MAX;
+    if (entry->size >= ar->scratch_size) {
+        uint8_t *buf = realloc(ar->scratch, (size_t)entry->size + 1);
+        if (!buf) {
+            return BRARCHIVE_ENOMEM;
+        }
+        ar->scratch = buf;
+        ar->scratch_size = (size_t)entry->size + 1;
+    }
+    int err = archive_pread(ar, pos, ar->scratch, entry->size);
+    if (err == BRARCHIVE_OK) {
+        ar->scratch_pos = pos;
+        ar->scratch_len = entry->size;
+        *data = ar->scratch;
+    }
+    return err;
+}
+
+int brarchive_view(brarchive *ar, uint64_t pos, size_t len, void *buf, const void **data) {
+    if (pos > ar->size || len > ar->size - pos) {
+        return BRARCHIVE_EBOUNDS;
+    }
+    if (ar->map) {
+        *data = ar->map + pos;
+        return BRARCHIVE_OK;
+    }
+    int err = archive_pread(ar, pos, buf, len);
+    if (err == BRARCHIVE_OK) {
+        *data = buf;
+    }
+    return err;
+}
+
+static void writer_free(brarchive_writer *w) {
+    free(w->path);
+    free(w->tmp_path);
+    free(w->buf);
+    free(w->zbuf);
+    free(w);
+}
+
+#ifdef HAVE_ZSTD
+/* Feed the compressor and write what it produces; ZSTD_e_end also ends the frame */
+static int zstd_out(brarchive_writer *w, const void *data, size_t len, ZSTD_EndDirective end) {
+    ZSTD_inBuffer in = { data, len, 0 };
+    size_t left;
+    do {
+        ZSTD_outBuffer out = { w->zbuf, ZSTD_CStreamOutSize(), 0 };
+        left = ZSTD_compressStream2((ZSTD_CCtx *)w->stream, &out, &in, end);
+        if (ZSTD_isError(left)) {
+            return BRARCHIVE_EIO;
+        }
+        if (out.pos > 0 && fwrite(w->zbuf, 1, out.pos, w->f) != out.pos) {
+            return BRARCHIVE_EIO;
+        }
+    } while (end == ZSTD_e_end ? left != 0 : in.pos < in.size);
+    return BRARCHIVE_OK;
+}
+#endif
+
+/* Write archive bytes, through the compressor if there is one */
+static int writer_out(brarchive_writer *w, const void *data, size_t len) {
+#ifdef HAVE_ZLIB
+    if (w->method == BRARCHIVE_GZIP) {
+        const uint8_t *p = data;
+        while (len > 0) {
+            unsigned chunk = len > (1U << 30) ? (1U << 30) : (unsigned)len;
+            if (gzwrite((gzFile)w->stream, p, chunk) != (int)chunk) {
+                return BRARCHIVE_EIO;
+            }
+            p += chunk;
+            len -= chunk;
+        }
+        return BRARCHIVE_OK;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (w->method == BRARCHIVE_ZSTD) {
+        return zstd_out(w, data, len, ZSTD_e_continue);
+    }
+#endif
+    return fwrite(data, 1, len, w->f) == len ? BRARCHIVE_OK : BRARCHIVE_EIO;
+}
+
+/* Flush (when committing) and release the compressor */
+static int writer_finish(brarchive_writer *w, int commit) {
+    int err = BRARCHIVE_OK;
+#ifdef HAVE_ZLIB
+    if (w->method == BRARCHIVE_GZIP && w->stream && gzclose((gzFile)w->stream) != Z_OK) {
+        err = BRARCHIVE_EIO;
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (w->method == BRARCHIVE_ZSTD && w->stream) {
+        if (commit) {
+            err = zstd_out(w, NULL, 0, ZSTD_e_end);
+        }
+        ZSTD_freeCCtx((ZSTD_CCtx *)w->stream);
+    }
+#endif
+    (void)commit;
+    w->stream = NULL;
+    return err;
+}
+
+int brarchive_writer_open(brarchive_writer **out, const char *path, size_t buffer_size) {
+    *out = NULL;
+    if (buffer_size < BRARCHIVE_ENTRY_SIZE) {
+        return BRARCHIVE_EINVAL;
+    }
+    brarchive_writer *w = calloc(1, sizeof(brarchive_writer));
+    if (!w) {
+        return BRARCHIVE_ENOMEM;
+    }
+    w->path = copy_string(path, NULL);
+    w->tmp_path = copy_string(path, ".XXXXXX");
+    w->buf = malloc(buffer_size);
+    w->buf_size = buffer_size;
+    if (!w->path || !w->tmp_path || !w->buf) {
+        writer_free(w);
+        return BRARCHIVE_ENOMEM;
+    }
+    
+#ifdef HAVE_MKSTEMP
+    int fd = mkstemp(w->tmp_path);
+    if (fd >= 0) {
+#ifdef HAVE_FCHMOD
+        /* mkstemp creates 0600; keep the existing archive's mode or use the umask */
+        struct stat st;
+        mode_t mode;
+        if (stat(path, &st) == 0) {
+            mode = st.st_mode & 0777;
+        } else {
+            mode_t mask = umask(0);
+            umask(mask);
+            mode = 0666 & ~mask;
+        }
+        fchmod(fd, mode);
+#endif
+        w->f = fdopen(fd, "wb");
+        if (!w->f) {
+            close(fd);
+            unlink(w->tmp_path);
+        }
+    }
+#else
+    strcpy(w->tmp_path + strlen(path), ".tmp");
+    w->f = fopen(w->tmp_path, "wb");
+#endif
+    if (!w->f) {
+        writer_free(w);
+        return BRARCHIVE_EIO;
+    }
+    *out = w;
+    return BRARCHIVE_OK;
+}
+
+int brarchive_writer_open_stream(brarchive_writer **out, FILE *f, size_t buffer_size) {
+    *out = NULL;
+    if (buffer_size < BRARCHIVE_ENTRY_SIZE) {
+        fclose(f);
+        return BRARCHIVE_EINVAL;
+    }
+    brarchive_writer *w = calloc(1, sizeof(brarchive_writer));
+    if (!w || !(w->buf = malloc(buffer_size))) {
+        free(w);
+        fclose(f);
+        return BRARCHIVE_ENOMEM;
+    }
+    w->buf_size = buffer_size;
+    w->f = f;
+    *out = w;
+    return BRARCHIVE_OK;
+}
+
+int brarchive_writer_compress(brarchive_writer *w, int method, int level, int threads) {
+    if (w->state != WRITER_OPEN || w->method != BRARCHIVE_RAW || level < 0) {
+        return BRARCHIVE_EINVAL;
+    }
+    if (!brarchive_compression_supported(method)) {
+        return BRARCHIVE_ENOTSUP;
+    }
+#ifdef HAVE_ZLIB
+    if (method == BRARCHIVE_GZIP) {
+        char mode[8] = "wb";
+        if (level > 9) {
+            return BRARCHIVE_EINVAL;
+        }
+        if (level > 0) {
+            snprintf(mode, sizeof(mode), "wb%d", level);
+        }
+        /* zlib writes through its own descriptor; nothing else is written to w->f */
+        int fd = dup(fileno(w->f));
+        if (fd < 0 || !(w->stream = gzdopen(fd, mode))) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return BRARCHIVE_EIO;
+        }
+        gzbuffer((gzFile)w->stream, STREAM_CHUNK);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (method == BRARCHIVE_ZSTD) {
+        if (level > ZSTD_maxCLevel()) {
+            return BRARCHIVE_EINVAL;
+        }
+        if (!(w->zbuf = malloc(ZSTD_CStreamOutSize())) || !(w->stream = ZSTD_createCCtx())) {
+            return BRARCHIVE_ENOMEM;
+        }
+        if (level > 0) {
+            ZSTD_CCtx_setParameter((ZSTD_CCtx *)w->stream, ZSTD_c_compressionLevel, level);
+        }
+        /* Fails harmlessly on a libzstd built without threads */
+        if (threads > 1) {
+            ZSTD_CCtx_setParameter((ZSTD_CCtx *)w->stream, ZSTD_c_nbWorkers, threads);
+        }
+    }
+#endif
+    (void)threads;
+    w->method = method;
+    return BRARCHIVE_OK;
+}
+
+int brarchive_writer_begin(brarchive_writer *w, uint32_t count) {
+    uint8_t header[BRARCHIVE_HEADER_SIZE];
+    if (w->state != WRITER_OPEN) {
+        return BRARCHIVE_EINVAL;
+    }
+    write_u64_le(header, BRARCHIVE_MAGIC);
+    write_u32_le(header + 8, count);
+    write_u32_le(header + 12, BRARCHIVE_VERSION);
+    if (writer_out(w, header, BRARCHIVE_HEADER_SIZE) != BRARCHIVE_OK) {
+        return BRARCHIVE_EIO;
+    }
+    w->count = count;
+    w->state = WRITER_TABLE;
+    return BRARCHIVE_OK;
+}
+
+static int writer_flush_table(brarchive_writer *w) {
+    if (w->pending > 0 && writer_out(w, w->buf, w->pending) != BRARCHIVE_OK) {
+        return BRARCHIVE_EIO;
+    }
+    w->pending = 0;
+    return BRARCHIVE_OK;
+}
+
+int brarchive_writer_entry(brarchive_writer *w, const char *name, size_t name_len,
+                           uint64_t offset, uint64_t size) {
+    if (w->state != WRITER_TABLE || w->added >= w->count) {
+        return BRARCHIVE_EINVAL;
+    }
+    if (name_len > BRARCHIVE_MAX_NAME) {
+        return BRARCHIVE_ENAME;
+    }
+    if (offset > UINT32_MAX || size > UINT32_MAX - offset) {
+        return BRARCHIVE_ERANGE;
+    }
+    if (w->pending + BRARCHIVE_ENTRY_SIZE > w->buf_size) {
+        int err = writer_flush_table(w);
+        if (err != BRARCHIVE_OK) {
+            return err;
+        }
+    }
+    
+    uint8_t *desc = w->buf + w->pending;
+    memset(desc, 0, BRARCHIVE_ENTRY_SIZE);
+    desc[0] = (uint8_t)name_len;
+    memcpy(desc + 1, name, name_len);
+    write_u32_le(desc + 248, (uint32_t)offset);
+    write_u32_le(desc + 252, (uint32_t)size);
+    w->pending += BRARCHIVE_ENTRY_SIZE;
+    w->added++;
+    return BRARCHIVE_OK;
+}
+
+/* Finish the table before the first data byte */
+static int writer_data(brarchive_writer *w) {
+    if (w->state == WRITER_DATA) {
+        return BRARCHIVE_OK;
+    }
+    if (w->state != WRITER_TABLE || w->added != w->count) {
+        return BRARCHIVE_EINVAL;
+    }
+    int err = writer_flush_table(w);
+    if (err == BRARCHIVE_OK) {
+        w->state = WRITER_DATA;
+    }
+    return err;
+}
+
+int brarchive_writer_write(brarchive_writer *w, const void *data, size_t len) {
+    int err = writer_data(w);
+    if (err != BRARCHIVE_OK) {
+        return err;
+    }
+    return writer_out(w, data, len);
+}
+
+int brarchive_writer_copy_file(brarchive_writer *w, FILE *in, uint64_t len) {
+    int err = writer_data(w);
+    while (err == BRARCHIVE_OK && len > 0) {
+        size_t chunk = len < w->buf_size ? (size_t)len : w->buf_size;
+        if (fread(w->buf, 1, chunk, in) != chunk) {
+            return BRARCHIVE_ESHORT;
+        }
+        if (writer_out(w, w->buf, chunk) != BRARCHIVE_OK) {
+            return BRARCHIVE_EIO;
+        }
+        len -= chunk;
+    }
+    return err;
+}
+
+int brarchive_writer_copy_range(brarchive_writer *w, brarchive *src, uint64_t pos, uint64_t len) {
+    int err = writer_data(w);
+    if (err != BRARCHIVE_OK) {
+        return err;
+    }
+    if (pos > src->size || len > src->size - pos) {
+        return BRARCHIVE_EBOUNDS;
+    }
+#ifdef HAVE_COPY_FILE_RANGE
+    if (len > 0 && w->tmp_path && w->method == BRARCHIVE_RAW && !src->streamed && fflush(w->f) == 0) {
+        off_t in_off = (off_t)pos;
+        while (len > 0) {
+            size_t chunk = len > (1U << 30) ? (1U << 30) : (size_t)len;
+            ssize_t n = copy_file_range(fileno(src->f), &in_off, fileno(w->f), NULL, chunk, 0);
+            if (n <= 0) {
+                break;
+            }
+            len -= (uint64_t)n;
+        }
+        pos = (uint64_t)in_off;
+        /* The stream's idea of the position is stale after a kernel copy */
+        if (fseeko(w->f, 0, SEEK_END) != 0) {
+            return BRARCHIVE_EIO;
+        }
+    }
+#endif
+    while (len > 0) {
+        size_t chunk = len < w->buf_size ? (size_t)len : w->buf_size;
+        const void *data;
+        err = brarchive_view(src, pos, chunk, w->buf, &data);
+        if (err != BRARCHIVE_OK) {
+            return err;
+        }
+        if (writer_out(w, data, chunk) != BRARCHIVE_OK) {
+            return BRARCHIVE_EIO;
+        }
+        pos += chunk;
+        len -= chunk;
+    }
+    return BRARCHIVE_OK;
+}
+
+int brarchive_writer_commit(brarchive_writer *w) {
+    int err = writer_data(w);
+    int finished = writer_finish(w, err == BRARCHIVE_OK);
+    if (err == BRARCHIVE_OK) {
+        err = finished;
+    }
+    if (err == BRARCHIVE_OK && (fflush(w->f) != 0 || ferror(w->f))) {
+        err = BRARCHIVE_EIO;
+    }
+    if (fclose(w->f) != 0 && err == BRARCHIVE_OK) {
+        err = BRARCHIVE_EIO;
+    }
+    if (!w->tmp_path) {
+        writer_free(w);
+        return err;
+    }
+#ifdef _WIN32
+    /* rename() does not replace an existing file on Windows */
+    if (err == BRARCHIVE_OK) {
+        remove(w->path);
+    }
+#endif
+    if (err == BRARCHIVE_OK && rename(w->tmp_path, w->path) != 0) {
+        err = BRARCHIVE_EIO;
+    }
+    if (err != BRARCHIVE_OK) {
+        unlink(w->tmp_path);
+    }
+    writer_free(w);
+    return err;
+}
+
+void brarchive_writer_abort(brarchive_writer *w) {
+    if (!w) {
+        return;
+    }
+    writer_finish(w, 0);
+    fclose(w->f);
+    if (w->tmp_path) {
+        unlink(w->tmp_path);
+    }
+    writer_free(w);
+}
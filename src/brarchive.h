@@ -0,0 +1,211 @@
+/*
+ * libbrarchive - read and write .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BRARCHIVE_H
+#define BRARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Format constants (see brarchive(5)) */
+#define BRARCHIVE_MAGIC       0x267052A0B125277DULL
+#define BRARCHIVE_VERSION     1
+#define BRARCHIVE_HEADER_SIZE 16
+#define BRARCHIVE_ENTRY_SIZE  256
+#define BRARCHIVE_MAX_NAME    247
+
+/* Error codes; functions return 0 on success or one of these */
+#define BRARCHIVE_OK        0
+#define BRARCHIVE_EIO      (-1)  /* Open, read or write failed; errno is set */
+#define BRARCHIVE_ENOMEM   (-2)  /* Out of memory */
+#define BRARCHIVE_ESMALL   (-3)  /* File too small for a header */
+#define BRARCHIVE_EMAGIC   (-4)  /* Not a .brarchive file */
+#define BRARCHIVE_ENAME    (-5)  /* Invalid name length */
+#define BRARCHIVE_EBOUNDS  (-6)  /* Descriptor or contents outside the file */
+#define BRARCHIVE_ENOENT   (-7)  /* No member with that name */
+#define BRARCHIVE_ESHORT   (-8)  /* Source ended before the declared size */
+#define BRARCHIVE_ERANGE   (-9)  /* Offset or size does not fit the format */
+#define BRARCHIVE_EINVAL   (-10) /* Invalid argument or call order */
+#define BRARCHIVE_ENOTSUP  (-11) /* Compression method not built in */
+#define BRARCHIVE_ESEEK    (-12) /* Read behind the position of a pipe */
+
+/* Compressed containers: the whole archive in one gzip or zstd stream */
+#define BRARCHIVE_RAW  0
+#define BRARCHIVE_GZIP 1
+#define BRARCHIVE_ZSTD 2
+
+/* Human-readable message for an error code */
+const char *brarchive_strerror(int err);
+
+/* Nonzero when method (BRARCHIVE_RAW, _GZIP or _ZSTD) was built in */
+int brarchive_compression_supported(int method);
+
+/*
+ * Reading.  An archive is mapped when possible, so member views point
+ * straight into the page cache; otherwise the header and entry table are
+ * loaded and members are read on demand.  The hint picks paging advice.
+ *
+ * A compressed archive is recognized by its magic and decompressed as a
+ * stream: opening it decompresses only the header and entry table, and
+ * reads continue forward from there.  Reading behind the stream position
+ * starts decompression over, so members are best read in data order.
+ *
+ * An archive on a pipe (brarchive_open_stream) is read the same way in a
+ * single forward pass, compressed or not, and reading behind the stream
+ * position fails with ESEEK.
+ */
+#define BRARCHIVE_READ_TABLE 0  /* Only the entry table is needed */
+#define BRARCHIVE_READ_ALL   1  /* Every member is read in table order */
+#define BRARCHIVE_READ_SOME  2  /* A subset of members is read */
+
+typedef struct brarchive brarchive;
+
+/* One entry descriptor, viewed in place; the name is not NUL-terminated */
+struct brarchive_entry {
+    const char *name;
+    size_t name_len;
+    uint32_t offset;            /* Relative to the data block */
+    uint32_t size;
+};
+
+int brarchive_open(brarchive **ar, const char *path, int hint);
+
+/* Read an already open stream, such as stdin; takes ownership of f */
+int brarchive_open_stream(brarchive **ar, FILE *f, const char *name, int hint);
+void brarchive_close(brarchive *ar);
+
+const char *brarchive_path(const brarchive *ar);
+uint32_t brarchive_version(const brarchive *ar);
+
+/* Entries declared by the header, and how many of them fit in the file */
+uint32_t brarchive_count(const brarchive *ar);
+uint32_t brarchive_table_count(const brarchive *ar);
+
+/*
+ * File offset of the data block, and the file size.  For a compressed
+ * archive the size is where the last member's contents end.
+ */
+uint64_t brarchive_data_start(const brarchive *ar);
+uint64_t brarchive_size(const brarchive *ar);
+
+/* Nonzero when members are served from a mapping (safe to read from several threads) */
+int brarchive_is_mapped(const brarchive *ar);
+
+/* How the archive file is compressed: BRARCHIVE_RAW, _GZIP or _ZSTD */
+int brarchive_compression(const brarchive *ar);
+
+/* Nonzero when members are read as a stream (compressed, or a pipe) */
+int brarchive_is_streamed(const brarchive *ar);
+
+/* Describe entry index; fails with ENAME or EBOUNDS for a bad descriptor */
+int brarchive_entry(const brarchive *ar, uint32_t index, struct brarchive_entry *entry);
+
+/* Nonzero when an entry's contents lie inside the file */
+int brarchive_in_bounds(const brarchive *ar, const struct brarchive_entry *entry);
+
+/*
+ * Find a member by full name.  A table sorted by name (as br-ar writes
+ * it) is binary searched.  Other tables are scanned once and indexed on
+ * the next lookup.  The first of duplicate names wins, except that in an
+ * unsorted table the binary search tried first may hit a later one.
+ * Lookups update this state, so they must not race other calls.
+ */
+int brarchive_find(brarchive *ar, const char *name, size_t name_len, uint32_t *index);
+
+/*
+ * Nonzero when every descriptor is valid and names never decrease, so
+ * the members named by brarchive_find() follow it in the table.  The
+ * answer is kept, like brarchive_find()'s.
+ */
+int brarchive_sorted(brarchive *ar);
+
+/*
+ * A member's contents.  Mapped archives return a view into the mapping;
+ * otherwise the member is read into a buffer owned by the archive that
+ * stays valid until the next call.
+ */
+int brarchive_read(brarchive *ar, const struct brarchive_entry *entry, const void **data);
+
+/*
+ * len bytes at file offset pos: a view into the mapping, or a copy in
+ * buf (which must hold len bytes) when the archive is not mapped.
+ */
+int brarchive_view(brarchive *ar, uint64_t pos, size_t len, void *buf, const void **data);
+
+/*
+ * Writing.  The archive is written to a temporary file that replaces
+ * the target on commit, so a failed write leaves any old archive intact.
+ * Calls go in format order: begin, one entry per member, then the data
+ * block, then commit.  Descriptors and copies go through one buffer of
+ * buffer_size bytes, so memory use does not depend on archive size.
+ */
+typedef struct brarchive_writer brarchive_writer;
+
+int brarchive_writer_open(brarchive_writer **w, const char *path, size_t buffer_size);
+
+/*
+ * Write straight to an open stream, such as stdout, taking ownership of
+ * f.  There is no temporary file: commit flushes and closes f, and a
+ * failed write leaves whatever was already written.
+ */
+int brarchive_writer_open_stream(brarchive_writer **w, FILE *f, size_t buffer_size);
+
+/*
+ * Compress the archive with method, before begin.  A level of 0 picks the
+ * method's default; threads above 1 compress in that many workers where
+ * the method and library support it (zstd built with threading).
+ */
+int brarchive_writer_compress(brarchive_writer *w, int method, int level, int threads);
+
+/* Write the header for count entries */
+int brarchive_writer_begin(brarchive_writer *w, uint32_t count);
+
+/* Add the next descriptor; offset is relative to the data block */
+int brarchive_writer_entry(brarchive_writer *w, const char *name, size_t name_len,
+                           uint64_t offset, uint64_t size);
+
+/* Append to the data block (after all entries) */
+int brarchive_writer_write(brarchive_writer *w, const void *data, size_t len);
+
+/* Append exactly len bytes from a stream; ESHORT if it ends early */
+int brarchive_writer_copy_file(brarchive_writer *w, FILE *in, uint64_t len);
+
+/*
+ * Append len bytes of another archive, starting at file offset pos.
+ * Uses a kernel-side copy where available (which can share extents on
+ * reflink-capable filesystems) when neither archive is compressed.
+ */
+int brarchive_writer_copy_range(brarchive_writer *w, brarchive *src, uint64_t pos, uint64_t len);
+
+/* Finish and replace the target; the writer is freed either way */
+int brarchive_writer_commit(brarchive_writer *w);
+
+/* Discard the temporary file and free the writer */
+void brarchive_writer_abort(brarchive_writer *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BRARCHIVE_H */
@@ -0,0 +1,772 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "delta.h"
+#include "hash.h"
+#include "stats.h"
+
+#define DELTA_CHUNK (1024 * 1024)  /* Bytes hashed or copied at a time; a multiple of 8 */
+#define DELTA_BATCH 64             /* Most members a worker hashes at once */
+#define NO_MEMBER   UINT32_MAX
+
+/* One archive of a diff */
+struct side {
+    brarchive *ar;
+    struct brarchive_entry *entries;
+    uint64_t *hashes;
+    uint32_t count;
+    const uint8_t *data;        /* Mapped data block, NULL when not mapped */
+};
+
+struct diff {
+    struct side from;
+    struct side to;
+    size_t next;                /* Next member to hash, counting from's then to's */
+    bool failed;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+/* Member order for hashing and writing */
+struct member_pos {
+    uint64_t key;
+    uint64_t size;
+    uint32_t index;
+};
+
+/* Pending data operation of a delta being written */
+struct delta_out {
+    FILE *f;
+    const struct side *to;
+    uint8_t *buf;
+    uint64_t hash;
+    int op;                     /* 0, 'c' or 'd' */
+    uint64_t src;               /* 'c': position in the old archive */
+    uint64_t pos;               /* Position in the new data block */
+    uint64_t len;
+};
+
+static void write_le(uint8_t *p, uint64_t v, int bytes) {
+    int i;
+    for (i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint64_t read_le(const uint8_t *p, int bytes) {
+    uint64_t v = 0;
+    int i;
+    for (i = bytes - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void put_varint(FILE *f, uint64_t v) {
+    while (v >= 0x80) {
+        putc((int)(v & 0x7F) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int)v, f);
+}
+
+static bool get_varint(FILE *f, uint64_t *v) {
+    int shift;
+    *v = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        int c = getc(f);
+        if (c == EOF) {
+            return false;
+        }
+        *v |= (uint64_t)(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A descriptor as the writer lays it out */
+static void build_desc(uint8_t *desc, const char *name, size_t name_len, uint64_t offset, uint64_t size) {
+    memset(desc, 0, BRARCHIVE_ENTRY_SIZE);
+    desc[0] = (uint8_t)name_len;
+    memcpy(desc + 1, name, name_len);
+    write_le(desc + 248, offset, 4);
+    write_le(desc + 252, size, 4);
+}
+
+/* Header as the writer lays it out */
+static uint64_t header_hash(uint32_t count) {
+    uint8_t header[BRARCHIVE_HEADER_SIZE];
+    write_le(header, BRARCHIVE_MAGIC, 8);
+    write_le(header + 8, count, 4);
+    write_le(header + 12, BRARCHIVE_VERSION, 4);
+    return content_hash(HASH_SEED, header, BRARCHIVE_HEADER_SIZE);
+}
+
+static void diff_lock(struct diff *d) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&d->lock);
+#else
+    (void)d;
+#endif
+}
+
+static void diff_unlock(struct diff *d) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&d->lock);
+#else
+    (void)d;
+#endif
+}
+
+static int member_pos_cmp(const void *a, const void *b) {
+    const struct member_pos *x = a;
+    const struct member_pos *y = b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Describe every entry; a diff needs the whole table and every member in bounds */
+static bool load_side(struct side *s, brarchive *ar) {
+    uint32_t i;
+    const void *map;
+    
+    s->ar = ar;
+    s->count = brarchive_table_count(ar);
+    if (s->count < brarchive_count(ar)) {
+        fprintf(stderr, "Archive corrupted: entry %u out of bounds: %s\n", s->count, brarchive_path(ar));
+        return false;
+    }
+    s->entries = malloc(((size_t)s->count + 1) * sizeof(struct brarchive_entry));
+    s->hashes = malloc(((size_t)s->count + 1) * sizeof(uint64_t));
+    if (!s->entries || !s->hashes) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    for (i = 0; i < s->count; i++) {
+        if (brarchive_entry(ar, i, &s->entries[i]) != BRARCHIVE_OK) {
+            fprintf(stderr, "Invalid name length in entry %u: %s\n", i, brarchive_path(ar));
+            return false;
+        }
+        if (!brarchive_in_bounds(ar, &s->entries[i])) {
+            fprintf(stderr, "Archive corrupted: file %.*s out of bounds: %s\n",
+                    (int)s->entries[i].name_len, s->entries[i].name, brarchive_path(ar));
+            return false;
+        }
+    }
+    if (brarchive_is_mapped(ar) && brarchive_data_start(ar) <= brarchive_size(ar) &&
+        brarchive_view(ar, 0, (size_t)brarchive_size(ar), NULL, &map) == BRARCHIVE_OK) {
+        s->data = (const uint8_t *)map + brarchive_data_start(ar);
+    }
+    return true;
+}
+
+static uint64_t member_hash(const struct brarchive_entry *e, const uint8_t *data) {
+    return content_hash(HASH_SEED ^ e->size, data, e->size);
+}
+
+/* Hash mapped members, a batch at a time */
+static void *hash_worker(void *arg) {
+    struct diff *d = arg;
+    size_t total = (size_t)d->from.count + d->to.count;
+    
+    for (;;) {
+        diff_lock(d);
+        size_t first = d->next;
+        size_t last = total - first > DELTA_BATCH ? first + DELTA_BATCH : total;
+        d->next = last;
+        diff_unlock(d);
+        if (first == last) {
+            break;
+        }
+        for (; first < last; first++) {
+            struct side *s = first < d->from.count ? &d->from : &d->to;
+            size_t i = first < d->from.count ? first : first - d->from.count;
+            if (s->data) {
+                s->hashes[i] = member_hash(&s->entries[i], s->data + s->entries[i].offset);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Without a mapping, read the members in data order so a stream only goes forward */
+static bool hash_unmapped(struct side *s) {
+    struct member_pos *order = malloc(((size_t)s->count + 1) * sizeof(struct member_pos));
+    uint32_t i;
+    if (!order) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    for (i = 0; i < s->count; i++) {
+        order[i].key = s->entries[i].offset;
+        order[i].size = s->entries[i].size;
+        order[i].index = i;
+    }
+    qsort(order, s->count, sizeof(struct member_pos), member_pos_cmp);
+    for (i = 0; i < s->count; i++) {
+        const struct brarchive_entry *e = &s->entries[order[i].index];
+        const void *data;
+        int err = brarchive_read(s->ar, e, &data);
+        if (err != BRARCHIVE_OK) {
+            fprintf(stderr, "Failed to read %.*s: %s\n", (int)e->name_len, e->name, brarchive_strerror(err));
+            free(order);
+            return false;
+        }
+        s->hashes[order[i].index] = member_hash(e, data);
+    }
+    free(order);
+    return true;
+}
+
+/* Hash every member of both archives, mapped ones on threads workers */
+static bool hash_members(struct diff *d, int threads) {
+    if ((!d->from.data && !hash_unmapped(&d->from)) || (!d->to.data && !hash_unmapped(&d->to))) {
+        return false;
+    }
+#ifdef HAVE_PTHREAD
+    /* The calling thread is one of the workers */
+    pthread_t *workers = NULL;
+    int started = 0;
+    if (threads > 1 && (workers = malloc((size_t)(threads - 1) * sizeof(pthread_t)))) {
+        while (started < threads - 1 && pthread_create(&workers[started], NULL, hash_worker, d) == 0) {
+            started++;
+        }
+    }
+    hash_worker(d);
+    while (started > 0) {
+        pthread_join(workers[--started], NULL);
+    }
+    free(workers);
+#else
+    (void)threads;
+    hash_worker(d);
+#endif
+    return true;
+}
+
+/* Whether two members hold the same bytes: compared when mapped, else by hash */
+static bool same_contents(const struct side *a, uint32_t i, const struct side *b, uint32_t j) {
+    const struct brarchive_entry *x = &a->entries[i];
+    const struct brarchive_entry *y = &b->entries[j];
+    if (x->size != y->size || a->hashes[i] != b->hashes[j]) {
+        return false;
+    }
+    return !a->data || !b->data || memcmp(a->data + x->offset, b->data + y->offset, x->size) == 0;
+}
+
+/* Old member with the same contents as new member i, or NO_MEMBER */
+static uint32_t find_source(const struct diff *d, const uint32_t *pair, const struct member_pos *by_hash, uint32_t i) {
+    const struct brarchive_entry *e = &d->to.entries[i];
+    size_t lo = 0;
+    size_t hi = d->from.count;
+    
+    if (pair[i] != NO_MEMBER && same_contents(&d->to, i, &d->from, pair[i])) {
+        return pair[i];
+    }
+    /* Renamed or copied members: any old member with the same hash */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (by_hash[mid].key < d->to.hashes[i] ||
+            (by_hash[mid].key == d->to.hashes[i] && by_hash[mid].size > e->size)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < d->from.count && by_hash[lo].key == d->to.hashes[i] && by_hash[lo].size == e->size; lo++) {
+        if (same_contents(&d->to, i, &d->from, by_hash[lo].index)) {
+            return by_hash[lo].index;
+        }
+    }
+    return NO_MEMBER;
+}
+
+/* Write the pending data operation, hashing the new archive's bytes it stands for */
+static bool delta_flush(struct delta_out *o) {
+    uint64_t done = 0;
+    uint64_t start = brarchive_data_start(o->to->ar) + o->pos;
+    
+    if (!o->op) {
+        return true;
+    }
+    putc(o->op, o->f);
+    if (o->op == 'c') {
+        put_varint(o->f, o->src);
+    }
+    put_varint(o->f, o->len);
+    while (done < o->len) {
+        size_t n = o->len - done > DELTA_CHUNK ? DELTA_CHUNK : (size_t)(o->len - done);
+        const void *data;
+        int err = brarchive_view(o->to->ar, start + done, n, o->buf, &data);
+        if (err != BRARCHIVE_OK) {
+            fprintf(stderr, "Failed to read %s: %s\n", brarchive_path(o->to->ar), brarchive_strerror(err));
+            return false;
+        }
+        o->hash = content_hash(o->hash, data, n);
+        if (o->op == 'd' && fwrite(data, 1, n, o->f) != n) {
+            return false;
+        }
+        done += n;
+    }
+    o->op = 0;
+    return true;
+}
+
+/* Add len bytes of the new data block at pos, copied from old position src or literal (src UINT64_MAX) */
+static bool delta_data(struct delta_out *o, uint64_t src, uint64_t pos, uint64_t len) {
+    int op = src == UINT64_MAX ? 'd' : 'c';
+    if (len == 0) {
+        return true;
+    }
+    if (o->op == op && o->pos + o->len == pos && (op == 'd' || o->src + o->len == src)) {
+        o->len += len;
+        return true;
+    }
+    if (!delta_flush(o)) {
+        return false;
+    }
+    o->op = op;
+    o->src = src;
+    o->pos = pos;
+    o->len = len;
+    return true;
+}
+
+/* Descriptor operations: runs of unchanged old descriptors, else literal ones */
+static void delta_table(struct delta_out *o, const struct diff *d, const uint32_t *pair) {
+    const struct side *to = &d->to;
+    uint64_t prev_end = 0;
+    uint32_t i = 0;
+    
+    o->hash = header_hash(to->count);
+    while (i < to->count) {
+        uint32_t run = 0;
+        while (i + run < to->count) {
+            const struct brarchive_entry *e = &to->entries[i + run];
+            uint32_t j = pair[i + run];
+            if (j == NO_MEMBER || (run > 0 && j != pair[i] + run) ||
+                d->from.entries[j].size != e->size || e->offset != prev_end) {
+                break;
+            }
+            prev_end = (uint64_t)e->offset + e->size;
+            run++;
+        }
+        if (run > 0) {
+            putc('e', o->f);
+            put_varint(o->f, pair[i]);
+            put_varint(o->f, run);
+        } else {
+            const struct brarchive_entry *e = &to->entries[i];
+            putc('n', o->f);
+            put_varint(o->f, e->name_len);
+            fwrite(e->name, 1, e->name_len, o->f);
+            put_varint(o->f, e->offset);
+            put_varint(o->f, e->size);
+            prev_end = (uint64_t)e->offset + e->size;
+            run = 1;
+        }
+        for (; run > 0; run--, i++) {
+            uint8_t desc[BRARCHIVE_ENTRY_SIZE];
+            const struct brarchive_entry *e = &to->entries[i];
+            build_desc(desc, e->name, e->name_len, e->offset, e->size);
+            o->hash = content_hash(o->hash, desc, BRARCHIVE_ENTRY_SIZE);
+        }
+    }
+}
+
+/* Write a delta: the table, then the new data block in order, copying what the old one has */
+static bool write_delta(const struct diff *d, const uint32_t *pair, FILE *f, const char *delta_name,
+                        uint64_t *delta_size) {
+    struct delta_out o;
+    struct member_pos *by_hash = malloc(((size_t)d->from.count + 1) * sizeof(struct member_pos));
+    struct member_pos *order = malloc(((size_t)d->to.count + 1) * sizeof(struct member_pos));
+    uint64_t data_len = brarchive_size(d->to.ar) - brarchive_data_start(d->to.ar);
+    uint64_t old_start = brarchive_data_start(d->from.ar);
+    uint64_t cursor = 0;
+    uint8_t header[28];
+    uint32_t i;
+    bool ok = true;
+    
+    memset(&o, 0, sizeof(o));
+    o.to = &d->to;
+    o.f = f;
+    o.buf = malloc(DELTA_CHUNK);
+    if (!by_hash || !order || !o.buf) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(by_hash);
+        free(order);
+        free(o.buf);
+        return false;
+    }
+    for (i = 0; i < d->from.count; i++) {
+        by_hash[i].key = d->from.hashes[i];
+        by_hash[i].size = d->from.entries[i].size;
+        by_hash[i].index = i;
+    }
+    qsort(by_hash, d->from.count, sizeof(struct member_pos), member_pos_cmp);
+    for (i = 0; i < d->to.count; i++) {
+        order[i].key = d->to.entries[i].offset;
+        order[i].size = d->to.entries[i].size;
+        order[i].index = i;
+    }
+    qsort(order, d->to.count, sizeof(struct member_pos), member_pos_cmp);
+    
+    memcpy(header, DELTA_MAGIC, 8);
+    write_le(header + 8, brarchive_size(d->from.ar), 8);
+    write_le(header + 16, brarchive_size(d->to.ar), 8);
+    write_le(header + 24, d->to.count, 4);
+    fwrite(header, 1, sizeof(header), o.f);
+    delta_table(&o, d, pair);
+    
+    /* Shared and overlapping ranges are covered once; gaps are literal */
+    for (i = 0; ok && i < d->to.count; i++) {
+        const struct brarchive_entry *e = &d->to.entries[order[i].index];
+        uint64_t end = (uint64_t)e->offset + e->size;
+        uint64_t start = e->offset > cursor ? e->offset : cursor;
+        if (end <= cursor) {
+            continue;
+        }
+        ok = delta_data(&o, UINT64_MAX, cursor, start - cursor);
+        uint32_t src = ok ? find_source(d, pair, by_hash, order[i].index) : NO_MEMBER;
+        if (ok && src != NO_MEMBER) {
+            ok = delta_data(&o, old_start + d->from.entries[src].offset + (start - e->offset), start, end - start);
+        } else if (ok) {
+            ok = delta_data(&o, UINT64_MAX, start, end - start);
+        }
+        cursor = end;
+    }
+    ok = ok && delta_data(&o, UINT64_MAX, cursor, data_len > cursor ? data_len - cursor : 0) && delta_flush(&o);
+    
+    if (ok) {
+        uint8_t hash[8];
+        write_le(hash, o.hash, 8);
+        putc('z', o.f);
+        fwrite(hash, 1, sizeof(hash), o.f);
+    }
+    if (ok && (fflush(o.f) != 0 || ferror(o.f))) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "Failed to write delta: %s\n", delta_name);
+    }
+    *delta_size = ok ? (uint64_t)ftell(o.f) : 0;
+    free(by_hash);
+    free(order);
+    free(o.buf);
+    return ok;
+}
+
+/* A line of the report */
+struct change {
+    const struct brarchive_entry *entry;
+    char status;
+};
+
+static int change_cmp(const void *a, const void *b) {
+    const struct brarchive_entry *x = ((const struct change *)a)->entry;
+    const struct brarchive_entry *y = ((const struct change *)b)->entry;
+    int r = memcmp(x->name, y->name, x->name_len < y->name_len ? x->name_len : y->name_len);
+    if (r != 0) {
+        return r;
+    }
+    return x->name_len < y->name_len ? -1 : x->name_len > y->name_len;
+}
+
+bool diff_archives(brarchive *from, brarchive *to, FILE *delta, const char *delta_name, int threads) {
+    struct diff d;
+    struct change *changes = NULL;
+    uint32_t *pair = NULL;
+    size_t change_count = 0;
+    size_t added = 0, removed = 0, changed = 0;
+    uint64_t delta_size = 0;
+    uint32_t i;
+    bool ok;
+    
+    memset(&d, 0, sizeof(d));
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&d.lock, NULL);
+#endif
+    STATS_PHASE("load");
+    ok = load_side(&d.from, from) && load_side(&d.to, to);
+    if (ok) {
+        STATS_PHASE("hash");
+        ok = hash_members(&d, threads);
+    }
+    
+    /* Pair members by name; the first of duplicate names wins */
+    if (ok) {
+        STATS_PHASE("compare");
+        pair = malloc(((size_t)d.to.count + 1) * sizeof(uint32_t));
+        changes = malloc(((size_t)d.from.count + d.to.count + 1) * sizeof(struct change));
+        if (!pair || !changes) {
+            fprintf(stderr, "Memory allocation failed\n");
+            ok = false;
+        }
+    }
+    for (i = 0; ok && i < d.to.count; i++) {
+        const struct brarchive_entry *e = &d.to.entries[i];
+        if (brarchive_find(from, e->name, e->name_len, &pair[i]) != BRARCHIVE_OK) {
+            pair[i] = NO_MEMBER;
+            changes[change_count].entry = e;
+            changes[change_count++].status = 'A';
+            added++;
+        } else if (!same_contents(&d.to, i, &d.from, pair[i])) {
+            changes[change_count].entry = e;
+            changes[change_count++].status = 'M';
+            changed++;
+        }
+    }
+    for (i = 0; ok && i < d.from.count; i++) {
+        const struct brarchive_entry *e = &d.from.entries[i];
+        uint32_t index;
+        if (brarchive_find(to, e->name, e->name_len, &index) == BRARCHIVE_ENOENT) {
+            changes[change_count].entry = e;
+            changes[change_count++].status = 'D';
+            removed++;
+        }
+    }
+    
+    if (ok) {
+        size_t k;
+        qsort(changes, change_count, sizeof(struct change), change_cmp);
+        for (k = 0; k < change_count; k++) {
+            printf("%c %.*s\n", changes[k].status, (int)changes[k].entry->name_len, changes[k].entry->name);
+        }
+        STATS_COUNT(d.from.count + d.to.count, 0);
+    }
+    if (ok && delta) {
+        STATS_PHASE("delta");
+        ok = write_delta(&d, pair, delta, delta_name, &delta_size);
+    }
+    if (ok) {
+        printf("%zu added, %zu removed, %zu changed, %zu unchanged\n",
+               added, removed, changed, (size_t)d.to.count - added - changed);
+        /* A pipe has no position to give the size */
+        if (delta && (int64_t)delta_size > 0) {
+            printf("Delta %s: %llu bytes for a %llu-byte archive\n", delta_name,
+                   (unsigned long long)delta_size, (unsigned long long)brarchive_size(to));
+        }
+    }
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&d.lock);
+#endif
+    free(changes);
+    free(pair);
+    free(d.from.entries);
+    free(d.from.hashes);
+    free(d.to.entries);
+    free(d.to.hashes);
+    return ok;
+}
+
+/* Read exactly len bytes of a delta */
+static bool delta_read(FILE *f, void *buf, size_t len) {
+    return fread(buf, 1, len, f) == len;
+}
+
+/* Copy old bytes into the new archive, hashing them on the way */
+static int apply_copy(brarchive *from, brarchive_writer *out, uint8_t *buf, uint64_t pos, uint64_t len, uint64_t *hash) {
+    uint64_t done = 0;
+    int err = BRARCHIVE_OK;
+    
+    if (pos > brarchive_size(from) || len > brarchive_size(from) - pos) {
+        return BRARCHIVE_EBOUNDS;
+    }
+    while (err == BRARCHIVE_OK && done < len) {
+        size_t n = len - done > DELTA_CHUNK ? DELTA_CHUNK : (size_t)(len - done);
+        const void *data;
+        if ((err = brarchive_view(from, pos + done, n, buf, &data)) == BRARCHIVE_OK) {
+            *hash = content_hash(*hash, data, n);
+            /* A mapped archive is copied in one go below, by the kernel where it can */
+            if (!brarchive_is_mapped(from)) {
+                err = brarchive_writer_write(out, data, n);
+            }
+        }
+        done += n;
+    }
+    if (err == BRARCHIVE_OK && brarchive_is_mapped(from)) {
+        err = brarchive_writer_copy_range(out, from, pos, len);
+    }
+    return err;
+}
+
+bool apply_delta(const char *delta_path, brarchive *from, brarchive_writer *out) {
+    bool is_stdin = strcmp(delta_path, "-") == 0;
+    FILE *f = is_stdin ? stdin : fopen(delta_path, "rb");
+    uint8_t *buf = malloc(DELTA_CHUNK);
+    uint8_t header[28];
+    uint32_t count = 0;
+    uint32_t added = 0;
+    uint64_t prev_end = 0;
+    uint64_t hash = 0;
+    uint64_t written = 0;
+    uint64_t expected = 0;
+    int err = BRARCHIVE_OK;
+    bool corrupt = false;
+    bool ended = false;
+    
+    if (!f || !buf) {
+        fprintf(stderr, buf ? "Failed to read delta: %s\n" : "Memory allocation failed\n", delta_path);
+        if (f && !is_stdin) {
+            fclose(f);
+        }
+        free(buf);
+        brarchive_writer_abort(out);
+        return false;
+    }
+    if (!delta_read(f, header, sizeof(header)) || memcmp(header, DELTA_MAGIC, 8) != 0) {
+        fprintf(stderr, "Not a delta: %s\n", delta_path);
+        err = BRARCHIVE_EINVAL;
+    } else if (read_le(header + 8, 8) != brarchive_size(from)) {
+        fprintf(stderr, "Delta %s was made for a %llu-byte archive, not %s (%llu bytes)\n", delta_path,
+                (unsigned long long)read_le(header + 8, 8), brarchive_path(from),
+                (unsigned long long)brarchive_size(from));
+        err = BRARCHIVE_EINVAL;
+    } else {
+        expected = read_le(header + 16, 8);
+        count = (uint32_t)read_le(header + 24, 4);
+        err = brarchive_writer_begin(out, count);
+        hash = header_hash(count);
+        written = BRARCHIVE_HEADER_SIZE;
+    }
+    
+    while (!corrupt && !ended && err == BRARCHIVE_OK) {
+        int op = getc(f);
+        uint64_t a, b, c;
+        switch (op) {
+        case 'e':
+            if (!get_varint(f, &a) || !get_varint(f, &b) || a > brarchive_table_count(from) ||
+                b > brarchive_table_count(from) - a || b > count - added) {
+                corrupt = true;
+                break;
+            }
+            for (; b > 0 && err == BRARCHIVE_OK; a++, b--) {
+                struct brarchive_entry e;
+                uint8_t desc[BRARCHIVE_ENTRY_SIZE];
+                if ((err = brarchive_entry(from, (uint32_t)a, &e)) != BRARCHIVE_OK ||
+                    (err = brarchive_writer_entry(out, e.name, e.name_len, prev_end, e.size)) != BRARCHIVE_OK) {
+                    break;
+                }
+                build_desc(desc, e.name, e.name_len, prev_end, e.size);
+                hash = content_hash(hash, desc, BRARCHIVE_ENTRY_SIZE);
+                prev_end += e.size;
+                added++;
+            }
+            break;
+        case 'n': {
+            char name[BRARCHIVE_MAX_NAME];
+            uint8_t desc[BRARCHIVE_ENTRY_SIZE];
+            if (!get_varint(f, &a) || a > BRARCHIVE_MAX_NAME || !delta_read(f, name, (size_t)a) ||
+                !get_varint(f, &b) || !get_varint(f, &c) || added >= count) {
+                corrupt = true;
+                break;
+            }
+            if ((err = brarchive_writer_entry(out, name, (size_t)a, b, c)) == BRARCHIVE_OK) {
+                build_desc(desc, name, (size_t)a, b, c);
+                hash = content_hash(hash, desc, BRARCHIVE_ENTRY_SIZE);
+                prev_end = b + c;
+                added++;
+            }
+            break;
+        }
+        case 'c':
+            if (!get_varint(f, &a) || !get_varint(f, &b) || added < count) {
+                corrupt = true;
+                break;
+            }
+            err = apply_copy(from, out, buf, a, b, &hash);
+            written += b;
+            break;
+        case 'd':
+            if (!get_varint(f, &a) || added < count) {
+                corrupt = true;
+                break;
+            }
+            written += a;
+            while (a > 0 && err == BRARCHIVE_OK) {
+                size_t n = a > DELTA_CHUNK ? DELTA_CHUNK : (size_t)a;
+                if (!delta_read(f, buf, n)) {
+                    corrupt = true;
+                    break;
+                }
+                hash = content_hash(hash, buf, n);
+                err = brarchive_writer_write(out, buf, n);
+                a -= n;
+            }
+            break;
+        case 'z': {
+            uint8_t tail[8];
+            corrupt = !delta_read(f, tail, sizeof(tail)) || added < count;
+            ended = true;
+            if (!corrupt && (read_le(tail, 8) != hash ||
+                             written + (uint64_t)BRARCHIVE_ENTRY_SIZE * count != expected)) {
+                fprintf(stderr, "Delta %s does not match %s\n", delta_path, brarchive_path(from));
+                err = BRARCHIVE_EINVAL;
+            }
+            break;
+        }
+        default:
+            corrupt = true;
+            break;
+        }
+    }
+    
+    /* EINVAL stands for a mismatch already reported */
+    if (corrupt && err == BRARCHIVE_OK) {
+        fprintf(stderr, "Delta corrupted: %s\n", delta_path);
+    } else if (err != BRARCHIVE_OK && err != BRARCHIVE_EINVAL) {
+        fprintf(stderr, "Failed to apply delta %s: %s\n", delta_path, brarchive_strerror(err));
+    }
+    if (!is_stdin) {
+        fclose(f);
+    }
+    free(buf);
+    if (corrupt || err != BRARCHIVE_OK) {
+        brarchive_writer_abort(out);
+        return false;
+    }
+    STATS_COUNT(count, expected);
+    return brarchive_writer_commit(out) == BRARCHIVE_OK;
+}
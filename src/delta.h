@@ -0,0 +1,73 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BR_AR_DELTA_H
+#define BR_AR_DELTA_H
+
+#ifdef HAVE_STDBOOL_H
+#include <stdbool.h>
+#else
+#ifndef bool
+#define bool int
+#define true 1
+#define false 0
+#endif
+#endif
+
+#include "brarchive.h"
+
+/*
+ * Deltas (--diff --delta, --apply) rebuild one archive from another.  A
+ * delta is a header, then operations that each start with a byte and
+ * carry unsigned LEB128 numbers:
+ *
+ * Header:  "BRDELTA1", the old archive's size and the new archive's size
+ *          (64-bit little-endian), and its entry count (32-bit).
+ *
+ *   'e' index, count         descriptors of old entries index onwards,
+ *                            each member placed right after the last
+ *   'n' length, name, offset, size   one descriptor
+ *   'c' position, length     bytes of the old archive, by file offset
+ *   'd' length, bytes        literal bytes
+ *   'z' hash                 end, then a 64-bit little-endian hash
+ *
+ * Descriptors come first; data operations then give the data block in
+ * order.  The hash chains content_hash() over the header, each
+ * descriptor and each data operation of the new archive, so a delta
+ * applied to the wrong archive is caught.  Descriptors are rebuilt the
+ * way br-ar writes them, with zero padding after the name.
+ */
+#define DELTA_MAGIC "BRDELTA1"
+
+/*
+ * Compare two archives: print added (A), removed (D) and changed (M)
+ * members by name and a summary line to stdout, with contents hashed on
+ * threads workers.  Also write a delta to the stream delta (named
+ * delta_name in messages) unless it is NULL; the caller closes it.
+ */
+bool diff_archives(brarchive *from, brarchive *to, FILE *delta, const char *delta_name, int threads);
+
+/*
+ * Rebuild into out the archive a delta (a path, or - for stdin) was made
+ * for from old.  out is committed on success and aborted otherwise.
+ */
+bool apply_delta(const char *delta_path, brarchive *from, brarchive_writer *out);
+
+#endif /* BR_AR_DELTA_H */
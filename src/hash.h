@@ -0,0 +1,41 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BR_AR_HASH_H
+#define BR_AR_HASH_H
+
+#include <stddef.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+/* FNV offset basis, the usual starting value */
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+/*
+ * 64-bit multiply-xorshift hash of p, a little-endian word at a time,
+ * continuing from h, so the result is the same on every host.  Hashing a
+ * buffer in pieces gives the same result as in one call as long as every
+ * piece but the last is a multiple of 8 bytes.
+ */
+uint64_t content_hash(uint64_t h, const uint8_t *p, size_t len);
+
+#endif /* BR_AR_HASH_H */
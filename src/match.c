@@ -0,0 +1,357 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "match.h"
+
+/* FNV-1a, good enough for short path names */
+uint64_t name_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (len--) {
+        h ^= (uint8_t)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static const char *base_name(const char *name) {
+    const char *slash = strrchr(name, '/');
+    return slash ? slash + 1 : name;
+}
+
+static bool is_glob(const char *pattern) {
+    return strpbrk(pattern, "*?[") != NULL;
+}
+
+/* Key a plain name the way lookups will see it */
+static const char *match_key(const struct name_matcher *m, const char *name) {
+    return m->mode == MATCH_BASENAME ? base_name(name) : name;
+}
+
+/* A plain name with a directory part names one member, like a path */
+static bool is_path_key(const struct name_matcher *m, const char *pattern) {
+    return m->mode == MATCH_BASENAME && strchr(pattern, '/') != NULL;
+}
+
+static bool key_insert(const char **keys, size_t capacity, const char *key) {
+    size_t mask = capacity - 1;
+    size_t i = (size_t)name_hash(key, strlen(key)) & mask;
+    while (keys[i]) {
+        if (strcmp(keys[i], key) == 0) {
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+    keys[i] = key;
+    return true;
+}
+
+static bool key_lookup(const struct name_matcher *m, const char *key) {
+    if (m->key_count == 0) {
+        return false;
+    }
+    size_t mask = m->key_capacity - 1;
+    size_t i = (size_t)name_hash(key, strlen(key)) & mask;
+    while (m->keys[i]) {
+        if (strcmp(m->keys[i], key) == 0) {
+            return true;
+        }
+        i = (i + 1) & mask;
+    }
+    return false;
+}
+
+/* Keep the set at most half full */
+static bool key_grow(struct name_matcher *m) {
+    size_t capacity = m->key_capacity ? m->key_capacity * 2 : 64;
+    const char **keys = calloc(capacity, sizeof(const char *));
+    size_t i;
+    if (!keys) {
+        return false;
+    }
+    for (i = 0; i < m->key_capacity; i++) {
+        if (m->keys[i]) {
+            key_insert(keys, capacity, m->keys[i]);
+        }
+    }
+    free((void *)m->keys);
+    m->keys = keys;
+    m->key_capacity = capacity;
+    return true;
+}
+
+void matcher_init(struct name_matcher *m, int mode) {
+    memset(m, 0, sizeof(*m));
+    m->mode = mode;
+}
+
+void matcher_free(struct name_matcher *m) {
+    size_t i;
+    for (i = 0; i < m->buffer_count; i++) {
+        free(m->buffers[i]);
+    }
+    free(m->buffers);
+    free((void *)m->keys);
+    free((void *)m->globs);
+    memset(m, 0, sizeof(*m));
+}
+
+bool matcher_add(struct name_matcher *m, const char *pattern) {
+    if (is_glob(pattern)) {
+        if (m->glob_count >= m->glob_capacity) {
+            size_t capacity = m->glob_capacity ? m->glob_capacity * 2 : 8;
+            const char **globs = realloc((void *)m->globs, capacity * sizeof(const char *));
+            if (!globs) {
+                return false;
+            }
+            m->globs = globs;
+            m->glob_capacity = capacity;
+        }
+        m->globs[m->glob_count++] = pattern;
+        return true;
+    }
+    
+    if ((m->key_count + 1) * 2 > m->key_capacity && !key_grow(m)) {
+        return false;
+    }
+    /* "./name" is the same member as "name" */
+    while (m->mode == MATCH_BASENAME && (pattern[0] == '/' || (pattern[0] == '.' && pattern[1] == '/'))) {
+        pattern += pattern[0] == '/' ? 1 : 2;
+    }
+    bool path = is_path_key(m, pattern);
+    if (key_insert(m->keys, m->key_capacity, path ? pattern : match_key(m, pattern))) {
+        m->key_count++;
+        if (path) {
+            m->path_count++;
+        }
+    }
+    return true;
+}
+
+bool matcher_add_file(struct name_matcher *m, const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to read name list: %s\n", path);
+        return false;
+    }
+    
+    /* Slurp the list; lines are split in place and the buffer kept alive */
+    size_t size = 0, capacity = 4096;
+    char *buf = malloc(capacity);
+    while (buf) {
+        size += fread(buf + size, 1, capacity - size - 1, f);
+        if (size < capacity - 1) {
+            break;
+        }
+        char *grown = realloc(buf, capacity * 2);
+        if (!grown) {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        buf = grown;
+        capacity *= 2;
+    }
+    bool read_error = ferror(f) != 0;
+    if (f != stdin) {
+        fclose(f);
+    }
+    if (!buf || read_error) {
+        fprintf(stderr, "Failed to read name list: %s\n", path);
+        free(buf);
+        return false;
+    }
+    buf[size] = '\0';
+    
+    char **buffers = realloc(m->buffers, (m->buffer_count + 1) * sizeof(char *));
+    if (!buffers) {
+        free(buf);
+        return false;
+    }
+    m->buffers = buffers;
+    m->buffers[m->buffer_count++] = buf;
+    
+    char *line = buf;
+    while (line < buf + size) {
+        char *end = strchr(line, '\n');
+        char *next = end ? end + 1 : buf + size;
+        if (!end) {
+            end = buf + size;
+        }
+        *end = '\0';
+        if (end > line && end[-1] == '\r') {
+            end[-1] = '\0';
+        }
+        if (*line && !matcher_add(m, line)) {
+            return false;
+        }
+        line = next;
+    }
+    return true;
+}
+
+bool matcher_empty(const struct name_matcher *m) {
+    return m->key_count == 0 && m->glob_count == 0;
+}
+
+bool matcher_match(const struct name_matcher *m, const char *name) {
+    size_t i;
+    
+    if (matcher_empty(m)) {
+        return true;
+    }
+    if (key_lookup(m, match_key(m, name))) {
+        return true;
+    }
+    if (m->path_count > 0 && is_path_key(m, name) && key_lookup(m, name)) {
+        return true;
+    }
+    for (i = 0; i < m->glob_count; i++) {
+        /* Patterns without a directory part follow the plain-name rule */
+        const char *target = strchr(m->globs[i], '/') ? name : match_key(m, name);
+        if (glob_match(m->globs[i], target)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool matcher_exact(const struct name_matcher *m) {
+    if (m->glob_count > 0 || m->key_count == 0) {
+        return false;
+    }
+    return m->mode == MATCH_EXACT || m->path_count == m->key_count;
+}
+
+/* Match a [...] class at *pp against c: 1 match, 0 no match, -1 malformed */
+static int class_match(const char **pp, char c) {
+    const char *p = *pp + 1;
+    bool negate = false;
+    bool found = false;
+    
+    if (*p == '!' || *p == '^') {
+        negate = true;
+        p++;
+    }
+    if (*p == ']') {
+        found = (c == ']');
+        p++;
+    }
+    while (*p && *p != ']') {
+        if (p[1] == '-' && p[2] && p[2] != ']') {
+            if ((unsigned char)c >= (unsigned char)p[0] && (unsigned char)c <= (unsigned char)p[2]) {
+                found = true;
+            }
+            p += 3;
+        } else {
+            if (*p == c) {
+                found = true;
+            }
+            p++;
+        }
+    }
+    if (*p != ']') {
+        return -1;
+    }
+    *pp = p + 1;
+    return (found != negate && c != '/') ? 1 : 0;
+}
+
+bool glob_match(const char *p, const char *n) {
+    while (*p) {
+        if (p[0] == '*' && p[1] == '*') {
+            while (*p == '*') {
+                p++;
+            }
+            if (*p == '/') {
+                /* "**" followed by "/" matches zero or more whole directories */
+                p++;
+                if (glob_match(p, n)) {
+                    return true;
+                }
+                for (; *n; n++) {
+                    if (*n == '/' && glob_match(p, n + 1)) {
+                        return true;
+                    }
+                }
+                return false;
+            }
+            for (;; n++) {
+                if (glob_match(p, n)) {
+                    return true;
+                }
+                if (!*n) {
+                    return false;
+                }
+            }
+        }
+        if (*p == '*') {
+            p++;
+            for (;; n++) {
+                if (glob_match(p, n)) {
+                    return true;
+                }
+                if (!*n || *n == '/') {
+                    return false;
+                }
+            }
+        }
+        if (!*n) {
+            return false;
+        }
+        if (*p == '?') {
+            if (*n == '/') {
+                return false;
+            }
+            p++;
+            n++;
+            continue;
+        }
+        if (*p == '[') {
+            int r = class_match(&p, *n);
+            if (r == 0) {
+                return false;
+            }
+            if (r == 1) {
+                n++;
+                continue;
+            }
+            /* Unterminated class: treat '[' literally */
+        } else if (*p == '\\' && p[1]) {
+            p++;
+        }
+        if (*p != *n) {
+            return false;
+        }
+        p++;
+        n++;
+    }
+    return *n == '\0';
+}
@@ -0,0 +1,85 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BR_AR_MATCH_H
+#define BR_AR_MATCH_H
+
+#include <stddef.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDBOOL_H
+#include <stdbool.h>
+#else
+#ifndef bool
+#define bool int
+#define true 1
+#define false 0
+#endif
+#endif
+
+/* Matching modes */
+#define MATCH_BASENAME 0  /* Plain names compare basenames (-t, -x, -p), unless they have a '/' */
+#define MATCH_EXACT    1  /* Plain names compare full member names (-d) */
+
+/*
+ * Member selection from command-line names, glob patterns and name list
+ * files.  Plain names go into a hash set so each lookup is O(1); only
+ * patterns containing '*', '?' or '[' are matched one by one.
+ */
+struct name_matcher {
+    int mode;
+    const char **keys;      /* Open-addressed hash set of plain names */
+    size_t key_count;
+    size_t key_capacity;
+    size_t path_count;      /* Keys compared as full names in basename mode */
+    const char **globs;
+    size_t glob_count;
+    size_t glob_capacity;
+    char **buffers;         /* Name list file contents, owned */
+    size_t buffer_count;
+};
+
+void matcher_init(struct name_matcher *m, int mode);
+void matcher_free(struct name_matcher *m);
+
+/* Add one name or pattern; the string must outlive the matcher */
+bool matcher_add(struct name_matcher *m, const char *pattern);
+
+/* Add one name or pattern per line from a file ("-" reads standard input) */
+bool matcher_add_file(struct name_matcher *m, const char *path);
+
+/* True if nothing was added */
+bool matcher_empty(const struct name_matcher *m);
+
+/* Whether a member name is selected; an empty matcher selects everything */
+bool matcher_match(const struct name_matcher *m, const char *name);
+
+/* True if only plain names were added and each selects one full member name */
+bool matcher_exact(const struct name_matcher *m);
+
+/* Hash of a name of the given length, shared with other name tables */
+uint64_t name_hash(const char *s, size_t len);
+
+/* Glob match: '*' and '?' stop at '/', '**' spans directories */
+bool glob_match(const char *pattern, const char *name);
+
+#endif /* BR_AR_MATCH_H */
@@ -0,0 +1,531 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include "brarchive.h"
+#include "serve.h"
+
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* Archives kept open between requests */
+#define SERVE_CACHE 32
+
+/*
+ * One open archive.  The entry table and mapping are shared by all
+ * workers; the lock covers what brarchive builds lazily (the name index)
+ * and reads through the unmapped fallback.
+ */
+struct served {
+    char *path;
+    brarchive *ar;
+    dev_t dev;                  /* Identity of the file when it was opened */
+    ino_t ino;
+    off_t size;
+    long long mtime_ns;
+    unsigned refs;
+    unsigned long long used;    /* LRU clock */
+    bool cached;                /* Still in the cache; freed with its last reference otherwise */
+    char *list;                 /* Name list for 'l', built on first use */
+    size_t list_len;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static struct served *cache[SERVE_CACHE];
+static size_t cache_count = 0;
+static unsigned long long cache_clock = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int listen_fd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void served_lock(struct served *s) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&s->lock);
+#else
+    (void)s;
+#endif
+}
+
+static void served_unlock(struct served *s) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&s->lock);
+#else
+    (void)s;
+#endif
+}
+
+static void cache_enter(void) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&cache_lock);
+#endif
+}
+
+static void cache_leave(void) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&cache_lock);
+#endif
+}
+
+static long long stat_mtime(const struct stat *st) {
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+    return (long long)st->st_mtimespec.tv_sec * 1000000000LL + st->st_mtimespec.tv_nsec;
+#else
+    return (long long)st->st_mtime * 1000000000LL;
+#endif
+}
+
+static bool served_current(const struct served *s, const struct stat *st) {
+    return s->dev == st->st_dev && s->ino == st->st_ino && s->size == st->st_size &&
+           s->mtime_ns == stat_mtime(st);
+}
+
+static void served_free(struct served *s) {
+    brarchive_close(s->ar);
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&s->lock);
+#endif
+    free(s->list);
+    free(s->path);
+    free(s);
+}
+
+/* Drop slot i from the cache; the archive goes once no request uses it */
+static void cache_remove(size_t i) {
+    struct served *s = cache[i];
+    cache[i] = cache[--cache_count];
+    s->cached = false;
+    if (s->refs == 0) {
+        served_free(s);
+    }
+}
+
+/*
+ * Find or open path.  A cached handle is only reused while the file on
+ * disk is the one it was opened from, so an archive replaced by rename
+ * (as br-ar itself writes them) or rewritten in place is reopened.
+ */
+static struct served *served_acquire(const char *path, int *err) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        *err = BRARCHIVE_EIO;
+        return NULL;
+    }
+    
+    cache_enter();
+    size_t i;
+    for (i = 0; i < cache_count; i++) {
+        if (strcmp(cache[i]->path, path) == 0) {
+            break;
+        }
+    }
+    if (i < cache_count) {
+        if (served_current(cache[i], &st)) {
+            struct served *s = cache[i];
+            s->refs++;
+            s->used = ++cache_clock;
+            cache_leave();
+            return s;
+        }
+        cache_remove(i);
+    }
+    
+    struct served *s = calloc(1, sizeof(struct served));
+    if (!s || !(s->path = strdup(path))) {
+        cache_leave();
+        free(s);
+        *err = BRARCHIVE_ENOMEM;
+        return NULL;
+    }
+    *err = brarchive_open(&s->ar, path, BRARCHIVE_READ_SOME);
+    if (*err == BRARCHIVE_OK && brarchive_version(s->ar) != BRARCHIVE_VERSION) {
+        *err = BRARCHIVE_EINVAL;
+    }
+    if (*err != BRARCHIVE_OK) {
+        cache_leave();
+        brarchive_close(s->ar);
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&s->lock, NULL);
+#endif
+    s->dev = st.st_dev;
+    s->ino = st.st_ino;
+    s->size = st.st_size;
+    s->mtime_ns = stat_mtime(&st);
+    s->refs = 1;
+    s->used = ++cache_clock;
+    
+    /* Evict the least recently used idle archive; with none idle, serve this one uncached */
+    if (cache_count == SERVE_CACHE) {
+        size_t lru = SERVE_CACHE;
+        for (i = 0; i < cache_count; i++) {
+            if (cache[i]->refs == 0 && (lru == SERVE_CACHE || cache[i]->used < cache[lru]->used)) {
+                lru = i;
+            }
+        }
+        if (lru < SERVE_CACHE) {
+            cache_remove(lru);
+        }
+    }
+    if (cache_count < SERVE_CACHE) {
+        s->cached = true;
+        cache[cache_count++] = s;
+    }
+    cache_leave();
+    return s;
+}
+
+static void served_release(struct served *s) {
+    cache_enter();
+    if (--s->refs == 0 && !s->cached) {
+        served_free(s);
+    }
+    cache_leave();
+}
+
+static bool recv_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* Header and body in one writev where the socket takes it */
+static bool send_response(int fd, int status, const void *body, size_t len) {
+    uint8_t header[8];
+    struct iovec iov[2];
+    struct iovec *v = iov;
+    int n = 2;
+    
+    put_le32(header, (uint32_t)status);
+    put_le32(header + 4, (uint32_t)len);
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = len;
+    while (n > 0) {
+        ssize_t w = writev(fd, v, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w < 0) {
+            return false;
+        }
+        while (n > 0 && (size_t)w >= v->iov_len) {
+            w -= (ssize_t)v->iov_len;
+            v++;
+            n--;
+        }
+        if (n > 0) {
+            v->iov_base = (uint8_t *)v->iov_base + w;
+            v->iov_len -= (size_t)w;
+        }
+    }
+    return true;
+}
+
+static bool send_error(int fd, int err) {
+    const char *msg = brarchive_strerror(err);
+    return send_response(fd, err, msg, strlen(msg));
+}
+
+/* Member names, one per line; built once per opened archive */
+static int served_list(struct served *s) {
+    int err = BRARCHIVE_OK;
+    
+    served_lock(s);
+    if (!s->list) {
+        uint32_t count = brarchive_table_count(s->ar);
+        struct brarchive_entry entry;
+        size_t len = 0;
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            if (brarchive_entry(s->ar, i, &entry) == BRARCHIVE_OK) {
+                len += entry.name_len + 1;
+            }
+        }
+        s->list = malloc(len + 1);
+        if (!s->list) {
+            err = BRARCHIVE_ENOMEM;
+        } else {
+            for (i = 0; i < count; i++) {
+                if (brarchive_entry(s->ar, i, &entry) == BRARCHIVE_OK) {
+                    memcpy(s->list + s->list_len, entry.name, entry.name_len);
+                    s->list_len += entry.name_len;
+                    s->list[s->list_len++] = '\n';
+                }
+            }
+        }
+    }
+    served_unlock(s);
+    return err;
+}
+
+static int served_find(struct served *s, const char *name, size_t name_len,
+                       uint32_t *index, struct brarchive_entry *entry) {
+    if (name_len == 0 || name_len > BRARCHIVE_MAX_NAME) {
+        return BRARCHIVE_ENOENT;
+    }
+    served_lock(s);
+    int err = brarchive_find(s->ar, name, name_len, index);
+    served_unlock(s);
+    if (err == BRARCHIVE_OK) {
+        err = brarchive_entry(s->ar, *index, entry);
+    }
+    return err;
+}
+
+/* Answer one request; false once the client can no longer be written to */
+static bool serve_request(int fd, const uint8_t *req, size_t len) {
+    const uint8_t *end = memchr(req + 1, '\0', len - 1);
+    if (!end || (req[0] != SERVE_LIST && req[0] != SERVE_STAT && req[0] != SERVE_READ)) {
+        return send_error(fd, BRARCHIVE_EINVAL);
+    }
+    const char *path = (const char *)req + 1;
+    const char *name = (const char *)end + 1;
+    size_t name_len = len - (size_t)(end + 1 - req);
+    
+    int err;
+    struct served *s = served_acquire(path, &err);
+    if (!s) {
+        return send_error(fd, err);
+    }
+    
+    bool sent;
+    uint32_t index;
+    struct brarchive_entry entry;
+    if (req[0] == SERVE_LIST) {
+        err = served_list(s);
+        sent = err == BRARCHIVE_OK ? send_response(fd, BRARCHIVE_OK, s->list, s->list_len) : send_error(fd, err);
+    } else if ((err = served_find(s, name, name_len, &index, &entry)) != BRARCHIVE_OK) {
+        sent = send_error(fd, err);
+    } else if (req[0] == SERVE_STAT) {
+        uint8_t body[12];
+        put_le32(body, index);
+        put_le32(body + 4, entry.offset);
+        put_le32(body + 8, entry.size);
+        sent = send_response(fd, BRARCHIVE_OK, body, sizeof(body));
+    } else {
+        /* Mapped contents can be sent by every worker at once; the read buffer cannot */
+        const void *data;
+        bool mapped = brarchive_is_mapped(s->ar);
+        if (!mapped) {
+            served_lock(s);
+        }
+        err = brarchive_read(s->ar, &entry, &data);
+        sent = err == BRARCHIVE_OK ? send_response(fd, BRARCHIVE_OK, data, entry.size) : send_error(fd, err);
+        if (!mapped) {
+            served_unlock(s);
+        }
+    }
+    
+    served_release(s);
+    return sent;
+}
+
+/* Requests on one connection until the client closes it */
+static void serve_client(int fd) {
+    uint8_t *req = malloc(SERVE_MAX_REQUEST);
+    uint8_t len_buf[4];
+    
+    while (req && recv_full(fd, len_buf, sizeof(len_buf))) {
+        uint32_t len = get_le32(len_buf);
+        if (len < 2 || len > SERVE_MAX_REQUEST || !recv_full(fd, req, len) ||
+            !serve_request(fd, req, len)) {
+            break;
+        }
+    }
+    free(req);
+}
+
+static void *serve_worker(void *arg) {
+    (void)arg;
+    while (!stopping) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EBADF || errno == EINVAL) {
+                break;
+            }
+            continue;
+        }
+        serve_client(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+#ifndef HAVE_PTHREAD
+static void serve_stop(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+#endif
+
+/* Bind the socket, replacing a stale one left by a server that is gone */
+static int serve_listen(const char *socket_path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fprintf(stderr, "Socket already in use: %s\n", socket_path);
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Failed to listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool serve_archives(const char *socket_path, int threads) {
+    /* A client that hangs up only ends its own connection */
+    signal(SIGPIPE, SIG_IGN);
+    
+    listen_fd = serve_listen(socket_path);
+    if (listen_fd < 0) {
+        return false;
+    }
+    
+#ifdef HAVE_PTHREAD
+    /* Workers inherit the mask, so only sigwait() below sees the signals */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    
+    int started = 0;
+    while (started < threads) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, serve_worker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(worker);
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Failed to start server threads\n");
+        close(listen_fd);
+        unlink(socket_path);
+        return false;
+    }
+    int sig;
+    sigwait(&set, &sig);
+    stopping = 1;
+    shutdown(listen_fd, SHUT_RDWR);
+#else
+    (void)threads;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    serve_worker(NULL);
+#endif
+    
+    /* Connections still being served end with the process */
+    close(listen_fd);
+    unlink(socket_path);
+    return true;
+}
+
+#else
+bool serve_archives(const char *socket_path, int threads) {
+    (void)socket_path;
+    (void)threads;
+    fprintf(stderr, "--serve is not supported on this platform (no Unix domain sockets)\n");
+    return false;
+}
+#endif /* HAVE_SYS_SOCKET_H && HAVE_SYS_UN_H */
@@ -0,0 +1,57 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BR_AR_SERVE_H
+#define BR_AR_SERVE_H
+
+#ifdef HAVE_STDBOOL_H
+#include <stdbool.h>
+#else
+#ifndef bool
+#define bool int
+#define true 1
+#define false 0
+#endif
+#endif
+
+/*
+ * Member server (--serve).  Clients connect to a Unix domain socket and
+ * send any number of requests on one connection.  All integers are 32-bit
+ * little-endian.
+ *
+ * Request:  length, then length bytes: an operation byte, the archive
+ *           path, a NUL, and for 's' and 'r' the exact member name.
+ *
+ *   'l'  list: member names, each followed by '\n'
+ *   's'  stat: index, offset and size of the member
+ *   'r'  read: the member's contents
+ *
+ * Response: status (0 or a BRARCHIVE_* error code), length, then length
+ *           bytes of body; failed requests carry brarchive_strerror() text.
+ */
+#define SERVE_LIST 'l'
+#define SERVE_STAT 's'
+#define SERVE_READ 'r'
+
+#define SERVE_MAX_REQUEST 8192
+
+/* Serve until SIGINT or SIGTERM with threads workers; false if the socket cannot be set up */
+bool serve_archives(const char *socket_path, int threads);
+
+#endif /* BR_AR_SERVE_H */
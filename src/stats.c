@@ -0,0 +1,320 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "stats.h"
+
+#define MAX_PHASES  16
+#define MAX_THREADS 256
+
+bool stats_enabled = false;
+bool trace_enabled = false;
+
+/* Resource counters at one instant */
+struct snapshot {
+    uint64_t wall_us;
+    double user_s;
+    double sys_s;
+    long long syscr;            /* Read- and write-type syscalls, -1 if unknown */
+    long long syscw;
+};
+
+struct phase {
+    const char *name;
+    double wall_s;
+    double user_s;
+    double sys_s;
+    long long syscr;
+    long long syscw;
+};
+
+static struct phase phases[MAX_PHASES];
+static int phase_count = 0;
+static int current = -1;
+static struct snapshot phase_start;
+static struct snapshot run_start;
+static uint64_t files_done = 0;
+static uint64_t bytes_done = 0;
+static long long probe_reads = 0;      /* Read syscalls of one snapshot itself */
+
+static FILE *trace_file = NULL;
+static bool trace_first = true;
+static uint64_t trace_epoch = 0;
+static long trace_pid = 0;
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t trace_threads[MAX_THREADS];
+static int trace_thread_count = 0;
+static pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t main_thread;           /* Phases are the main thread's; workers only count */
+#endif
+
+static uint64_t clock_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void take_snapshot(struct snapshot *s) {
+    s->wall_us = clock_us();
+    s->user_s = 0;
+    s->sys_s = 0;
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        s->user_s = (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6;
+        s->sys_s = (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+    }
+#endif
+    
+    /*
+     * Linux counts read- and write-type syscalls for the whole process;
+     * open, stat, mkdir, close and the like are in neither count
+     */
+    s->syscr = -1;
+    s->syscw = -1;
+    FILE *f = fopen("/proc/self/io", "r");
+    if (f) {
+        char line[128];
+        while (fgets(line, sizeof(line), f)) {
+            sscanf(line, "syscr: %lld", &s->syscr);
+            sscanf(line, "syscw: %lld", &s->syscw);
+        }
+        fclose(f);
+    }
+}
+
+bool stats_init(bool stats, const char *trace_path) {
+    stats_enabled = stats;
+#ifdef HAVE_PTHREAD
+    main_thread = pthread_self();
+#endif
+    if (trace_path) {
+        trace_file = fopen(trace_path, "w");
+        if (!trace_file) {
+            fprintf(stderr, "Failed to create trace file: %s\n", trace_path);
+            return false;
+        }
+        fputs("{\"traceEvents\":[", trace_file);
+        trace_epoch = clock_us();
+#ifdef HAVE_UNISTD_H
+        trace_pid = (long)getpid();
+#endif
+        trace_enabled = true;
+    }
+    if (stats_enabled) {
+        struct snapshot probe;
+        take_snapshot(&probe);
+        take_snapshot(&run_start);
+        if (probe.syscr >= 0) {
+            probe_reads = run_start.syscr - probe.syscr;
+        }
+    }
+    return true;
+}
+
+uint64_t trace_now(void) {
+    return clock_us();
+}
+
+/* Write s as the body of a JSON string */
+static void json_escape(FILE *f, const char *s) {
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+}
+
+/* Small, stable thread numbers for the trace viewer */
+static int trace_tid(void) {
+#ifdef HAVE_PTHREAD
+    pthread_t self = pthread_self();
+    int i;
+    for (i = 0; i < trace_thread_count; i++) {
+        if (pthread_equal(trace_threads[i], self)) {
+            return i + 1;
+        }
+    }
+    if (trace_thread_count < MAX_THREADS) {
+        trace_threads[trace_thread_count++] = self;
+        return trace_thread_count;
+    }
+#endif
+    return 1;
+}
+
+void trace_span(const char *name, const char *detail, uint64_t start) {
+    uint64_t end = clock_us();
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&trace_lock);
+#endif
+    fprintf(trace_file, "%s\n{\"name\":\"", trace_first ? "" : ",");
+    json_escape(trace_file, name);
+    fprintf(trace_file, "\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%ld,\"tid\":%d",
+            (unsigned long long)(start - trace_epoch), (unsigned long long)(end - start),
+            trace_pid, trace_tid());
+    if (detail) {
+        fputs(",\"args\":{\"detail\":\"", trace_file);
+        json_escape(trace_file, detail);
+        fputs("\"}", trace_file);
+    }
+    fputc('}', trace_file);
+    trace_first = false;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&trace_lock);
+#endif
+}
+
+void stats_phase(const char *name) {
+    struct snapshot now;
+#ifdef HAVE_PTHREAD
+    if (!pthread_equal(pthread_self(), main_thread)) {
+        return;
+    }
+#endif
+    take_snapshot(&now);
+    
+    if (current >= 0) {
+        struct phase *p = &phases[current];
+        p->wall_s += (double)(now.wall_us - phase_start.wall_us) / 1e6;
+        p->user_s += now.user_s - phase_start.user_s;
+        p->sys_s += now.sys_s - phase_start.sys_s;
+        if (now.syscr >= 0 && p->syscr >= 0) {
+            long long reads = now.syscr - phase_start.syscr - probe_reads;
+            p->syscr += reads > 0 ? reads : 0;
+            p->syscw += now.syscw - phase_start.syscw;
+        } else {
+            p->syscr = p->syscw = -1;
+        }
+        TRACE_SPAN(p->name, NULL, phase_start.wall_us);
+    }
+    
+    /* A phase entered again adds to its earlier total */
+    current = -1;
+    if (name) {
+        int i;
+        for (i = 0; i < phase_count && strcmp(phases[i].name, name) != 0; i++) {
+        }
+        if (i == phase_count && phase_count < MAX_PHASES) {
+            memset(&phases[i], 0, sizeof(struct phase));
+            phases[i].name = name;
+            phase_count++;
+        }
+        current = i < phase_count ? i : -1;
+    }
+    
+    /* Start after our own bookkeeping */
+    take_snapshot(&phase_start);
+}
+
+void stats_count(uint64_t files, uint64_t bytes) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&count_lock);
+#endif
+    files_done += files;
+    bytes_done += bytes;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&count_lock);
+#endif
+}
+
+void stats_finish(void) {
+    if (!stats_enabled && !trace_enabled) {
+        return;
+    }
+    stats_phase(NULL);
+    
+    if (stats_enabled) {
+        struct snapshot now;
+        long long syscr = 0, syscw = 0;
+        int i;
+        take_snapshot(&now);
+        fprintf(stderr, "%-10s %10s %10s %10s %10s %10s\n",
+                "phase", "wall_ms", "user_ms", "sys_ms", "rd_syscall", "wr_syscall");
+        for (i = 0; i < phase_count; i++) {
+            fprintf(stderr, "%-10s %10.2f %10.2f %10.2f %10lld %10lld\n", phases[i].name,
+                    phases[i].wall_s * 1e3, phases[i].user_s * 1e3, phases[i].sys_s * 1e3,
+                    phases[i].syscr, phases[i].syscw);
+            if (phases[i].syscr < 0 || syscr < 0) {
+                syscr = syscw = -1;
+            } else {
+                syscr += phases[i].syscr;
+                syscw += phases[i].syscw;
+            }
+        }
+        /* Syscalls are summed over the phases, leaving out our own probes */
+        fprintf(stderr, "%-10s %10.2f %10.2f %10.2f %10lld %10lld\n", "total",
+                (double)(now.wall_us - run_start.wall_us) / 1e3,
+                (now.user_s - run_start.user_s) * 1e3, (now.sys_s - run_start.sys_s) * 1e3,
+                syscr, syscw);
+        
+        long peak_kb = -1;
+#ifdef HAVE_SYS_RESOURCE_H
+        struct rusage ru;
+        if (getrusage(RUSAGE_SELF, &ru) == 0) {
+            peak_kb = (long)ru.ru_maxrss;
+#ifdef __APPLE__
+            peak_kb /= 1024;
+#endif
+        }
+#endif
+        fprintf(stderr, "files: %llu  bytes: %llu  peak RSS: %ld KiB\n",
+                (unsigned long long)files_done, (unsigned long long)bytes_done, peak_kb);
+    }
+    
+    if (trace_enabled) {
+        trace_enabled = false;
+        fputs("\n]}\n", trace_file);
+        if (fclose(trace_file) != 0) {
+            fprintf(stderr, "Warning: Failed to write trace file\n");
+        }
+        trace_file = NULL;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BR_AR_STATS_H
+#define BR_AR_STATS_H
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDBOOL_H
+#include <stdbool.h>
+#else
+#ifndef bool
+#define bool int
+#define true 1
+#define false 0
+#endif
+#endif
+
+/*
+ * Per-phase timing and counters (--stats) and Chrome trace events
+ * (--trace).  Call sites use the macros, which cost one branch when
+ * both are off.
+ */
+extern bool stats_enabled;
+extern bool trace_enabled;
+
+/* Turn on stats and/or start a trace file; false if the trace cannot be created */
+bool stats_init(bool stats, const char *trace_path);
+
+/* End the current phase and start the next one (NULL starts none) */
+void stats_phase(const char *name);
+
+/* Add to the files and bytes processed */
+void stats_count(uint64_t files, uint64_t bytes);
+
+/* End the last phase, print the report to stderr and finish the trace */
+void stats_finish(void);
+
+/* Trace clock in microseconds, and one complete event since start; thread-safe */
+uint64_t trace_now(void);
+void trace_span(const char *name, const char *detail, uint64_t start);
+
+#define STATS_PHASE(name) do { if (stats_enabled || trace_enabled) stats_phase(name); } while (0)
+#define STATS_COUNT(files, bytes) do { if (stats_enabled) stats_count(files, bytes); } while (0)
+#define TRACE_START() (trace_enabled ? trace_now() : 0)
+#define TRACE_SPAN(name, detail, start) do { if (trace_enabled) trace_span(name, detail, start); } while (0)
+
+#endif /* BR_AR_STATS_H */
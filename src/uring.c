@@ -0,0 +1,255 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Kernels before 5.6 have rings but none of the file operations we queue */
+static bool probe_ops(int fd) {
+    static const int needed[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    struct {
+        struct io_uring_probe probe;
+        struct io_uring_probe_op ops[256];
+    } p;
+    size_t i;
+    
+    memset(&p, 0, sizeof(p));
+    if (sys_register(fd, IORING_REGISTER_PROBE, &p, 256) < 0) {
+        return false;
+    }
+    for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+        int op = needed[i];
+        if (op > p.probe.last_op || !(p.ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->fd = sys_setup(entries, &p);
+    if (r->fd < 0) {
+        r->fd = -1;
+        return false;
+    }
+    if (!probe_ops(r->fd)) {
+        close(r->fd);
+        r->fd = -1;
+        errno = EOPNOTSUPP;
+        return false;
+    }
+    
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        uring_exit(r);
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            uring_exit(r);
+            return false;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_exit(r);
+        return false;
+    }
+    
+    char *sq = r->sq_ring;
+    char *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->tail = *r->sq_tail;
+    return true;
+}
+
+void uring_exit(struct uring *r) {
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/* Next free submission entry, cleared; NULL if the queue is full */
+static struct io_uring_sqe *get_sqe(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->tail - head >= r->sq_entries) {
+        return NULL;
+    }
+    unsigned slot = r->tail & r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[slot] = slot;
+    r->tail++;
+    return sqe;
+}
+
+bool uring_openat(struct uring *r, int dir_fd, const char *path, int flags, int mode, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = (uint32_t)mode;
+    sqe->open_flags = (uint32_t)flags;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_read(struct uring *r, int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_write(struct uring *r, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    return true;
+}
+
+bool uring_close(struct uring *r, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return true;
+}
+
+int uring_submit(struct uring *r, unsigned wait) {
+    /* Publish the new entries before the kernel can see the tail move */
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    unsigned pending = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0 && !wait) {
+        return 0;
+    }
+    for (;;) {
+        int n = sys_enter(r->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -errno;
+        }
+        pending = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    }
+}
+
+bool uring_reap(struct uring *r, uint64_t *user_data, int *res) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    const struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,88 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BR_AR_URING_H
+#define BR_AR_URING_H
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#include <stddef.h>
+
+#ifdef HAVE_STDBOOL_H
+#include <stdbool.h>
+#else
+#ifndef bool
+#define bool int
+#define true 1
+#define false 0
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+/*
+ * Minimal io_uring wrapper (--io=uring), talking to the kernel through
+ * the raw system calls.  Only what bulk extract and create need: queue
+ * openat, read, write and close, submit them in one call, and reap the
+ * completions.  Not thread-safe; one ring per caller.
+ */
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned tail;              /* Our tail, published by uring_submit() */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;              /* Same as sq_ring with IORING_FEAT_SINGLE_MMAP */
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+/* Set up a ring with room for entries queued operations; false (with errno set) if unsupported */
+bool uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+
+/* Queue one operation; false if the submission queue is full */
+bool uring_openat(struct uring *r, int dir_fd, const char *path, int flags, int mode, uint64_t user_data);
+bool uring_read(struct uring *r, int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data);
+bool uring_write(struct uring *r, int fd, const void *buf, unsigned len, uint64_t offset, uint64_t user_data);
+bool uring_close(struct uring *r, int fd, uint64_t user_data);
+
+/* Submit everything queued and wait until at least wait completions are ready; 0 or -errno */
+int uring_submit(struct uring *r, unsigned wait);
+
+/* Take one completion; false if none is ready */
+bool uring_reap(struct uring *r, uint64_t *user_data, int *res);
+
+#endif /* HAVE_IO_URING */
+
+#endif /* BR_AR_URING_H */
@@ -0,0 +1,258 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "utf8.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* SSSE3 block validator, picked at run time on x86 */
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_SSSE3 1
+#include <tmmintrin.h>
+#else
+#define USE_SSSE3 0
+#endif
+
+/* Bytes of p before the first one with the high bit set, counted in whole blocks */
+static size_t ascii_prefix(const uint8_t *p, size_t len) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    while (i + 64 <= len) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) != 0) {
+            break;
+        }
+        i += 64;
+    }
+    while (i + 16 <= len && _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(p + i))) == 0) {
+        i += 16;
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    while (i + 64 <= len) {
+        uint8x16_t a = vld1q_u8(p + i);
+        uint8x16_t b = vld1q_u8(p + i + 16);
+        uint8x16_t c = vld1q_u8(p + i + 32);
+        uint8x16_t d = vld1q_u8(p + i + 48);
+        if (vmaxvq_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d))) >= 0x80) {
+            break;
+        }
+        i += 64;
+    }
+    while (i + 16 <= len && vmaxvq_u8(vld1q_u8(p + i)) < 0x80) {
+        i += 16;
+    }
+#else
+    while (i + 8 <= len) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (w & 0x8080808080808080ULL) {
+            break;
+        }
+        i += 8;
+    }
+#endif
+    return i;
+}
+
+/* Length of the well-formed multibyte sequence at p, 0 if there is none */
+static size_t sequence_length(const uint8_t *p, size_t len) {
+    uint8_t c = p[0];
+    uint8_t lo = 0x80, hi = 0xBF;
+    size_t n;
+    
+    if (c >= 0xC2 && c <= 0xDF) {
+        n = 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        n = 3;
+        if (c == 0xE0) {
+            lo = 0xA0;          /* Overlong */
+        } else if (c == 0xED) {
+            hi = 0x9F;          /* Surrogates */
+        }
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        n = 4;
+        if (c == 0xF0) {
+            lo = 0x90;          /* Overlong */
+        } else if (c == 0xF4) {
+            hi = 0x8F;          /* Past U+10FFFF */
+        }
+    } else {
+        return 0;
+    }
+    
+    if (len < n || p[1] < lo || p[1] > hi) {
+        return 0;
+    }
+    size_t k;
+    for (k = 2; k < n; k++) {
+        if ((p[k] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+#if USE_SSSE3
+/*
+ * Keiser and Lemire's lookup algorithm ("Validating UTF-8 In Less Than
+ * One Instruction Per Byte", 2021).  Three table lookups on the high and
+ * low nibbles of each byte and the high nibble of the next classify every
+ * two-byte window; the third and fourth bytes of long sequences are
+ * checked from the bytes two and three back.
+ */
+#define TOO_SHORT      (1 << 0)  /* Lead or ASCII followed by a lead or ASCII */
+#define TOO_LONG       (1 << 1)  /* ASCII followed by a continuation */
+#define OVERLONG_3     (1 << 2)  /* E0 80..9F */
+#define TOO_LARGE      (1 << 3)  /* F4 90..BF, F5..FF */
+#define SURROGATE      (1 << 4)  /* ED A0..BF */
+#define OVERLONG_2     (1 << 5)  /* C0, C1 */
+#define TOO_LARGE_1000 (1 << 6)  /* F5..FF 80..8F */
+#define OVERLONG_4     (1 << 6)  /* F0 80..8F */
+#define TWO_CONTS      (1 << 7)  /* Continuation followed by a continuation */
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+__attribute__((target("ssse3")))
+static __m128i block_errors(__m128i input, __m128i prev_input) {
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    
+    __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+    __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+    
+    /* Bytes after a 3- or 4-byte lead must be continuations */
+    __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+    return _mm_xor_si128(must23, special);
+}
+
+/*
+ * Offset of the first 64-byte block that is not known to be valid, or of
+ * the tail shorter than a block.  Everything before it is valid except
+ * that a sequence may run on into it.
+ */
+__attribute__((target("ssse3")))
+static size_t valid_blocks(const uint8_t *p, size_t len) {
+    /* Nonzero where the last bytes start a sequence that needs more */
+    const __m128i max_tail = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                           (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m128i prev = _mm_setzero_si128();
+    __m128i incomplete = _mm_setzero_si128();
+    size_t i;
+    
+    for (i = 0; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(p + i + 48));
+        __m128i error;
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))) == 0) {
+            error = incomplete;
+            incomplete = _mm_setzero_si128();
+        } else {
+            error = block_errors(a, prev);
+            error = _mm_or_si128(error, block_errors(b, a));
+            error = _mm_or_si128(error, block_errors(c, b));
+            error = _mm_or_si128(error, block_errors(d, c));
+            incomplete = _mm_subs_epu8(d, max_tail);
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+            break;
+        }
+        prev = d;
+    }
+    return i;
+}
+#endif
+
+size_t utf8_validate(const uint8_t *p, size_t len) {
+    size_t i = 0;
+#if USE_SSSE3
+    /* Vectors vouch for a prefix; the scalar loop finds the exact error and does the tail */
+    if (len >= 64 && __builtin_cpu_supports("ssse3")) {
+        size_t end = valid_blocks(p, len);
+        /* Restart at the last sequence begun before the blocks stopped */
+        for (i = end; i > 0 && end - i < 4; ) {
+            if ((p[--i] & 0xC0) != 0x80) {
+                break;
+            }
+        }
+    }
+#endif
+    while (i < len) {
+        if (p[i] < 0x80) {
+            i += 1 + ascii_prefix(p + i + 1, len - i - 1);
+            continue;
+        }
+        size_t n = sequence_length(p + i, len - i);
+        if (n == 0) {
+            return i;
+        }
+        i += n;
+    }
+    return len;
+}
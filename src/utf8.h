@@ -0,0 +1,37 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BR_AR_UTF8_H
+#define BR_AR_UTF8_H
+
+#include <stddef.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+/*
+ * Length of the longest prefix of p made of complete, well-formed UTF-8
+ * sequences (no overlongs, surrogates or code points past U+10FFFF), so
+ * len when all of it is valid.  Whole 64-byte blocks are checked with
+ * SSSE3 where the CPU has it; elsewhere only ASCII runs are vectorized.
+ */
+size_t utf8_validate(const uint8_t *p, size_t len);
+
+#endif /* BR_AR_UTF8_H */
@@ -0,0 +1,486 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "brarchive.h"
+#include "stats.h"
+#include "utf8.h"
+#include "verify.h"
+
+#define VERIFY_PIECE   (1024 * 1024)  /* Contents checked as one work item */
+#define VERIFY_BATCH   64             /* Most pieces a worker takes at once */
+#define VERIFY_REPORTS 100            /* Problems printed before they are only counted */
+
+/* One member's contents, relative to the data block */
+struct range {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t index;
+    bool check;                 /* Selected for the UTF-8 check */
+};
+
+/* Part of a distinct range; pieces start on a sequence boundary */
+struct piece {
+    size_t range;
+    uint64_t start;
+    uint64_t len;
+};
+
+struct verify {
+    brarchive *ar;
+    const uint8_t *data;        /* Mapped data block, NULL when not mapped */
+    struct range *ranges;       /* Sorted by offset, then size, then index */
+    size_t range_count;
+    size_t selected;            /* Members whose contents are checked */
+    uint64_t *bad;              /* Per distinct range: first invalid byte, UINT64_MAX if none */
+    struct piece *pieces;
+    size_t piece_count;
+    size_t next_piece;
+    size_t errors;
+    size_t warnings;
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+#endif
+};
+
+static void verify_lock(struct verify *v) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&v->lock);
+#else
+    (void)v;
+#endif
+}
+
+static void verify_unlock(struct verify *v) {
+#ifdef HAVE_PTHREAD
+    pthread_mutex_unlock(&v->lock);
+#else
+    (void)v;
+#endif
+}
+
+/* Count a problem and print the first VERIFY_REPORTS of them */
+static void problem(struct verify *v, bool error, const char *fmt, ...) {
+    va_list ap;
+    if (v->errors + v->warnings < VERIFY_REPORTS) {
+        if (!error) {
+            fputs("Warning: ", stderr);
+        }
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+    }
+    if (error) {
+        v->errors++;
+    } else {
+        v->warnings++;
+    }
+}
+
+/* Entry name, NUL-terminated in buf (which holds BRARCHIVE_MAX_NAME + 1 bytes) */
+static const char *entry_name(const brarchive *ar, uint32_t index, char *buf) {
+    struct brarchive_entry e;
+    if (brarchive_entry(ar, index, &e) != BRARCHIVE_OK) {
+        buf[0] = '\0';
+    } else {
+        memcpy(buf, e.name, e.name_len);
+        buf[e.name_len] = '\0';
+    }
+    return buf;
+}
+
+static int range_cmp(const void *a, const void *b) {
+    const struct range *x = a;
+    const struct range *y = b;
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Check every descriptor and collect the ranges of those that are usable */
+static bool check_entries(struct verify *v, const struct name_matcher *filter) {
+    brarchive *ar = v->ar;
+    uint32_t count = brarchive_table_count(ar);
+    char name[BRARCHIVE_MAX_NAME + 1];
+    uint32_t i;
+    
+    if (count < brarchive_count(ar)) {
+        problem(v, true, "Archive corrupted: header declares %u entries, the file holds %u",
+                brarchive_count(ar), count);
+    }
+    v->ranges = malloc(((size_t)count + 1) * sizeof(struct range));
+    if (!v->ranges) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    
+    for (i = 0; i < count; i++) {
+        struct brarchive_entry e;
+        if (brarchive_entry(ar, i, &e) != BRARCHIVE_OK) {
+            problem(v, true, "Invalid name length in entry %u", i);
+            continue;
+        }
+        memcpy(name, e.name, e.name_len);
+        name[e.name_len] = '\0';
+        if (e.name_len == 0) {
+            problem(v, true, "Empty name in entry %u", i);
+        } else if (memchr(e.name, '\0', e.name_len)) {
+            problem(v, true, "NUL byte in the name of entry %u (%s)", i, name);
+        } else if (utf8_validate((const uint8_t *)e.name, e.name_len) != e.name_len) {
+            problem(v, true, "Name of entry %u is not valid UTF-8", i);
+        }
+        if (!brarchive_in_bounds(ar, &e)) {
+            problem(v, true, "Archive corrupted: file %s out of bounds", name);
+            continue;
+        }
+        
+        struct range *r = &v->ranges[v->range_count++];
+        r->offset = e.offset;
+        r->size = e.size;
+        r->index = i;
+        r->check = matcher_match(filter, name);
+        v->selected += r->check;
+    }
+    return true;
+}
+
+/* Whether ranges[i] is the first of a run of identical ranges */
+static bool range_distinct(const struct verify *v, size_t i) {
+    return i == 0 || v->ranges[i - 1].offset != v->ranges[i].offset || v->ranges[i - 1].size != v->ranges[i].size;
+}
+
+/*
+ * Whether a gap before a member is --align padding: shorter than the
+ * alignment (8 bytes to MAX_ALIGN) of the member's file offset.
+ */
+static bool is_padding(const struct verify *v, uint64_t gap, uint64_t offset) {
+    uint64_t pos = brarchive_data_start(v->ar) + offset;
+    uint64_t align = pos & (~pos + 1);
+    return align >= 8 && gap < (align < MAX_ALIGN ? align : MAX_ALIGN);
+}
+
+/*
+ * Walk the ranges in offset order: identical ranges are shared contents
+ * (as --dedup writes them) and are checked once; partial overlaps are
+ * errors, and bytes no member covers are reported as gaps, except the
+ * padding --align leaves before a member.  A shared
+ * range is checked if any of its members is selected.  Returns the
+ * number of distinct shared ranges.
+ */
+static size_t check_layout(struct verify *v) {
+    uint64_t data_size = brarchive_size(v->ar) > brarchive_data_start(v->ar)
+                             ? brarchive_size(v->ar) - brarchive_data_start(v->ar) : 0;
+    char a[BRARCHIVE_MAX_NAME + 1];
+    char b[BRARCHIVE_MAX_NAME + 1];
+    uint64_t covered = 0;       /* End of the ranges seen so far */
+    size_t cover = SIZE_MAX;    /* Range reaching furthest */
+    size_t shared = 0;
+    size_t head = 0;            /* First of the current run of identical ranges */
+    size_t i;
+    
+    qsort(v->ranges, v->range_count, sizeof(struct range), range_cmp);
+    for (i = 0; i < v->range_count; i++) {
+        struct range *r = &v->ranges[i];
+        if (!range_distinct(v, i)) {
+            v->ranges[head].check |= r->check;
+            shared += (r->size > 0 && head == i - 1);
+            continue;
+        }
+        head = i;
+        if (r->size == 0) {
+            continue;
+        }
+        if (r->offset < covered) {
+            problem(v, true, "Overlapping contents: %s and %s",
+                    entry_name(v->ar, v->ranges[cover].index, a), entry_name(v->ar, r->index, b));
+        } else if (r->offset > covered && !is_padding(v, r->offset - covered, r->offset)) {
+            problem(v, false, "%llu unreferenced bytes at data offset %llu",
+                    (unsigned long long)(r->offset - covered), (unsigned long long)covered);
+        }
+        if (r->offset + r->size > covered) {
+            covered = r->offset + r->size;
+            cover = i;
+        }
+    }
+    if (covered < data_size) {
+        problem(v, false, "%llu unreferenced bytes at data offset %llu",
+                (unsigned long long)(data_size - covered), (unsigned long long)covered);
+    }
+    return shared;
+}
+
+/* Split the mapped ranges to check into pieces of about VERIFY_PIECE bytes */
+static bool plan_pieces(struct verify *v) {
+    size_t max = 0;
+    size_t i;
+    for (i = 0; i < v->range_count; i++) {
+        if (range_distinct(v, i) && v->ranges[i].check) {
+            max += (size_t)(v->ranges[i].size / VERIFY_PIECE) + 1;
+        }
+    }
+    v->pieces = malloc((max + 1) * sizeof(struct piece));
+    if (!v->pieces) {
+        return false;
+    }
+    
+    for (i = 0; i < v->range_count; i++) {
+        const struct range *r = &v->ranges[i];
+        if (!range_distinct(v, i) || !r->check) {
+            continue;
+        }
+        const uint8_t *p = v->data + r->offset;
+        uint64_t start = 0;
+        do {
+            uint64_t end = r->size - start > VERIFY_PIECE ? start + VERIFY_PIECE : r->size;
+            int k;
+            /* Move the cut past continuation bytes so no sequence spans two pieces */
+            for (k = 0; k < 3 && end < r->size && (p[end] & 0xC0) == 0x80; k++) {
+                end++;
+            }
+            struct piece *piece = &v->pieces[v->piece_count++];
+            piece->range = i;
+            piece->start = start;
+            piece->len = end - start;
+            start = end;
+        } while (start < r->size);
+    }
+    return true;
+}
+
+static void check_piece(struct verify *v, const struct piece *piece) {
+    const uint8_t *p = v->data + v->ranges[piece->range].offset + piece->start;
+    size_t ok = utf8_validate(p, (size_t)piece->len);
+    if (ok < piece->len) {
+        verify_lock(v);
+        if (piece->start + ok < v->bad[piece->range]) {
+            v->bad[piece->range] = piece->start + ok;
+        }
+        verify_unlock(v);
+    }
+}
+
+/* Take batches of pieces until none are left */
+static void *verify_worker(void *arg) {
+    struct verify *v = arg;
+    for (;;) {
+        uint64_t span = TRACE_START();
+        uint64_t bytes = 0;
+        size_t first, last;
+        
+        verify_lock(v);
+        first = last = v->next_piece;
+        while (last < v->piece_count && last - first < VERIFY_BATCH && bytes < VERIFY_PIECE) {
+            bytes += v->pieces[last++].len;
+        }
+        v->next_piece = last;
+        verify_unlock(v);
+        if (first == last) {
+            break;
+        }
+        for (; first < last; first++) {
+            check_piece(v, &v->pieces[first]);
+        }
+        TRACE_SPAN("verify", NULL, span);
+    }
+    return NULL;
+}
+
+/* Without a mapping, read each range a buffer at a time; sequences cut by the buffer carry over */
+static bool check_unmapped(struct verify *v) {
+    size_t buf_size = VERIFY_PIECE + 4;
+    uint8_t *buf = malloc(buf_size);
+    uint64_t data_start = brarchive_data_start(v->ar);
+    size_t i;
+    if (!buf) {
+        return false;
+    }
+    
+    for (i = 0; i < v->range_count; i++) {
+        const struct range *r = &v->ranges[i];
+        uint64_t done = 0;
+        size_t carry = 0;
+        if (!range_distinct(v, i) || !r->check) {
+            continue;
+        }
+        while (done < r->size) {
+            size_t n = r->size - done > VERIFY_PIECE ? VERIFY_PIECE : (size_t)(r->size - done);
+            const void *data;
+            if (brarchive_view(v->ar, data_start + r->offset + done, n, buf + carry, &data) != BRARCHIVE_OK) {
+                fprintf(stderr, "Failed to read archive: %s\n", brarchive_path(v->ar));
+                free(buf);
+                return false;
+            }
+            if (data != buf + carry) {
+                memcpy(buf + carry, data, n);
+            }
+            size_t have = carry + n;
+            size_t ok = utf8_validate(buf, have);
+            done += n;
+            if (ok == have) {
+                carry = 0;
+            } else if (done < r->size && have - ok < 4) {
+                carry = have - ok;
+                memmove(buf, buf + ok, carry);
+            } else {
+                v->bad[i] = done - have + ok;
+                break;
+            }
+        }
+    }
+    free(buf);
+    return true;
+}
+
+/* UTF-8 check of every distinct selected range, on threads workers when mapped */
+static bool check_contents(struct verify *v, int threads) {
+    size_t i;
+    v->bad = malloc((v->range_count + 1) * sizeof(uint64_t));
+    if (!v->bad) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+    for (i = 0; i < v->range_count; i++) {
+        v->bad[i] = UINT64_MAX;
+    }
+    
+    if (!v->data) {
+        return check_unmapped(v);
+    }
+    if (!plan_pieces(v)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return false;
+    }
+#ifdef HAVE_PTHREAD
+    /* The calling thread is one of the workers */
+    pthread_t *workers = NULL;
+    int started = 0;
+    if ((size_t)threads > v->piece_count) {
+        threads = (int)v->piece_count;
+    }
+    if (threads > 1 && (workers = malloc((size_t)(threads - 1) * sizeof(pthread_t)))) {
+        while (started < threads - 1 && pthread_create(&workers[started], NULL, verify_worker, v) == 0) {
+            started++;
+        }
+    }
+    verify_worker(v);
+    while (started > 0) {
+        pthread_join(workers[--started], NULL);
+    }
+    free(workers);
+#else
+    (void)threads;
+    verify_worker(v);
+#endif
+    return true;
+}
+
+bool verify_archive(const char *archive_path, const struct name_matcher *filter, int threads) {
+    struct verify v;
+    brarchive *ar;
+    char name[BRARCHIVE_MAX_NAME + 1];
+    
+    STATS_PHASE("open");
+    int err = strcmp(archive_path, "-") == 0 ? brarchive_open_stream(&ar, stdin, archive_path, BRARCHIVE_READ_ALL)
+                                             : brarchive_open(&ar, archive_path, BRARCHIVE_READ_ALL);
+    if (err != BRARCHIVE_OK) {
+        fprintf(stderr, "%s: %s\n", archive_path, brarchive_strerror(err));
+        printf("%s: FAILED\n", archive_path);
+        return false;
+    }
+    if (brarchive_version(ar) != BRARCHIVE_VERSION) {
+        fprintf(stderr, "Unsupported version: %u\n", brarchive_version(ar));
+        printf("%s: FAILED\n", archive_path);
+        brarchive_close(ar);
+        return false;
+    }
+    
+    memset(&v, 0, sizeof(v));
+    v.ar = ar;
+    if (brarchive_is_mapped(ar) && brarchive_data_start(ar) <= brarchive_size(ar)) {
+        const void *map;
+        if (brarchive_view(ar, 0, (size_t)brarchive_size(ar), NULL, &map) == BRARCHIVE_OK) {
+            v.data = (const uint8_t *)map + brarchive_data_start(ar);
+        }
+    }
+#ifdef HAVE_PTHREAD
+    pthread_mutex_init(&v.lock, NULL);
+#endif
+    
+    STATS_PHASE("layout");
+    bool ok = check_entries(&v, filter);
+    size_t shared = ok ? check_layout(&v) : 0;
+    
+    STATS_PHASE("contents");
+    ok = ok && check_contents(&v, threads);
+    
+    uint64_t checked = 0;
+    size_t i;
+    for (i = 0; ok && i < v.range_count; i++) {
+        if (!v.ranges[i].check || !range_distinct(&v, i)) {
+            continue;
+        }
+        checked += v.ranges[i].size;
+        if (v.bad[i] != UINT64_MAX) {
+            problem(&v, true, "Invalid UTF-8 in %s at byte %llu",
+                    entry_name(ar, v.ranges[i].index, name), (unsigned long long)v.bad[i]);
+        }
+    }
+    STATS_COUNT(v.selected, checked);
+    
+    if (v.errors + v.warnings > VERIFY_REPORTS) {
+        fprintf(stderr, "(%zu more problems not shown)\n", v.errors + v.warnings - VERIFY_REPORTS);
+    }
+    if (ok) {
+        printf("%s: %s, %u entries, %zu members checked, %llu bytes, %zu shared ranges, %zu errors, %zu warnings\n",
+               archive_path, v.errors ? "FAILED" : "OK", brarchive_count(ar), v.selected,
+               (unsigned long long)checked, shared, v.errors, v.warnings);
+    } else {
+        printf("%s: FAILED\n", archive_path);
+    }
+    
+#ifdef HAVE_PTHREAD
+    pthread_mutex_destroy(&v.lock);
+#endif
+    free(v.pieces);
+    free(v.bad);
+    free(v.ranges);
+    brarchive_close(ar);
+    return ok && v.errors == 0;
+}
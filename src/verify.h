@@ -0,0 +1,37 @@
+/*
+ * br-ar - create and maintain .brarchive files
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BR_AR_VERIFY_H
+#define BR_AR_VERIFY_H
+
+#include "match.h"
+
+/* Largest --align, so -V can tell alignment padding from gaps */
+#define MAX_ALIGN 4096
+
+/*
+ * Verify an archive (-V): the header, the entry count against the file
+ * size, every descriptor's name and range, ranges that overlap or leave
+ * gaps, and that the contents of the members selected by filter are
+ * UTF-8, spread over threads workers.  Problems go to stderr and a
+ * summary line to stdout; false if any error was found.
+ */
+bool verify_archive(const char *archive_path, const struct name_matcher *filter, int threads);
+
+#endif /* BR_AR_VERIFY_H */
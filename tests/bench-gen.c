@@ -0,0 +1,156 @@
+/*
+ * bench-gen - generate synthetic pack trees for the benchmarks
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: bench-gen dir count size depth json|binary
+ *
+ * Writes count files of size bytes below dir.  With depth 0 every file
+ * is in dir itself; otherwise files are spread over the leaves of a tree
+ * of that depth with FANOUT directories per level.  Contents come from a
+ * fixed seed, so every run produces the same tree.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+#define FANOUT 4
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* xorshift64*, plenty for filler bytes */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static int make_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create directory: %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* JSON-looking text padded to exactly size bytes */
+static void fill_json(char *buf, size_t size, unsigned long i) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    int n = snprintf(buf, size, "{\"id\": %lu, \"value\": \"", i);
+    size_t k;
+    if (n < 0 || (size_t)n + 3 > size) {
+        memset(buf, ' ', size);
+        return;
+    }
+    for (k = (size_t)n; k + 3 < size; k++) {
+        buf[k] = alphabet[rng_next() % (sizeof(alphabet) - 1)];
+    }
+    memcpy(buf + size - 3, "\"}\n", 3);
+}
+
+static void fill_binary(char *buf, size_t size) {
+    size_t k;
+    for (k = 0; k + 8 <= size; k += 8) {
+        uint64_t v = rng_next();
+        memcpy(buf + k, &v, 8);
+    }
+    for (; k < size; k++) {
+        buf[k] = (char)rng_next();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 6) {
+        fprintf(stderr, "Usage: %s dir count size depth json|binary\n", argv[0]);
+        return 1;
+    }
+    const char *root = argv[1];
+    unsigned long count = strtoul(argv[2], NULL, 10);
+    size_t size = (size_t)strtoul(argv[3], NULL, 10);
+    int depth = atoi(argv[4]);
+    int binary = strcmp(argv[5], "binary") == 0;
+    
+    unsigned long leaves = 1;
+    int d;
+    for (d = 0; d < depth; d++) {
+        leaves *= FANOUT;
+    }
+    
+    char *buf = malloc(size + 1);
+    char *path = malloc(strlen(root) + (size_t)depth * 4 + 32);
+    if (!buf || !path) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    if (make_dir(root) != 0) {
+        return 1;
+    }
+    
+    unsigned long i;
+    for (i = 0; i < count; i++) {
+        /* Leaf directories are created as their first file is written */
+        unsigned long leaf = i % leaves;
+        size_t len = (size_t)sprintf(path, "%s", root);
+        for (d = depth - 1; d >= 0; d--) {
+            unsigned long step = 1;
+            int k;
+            for (k = 0; k < d; k++) {
+                step *= FANOUT;
+            }
+            len += (size_t)sprintf(path + len, "/d%lu", (leaf / step) % FANOUT);
+            if (i < leaves && make_dir(path) != 0) {
+                return 1;
+            }
+        }
+        sprintf(path + len, "/f%07lu.%s", i, binary ? "bin" : "json");
+        
+        if (binary) {
+            fill_binary(buf, size);
+        } else {
+            fill_json(buf, size, i);
+        }
+        FILE *f = fopen(path, "wb");
+        if (!f || fwrite(buf, 1, size, f) != size || fclose(f) != 0) {
+            fprintf(stderr, "Failed to write file: %s\n", path);
+            return 1;
+        }
+    }
+    
+    free(buf);
+    free(path);
+    return 0;
+}
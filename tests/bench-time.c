@@ -0,0 +1,136 @@
+/*
+ * bench-time - run a command and record what it cost
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: bench-time file command [arg ...]
+ *
+ * Runs the command with the caller's standard streams and appends one
+ * line to file:
+ *
+ *   status wall_s user_s sys_s max_rss_kb read_syscalls write_syscalls
+ *
+ * The syscall counts are the read- and write-type calls (syscr and syscw)
+ * of /proc/<pid>/io, read while the finished child is still a zombie;
+ * open, stat, mkdir, close and the like are in neither.  They are -1
+ * where /proc/<pid>/io is not available.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static double timeval_s(const struct timeval *tv) {
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+/* Read syscall counters of a finished but unreaped child */
+static void proc_io(pid_t pid, long long *syscr, long long *syscw) {
+    char path[64];
+    char line[128];
+    *syscr = -1;
+    *syscw = -1;
+    snprintf(path, sizeof(path), "/proc/%ld/io", (long)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "syscr: %lld", syscr);
+        sscanf(line, "syscw: %lld", syscw);
+    }
+    fclose(f);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s file command [arg ...]\n", argv[0]);
+        return 2;
+    }
+    FILE *out = fopen(argv[1], "a");
+    if (!out) {
+        fprintf(stderr, "Failed to open results file: %s\n", argv[1]);
+        return 2;
+    }
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Failed to start: %s\n", argv[2]);
+        return 2;
+    }
+    if (pid == 0) {
+        execvp(argv[2], argv + 2);
+        fprintf(stderr, "Failed to run: %s\n", argv[2]);
+        _exit(127);
+    }
+    
+    long long syscr = -1, syscw = -1;
+    bool ended = false;
+#ifdef WNOWAIT
+    /* Wait without reaping, so /proc still has the child's counters */
+    siginfo_t info;
+    if (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOWAIT) == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        ended = true;
+        proc_io(pid, &syscr, &syscw);
+    }
+#endif
+    int status;
+    if (waitpid(pid, &status, 0) != pid) {
+        fprintf(stderr, "Failed to wait for: %s\n", argv[2]);
+        return 2;
+    }
+    if (!ended) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+    }
+    
+    /* The command is our only child, so the children's totals are its own */
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    long max_rss = (long)ru.ru_maxrss;
+#ifdef __APPLE__
+    max_rss /= 1024;
+#endif
+    
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    double wall = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(out, "%d %.6f %.6f %.6f %ld %lld %lld\n", code, wall,
+            timeval_s(&ru.ru_utime), timeval_s(&ru.ru_stime), max_rss, syscr, syscw);
+    fclose(out);
+    return code;
+}
@@ -0,0 +1,171 @@
+/*
+ * serve-client - send one request to a br_ar --serve socket
+ *
+ * Copyright (C) 2025  Torrekie <me@torrekie.dev>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: serve-client [-n count] socket l|s|r archive [member]
+ *
+ * Sends the request count times on one connection and writes the last
+ * response body to stdout ('s' as "index offset size").  Exits 1 with the
+ * error text on stderr if the server reports a failure, and 2 if the
+ * socket cannot be used; 77 where Unix domain sockets are not available.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_SYS_UN_H)
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    long count = 1;
+    int arg = 1;
+    if (argc > 2 && strcmp(argv[1], "-n") == 0) {
+        count = atol(argv[2]);
+        arg = 3;
+    }
+    if (argc - arg < 3 || argc - arg > 4 || count < 1) {
+        fprintf(stderr, "Usage: %s [-n count] socket l|s|r archive [member]\n", argv[0]);
+        return 2;
+    }
+    const char *socket_path = argv[arg];
+    const char *archive = argv[arg + 2];
+    const char *member = argc - arg == 4 ? argv[arg + 3] : "";
+    
+    size_t archive_len = strlen(archive);
+    size_t member_len = strlen(member);
+    size_t len = 1 + archive_len + 1 + member_len;
+    uint8_t *req = malloc(4 + len);
+    if (!req) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 2;
+    }
+    put_le32(req, (uint32_t)len);
+    req[4] = (uint8_t)argv[arg + 1][0];
+    memcpy(req + 5, archive, archive_len + 1);
+    memcpy(req + 6 + archive_len, member, member_len);
+    
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Failed to connect: %s\n", socket_path);
+        return 2;
+    }
+    
+    uint8_t header[8];
+    uint8_t *body = NULL;
+    uint32_t status = 0;
+    uint32_t body_len = 0;
+    long i;
+    for (i = 0; i < count; i++) {
+        if (write_full(fd, req, 4 + len) != 0 || read_full(fd, header, sizeof(header)) != 0) {
+            fprintf(stderr, "Connection closed by server\n");
+            return 2;
+        }
+        status = get_le32(header);
+        body_len = get_le32(header + 4);
+        free(body);
+        body = malloc((size_t)body_len + 1);
+        if (!body || read_full(fd, body, body_len) != 0) {
+            fprintf(stderr, "Connection closed by server\n");
+            return 2;
+        }
+    }
+    close(fd);
+    
+    if (status != 0) {
+        fprintf(stderr, "%.*s\n", (int)body_len, (const char *)body);
+        return 1;
+    }
+    if (req[4] == 's' && body_len == 12) {
+        printf("%lu %lu %lu\n", (unsigned long)get_le32(body), (unsigned long)get_le32(body + 4),
+               (unsigned long)get_le32(body + 8));
+    } else {
+        fwrite(body, 1, body_len, stdout);
+    }
+    free(body);
+    free(req);
+    return 0;
+}
+
+#else
+int main(void) {
+    fprintf(stderr, "Unix domain sockets are not available\n");
+    return 77;
+}
+#endif